@@ -15,6 +15,7 @@
 #include "../common/filter.h"
 
 #define TO_BE_CONTINUED  1
+#define INCOMPRESSIBLE   2
 
 class CountFilter : public Filter {
 private:
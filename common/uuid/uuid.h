@@ -80,8 +80,13 @@ struct UUID {
         return (memcmp(&uuid_, &b.uuid_, sizeof uuid_) < 0);
     }
 
+    bool operator==(const UUID &b) const {
+        return (memcmp(&uuid_, &b.uuid_, sizeof uuid_) == 0);
+    }
+
     bool is_valid() const {
         uuid_t u;
+        memset(&u, 0, sizeof u);
         return (memcmp(&uuid_, &u, sizeof uuid_) != 0);
     }
 };
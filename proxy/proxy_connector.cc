@@ -58,6 +58,8 @@ ProxyConnector::ProxyConnector(const std::string &name,
           is_ssh_(ssh),
           request_chain_(this),
           response_chain_(this),
+          request_encoder_(0),
+          response_encoder_(0),
           connect_action_(0),
           stop_action_(0),
           request_action_(0),
@@ -145,6 +147,7 @@ bool ProxyConnector::build_chains(WANProxyCodec *cdc1, WANProxyCodec *cdc2, Sock
             request_chain_.append((dec = new DecodeFilter("/wanproxy/" + cdc1->name_ + "/dec", cdc1)));
             response_chain_.prepend((enc = new EncodeFilter("/wanproxy/" + cdc1->name_ + "/enc", cdc1, 1)));
             dec->set_upstream(enc);
+            response_encoder_ = enc;
         }
 
         if (cdc1->counting_) {
@@ -165,6 +168,7 @@ bool ProxyConnector::build_chains(WANProxyCodec *cdc1, WANProxyCodec *cdc2, Sock
             request_chain_.append((enc = new EncodeFilter("/wanproxy/" + cdc2->name_ + "/enc", cdc2)));
             response_chain_.prepend((dec = new DecodeFilter("/wanproxy/" + cdc2->name_ + "/dec", cdc2)));
             dec->set_upstream(enc);
+            request_encoder_ = enc;
         }
 
         if (cdc2->compressor_) {
@@ -199,9 +203,13 @@ void ProxyConnector::on_request_data(Event e) {
 
     switch (e.type_) {
         case Event::Done:
-            request_action_ = local_socket_->read(callback(this, &ProxyConnector::on_request_data));
-            if (request_chain_.consume(e.buffer_))
+            if (request_chain_.consume(e.buffer_)) {
+                if (request_encoder_ && request_encoder_->paused())
+                    request_encoder_->on_resume(callback(this, &ProxyConnector::on_request_resume));
+                else
+                    request_action_ = local_socket_->read(callback(this, &ProxyConnector::on_request_data));
                 break;
+            }
         case Event::EOS:
             DEBUG(log_) << "Flushing request";
             flushing_ |= REQUEST_CHAIN_FLUSHING;
@@ -222,9 +230,13 @@ void ProxyConnector::on_response_data(Event e) {
 
     switch (e.type_) {
         case Event::Done:
-            response_action_ = remote_socket_->read(callback(this, &ProxyConnector::on_response_data));
-            if (response_chain_.consume(e.buffer_))
+            if (response_chain_.consume(e.buffer_)) {
+                if (response_encoder_ && response_encoder_->paused())
+                    response_encoder_->on_resume(callback(this, &ProxyConnector::on_response_resume));
+                else
+                    response_action_ = remote_socket_->read(callback(this, &ProxyConnector::on_response_data));
                 break;
+            }
         case Event::EOS:
             DEBUG(log_) << "Flushing response";
             flushing_ |= RESPONSE_CHAIN_FLUSHING;
@@ -237,6 +249,20 @@ void ProxyConnector::on_response_data(Event e) {
     }
 }
 
+/*
+ * Reading stops while the peer of the encoder has the stream paused, and
+ * goes on from here once it resumes it.
+ */
+void ProxyConnector::on_request_resume(Event e) {
+    if (!(flushing_ & REQUEST_CHAIN_FLUSHING) && !request_action_)
+        request_action_ = local_socket_->read(callback(this, &ProxyConnector::on_request_data));
+}
+
+void ProxyConnector::on_response_resume(Event e) {
+    if (!(flushing_ & RESPONSE_CHAIN_FLUSHING) && !response_action_)
+        response_action_ = remote_socket_->read(callback(this, &ProxyConnector::on_response_data));
+}
+
 void ProxyConnector::flush(int flg) {
     flushing_ |= flg;
     if ((flushing_ & (REQUEST_CHAIN_READY | RESPONSE_CHAIN_READY)) == (REQUEST_CHAIN_READY | RESPONSE_CHAIN_READY))
@@ -47,6 +47,8 @@
 //                                                                            //
 ////////////////////////////////////////////////////////////////////////////////
 
+class EncodeFilter;
+
 class ProxyConnector : public Filter {
     LogHandle log_;
     WANProxyCodec *local_codec_;
@@ -56,6 +58,8 @@ class ProxyConnector : public Filter {
     bool is_cln_, is_ssh_;
     FilterChain request_chain_;
     FilterChain response_chain_;
+    EncodeFilter *request_encoder_;
+    EncodeFilter *response_encoder_;
     Action *connect_action_;
     Action *stop_action_;
     Action *request_action_;
@@ -77,6 +81,10 @@ public:
 
     void on_response_data(Event e);
 
+    void on_request_resume(Event e);
+
+    void on_response_resume(Event e);
+
     virtual void flush(int flg);
 
     void conclude(Event e);
@@ -16,6 +16,7 @@
 #include "../xcodec/xcodec.h"
 #include "../xcodec/xcodec_cache.h"
 #include "../xcodec/cache/coss/xcodec_cache_coss.h"
+#include "../xcodec/cache/coss/xcodec_cache_mapped.h"
 #include "./wanproxy_codec.h"
 #include "./wanproxy_config.h"
 #include "./wanproxy_config_type_codec.h"
@@ -96,14 +97,19 @@ public:
                                    prx.proxy_client_, prx.proxy_secure_);
     }
 
-    XCodecCache *add_cache(WANProxyConfigCache type, std::string &path, size_t size, UUID &uuid) {
+    XCodecCache *add_cache(WANProxyConfigCache type, std::string &path, size_t size, UUID &uuid,
+                           unsigned family = XCODEC_HASH_FAMILY_LEGACY,
+                           unsigned segment_length = XCODEC_SEGMENT_LENGTH) {
         XCodecCache *cache = 0;
         switch (type) {
             case WANProxyConfigCacheMemory:
-                cache = new XCodecMemoryCache(uuid, size);
+                cache = new XCodecMemoryCache(uuid, size, family, segment_length);
                 break;
             case WANProxyConfigCacheCOSS:
-                cache = new XCodecCacheCOSS(uuid, path, size);
+                cache = new XCodecCacheCOSS(uuid, path, size, family, segment_length);
+                break;
+            case WANProxyConfigCacheMapped:
+                cache = new XCodecCacheMapped(uuid, path, size, family, segment_length);
                 break;
         }
         ASSERT("/xcodec/cache", caches_.find(uuid) == caches_.end());
@@ -112,6 +118,13 @@ public:
         return cache;
     }
 
+    /*
+     * Every cache held, ours and the copies of those of other sides.
+     */
+    const std::map<UUID, XCodecCache *> &caches(void) const {
+        return caches_;
+    }
+
     XCodecCache *find_cache(UUID uuid) {
         std::map<UUID, XCodecCache *>::const_iterator it = caches_.find(uuid);
         if (it != caches_.end())
@@ -143,6 +156,11 @@ public:
             INFO("wanproxy/core") << "Local codec request output bytes:   " << prx.local_codec_.request_output_bytes_;
             INFO("wanproxy/core") << "Local codec response input bytes:   " << prx.local_codec_.response_input_bytes_;
             INFO("wanproxy/core") << "Local codec response output bytes:  " << prx.local_codec_.response_output_bytes_;
+            if (prx.local_codec_.xcache_)
+                INFO("wanproxy/core") << "Local codec encoder: " << prx.local_codec_.encoder_stats_;
+            if (prx.local_codec_.bypass_)
+                INFO("wanproxy/core") << "Local codec bypassed bytes:        " << prx.local_codec_.bypassed_bytes_ <<
+                                         " in " << prx.local_codec_.bypass_regions_ << " regions";
         }
 
         if (prx.remote_codec_.counting_) {
@@ -150,6 +168,11 @@ public:
             INFO("wanproxy/core") << "Remote codec request output bytes:  " << prx.remote_codec_.request_output_bytes_;
             INFO("wanproxy/core") << "Remote codec response input bytes:  " << prx.remote_codec_.response_input_bytes_;
             INFO("wanproxy/core") << "Remote codec response output bytes: " << prx.remote_codec_.response_output_bytes_;
+            if (prx.remote_codec_.xcache_)
+                INFO("wanproxy/core") << "Remote codec encoder: " << prx.remote_codec_.encoder_stats_;
+            if (prx.remote_codec_.bypass_)
+                INFO("wanproxy/core") << "Remote codec bypassed bytes:       " << prx.remote_codec_.bypassed_bytes_ <<
+                                         " in " << prx.remote_codec_.bypass_regions_ << " regions";
         }
     }
 };
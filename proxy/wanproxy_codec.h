@@ -29,6 +29,7 @@
 #include "./wanproxy_config_type_codec.h"
 #include "./wanproxy_config_type_compressor.h"
 #include "../xcodec/xcodec_cache.h"
+#include "../xcodec/xcodec_encoder.h"
 
 ////////////////////////////////////////////////////////////////////////////////
 //                                                                            //
@@ -47,26 +48,47 @@ struct WANProxyCodec {
     size_t cache_size_;
     UUID cache_uuid_;
     XCodecCache *xcache_;
+    XCodecCache *pass_cache_;
+    unsigned xcodec_options_;
+    unsigned lookup_sample_bits_;
+    unsigned lookup_budget_;
     bool compressor_;
     char compressor_level_;
     bool counting_;
+    bool eviction_notices_;
+    bool negotiate_;
+    bool bypass_;
+    size_t flow_window_;
     intmax_t request_input_bytes_;
     intmax_t request_output_bytes_;
     intmax_t response_input_bytes_;
     intmax_t response_output_bytes_;
+    XCodecEncoderStats encoder_stats_;
+    intmax_t bypassed_bytes_;
+    intmax_t bypass_regions_;
 
     WANProxyCodec(void)
             : name_(""),
               cache_type_(WANProxyConfigCacheMemory),
               cache_size_(0),
               xcache_(NULL),
+              pass_cache_(NULL),
+              xcodec_options_(0),
+              lookup_sample_bits_(0),
+              lookup_budget_(0),
               compressor_(false),
               compressor_level_(0),
               counting_(false),
+              eviction_notices_(false),
+              negotiate_(false),
+              bypass_(false),
+              flow_window_(0),
               request_input_bytes_(0),
               request_output_bytes_(0),
               response_input_bytes_(0),
-              response_output_bytes_(0) {}
+              response_output_bytes_(0),
+              bypassed_bytes_(0),
+              bypass_regions_(0) {}
 };
 
 #endif /* !PROGRAMS_WANPROXY_WANPROXY_CODEC_H */
@@ -49,6 +49,7 @@ bool
 WANProxyConfigClassCodec::Instance::activate(const ConfigObject *co) {
     UUID uuid;
     XCodecCache *cache;
+    unsigned family;
 
     codec_.name_ = co->name_;
 
@@ -67,14 +68,138 @@ WANProxyConfigClassCodec::Instance::activate(const ConfigObject *co) {
                 }
             }
 
+            /*
+             * Segments named by another hash family go in a cache of
+             * their own, and only a peer told so in <HELLO> can find
+             * them.
+             */
+            switch (hash_family_) {
+                case WANProxyConfigHashFamilyLegacy:
+                    family = XCODEC_HASH_FAMILY_LEGACY;
+                    break;
+                case WANProxyConfigHashFamilyPolynomial:
+                    family = XCODEC_HASH_FAMILY_POLYNOMIAL;
+                    break;
+                default:
+                    ERROR("/wanproxy/config/codec") << "Invalid hash family.";
+                    return (false);
+            }
+            uuid = XCodecCache::family_identifier(uuid, family);
+
+            if (segment_length_ < 0 || !XCODEC_SEGMENT_LENGTH_VALID((uintmax_t) segment_length_)) {
+                ERROR("/wanproxy/config/codec") << "Segment length must be 512, 1024 or 2048.";
+                return (false);
+            }
+            uuid = XCodecCache::length_identifier(uuid, (unsigned) segment_length_);
+
             codec_.cache_type_ = cache_type_;
             codec_.cache_path_ = cache_path_;
             codec_.cache_size_ = local_size_;
             codec_.cache_uuid_ = uuid;
 
             if (!(cache = wanproxy.find_cache(uuid)))
-                cache = wanproxy.add_cache(cache_type_, cache_path_, local_size_, uuid);
+                cache = wanproxy.add_cache(cache_type_, cache_path_, local_size_, uuid, family,
+                                           (unsigned) segment_length_);
             codec_.xcache_ = cache;
+
+            switch (chunking_) {
+                case WANProxyConfigChunkingFixed:
+                    break;
+                case WANProxyConfigChunkingContent:
+                    codec_.xcodec_options_ |= XCODEC_OPTION_CHUNKING;
+                    break;
+                default:
+                    ERROR("/wanproxy/config/codec") << "Invalid chunking type.";
+                    return (false);
+            }
+
+            if (lookup_sample_bits_ < 0 || lookup_sample_bits_ > 10) {
+                ERROR("/wanproxy/config/codec") << "Lookup sample bits must be in range 0..10 (inclusive.)";
+                return (false);
+            }
+            if (lookup_budget_ < 0 || lookup_budget_ > 1024) {
+                ERROR("/wanproxy/config/codec") << "Lookup budget must be in range 0..1024 (inclusive.)";
+                return (false);
+            }
+            codec_.lookup_sample_bits_ = (unsigned) lookup_sample_bits_;
+            codec_.lookup_budget_ = (unsigned) lookup_budget_;
+
+            if (reference_runs_ < 0 || reference_runs_ > 1) {
+                ERROR("/wanproxy/config/codec") << "Reference runs must be 0 or 1.";
+                return (false);
+            }
+            if (reference_runs_)
+                codec_.xcodec_options_ |= XCODEC_OPTION_RUNS;
+
+            if (delta_encoding_ < 0 || delta_encoding_ > 1) {
+                ERROR("/wanproxy/config/codec") << "Delta encoding must be 0 or 1.";
+                return (false);
+            }
+            if (delta_encoding_)
+                codec_.xcodec_options_ |= XCODEC_OPTION_DELTA;
+
+            if (superchunks_ < 0 || superchunks_ > 1) {
+                ERROR("/wanproxy/config/codec") << "Superchunks must be 0 or 1.";
+                return (false);
+            }
+            if (superchunks_ && !reference_runs_) {
+                ERROR("/wanproxy/config/codec") << "Superchunks need reference runs.";
+                return (false);
+            }
+            if (superchunks_)
+                codec_.xcodec_options_ |= XCODEC_OPTION_SUPER;
+
+            if (peer_references_ < 0 || peer_references_ > 1) {
+                ERROR("/wanproxy/config/codec") << "Peer references must be 0 or 1.";
+                return (false);
+            }
+            if (peer_references_)
+                codec_.xcodec_options_ |= XCODEC_OPTION_PEER;
+
+            if (shared_namespaces_ < 0 || shared_namespaces_ > 1) {
+                ERROR("/wanproxy/config/codec") << "Shared namespaces must be 0 or 1.";
+                return (false);
+            }
+            if (shared_namespaces_)
+                codec_.xcodec_options_ |= XCODEC_OPTION_SHARED;
+
+            if (second_pass_ < 0 || second_pass_ > 1) {
+                ERROR("/wanproxy/config/codec") << "Second pass must be 0 or 1.";
+                return (false);
+            }
+            codec_.pass_cache_ = 0;
+            if (second_pass_) {
+                UUID pass_uuid = XCodecCache::pass_identifier(uuid);
+                if (!(cache = wanproxy.find_cache(pass_uuid)))
+                    cache = wanproxy.add_cache(cache_type_, cache_path_, local_size_, pass_uuid, family,
+                                               (unsigned) segment_length_);
+                codec_.pass_cache_ = cache;
+            }
+
+            if (eviction_notices_ < 0 || eviction_notices_ > 1) {
+                ERROR("/wanproxy/config/codec") << "Eviction notices must be 0 or 1.";
+                return (false);
+            }
+            codec_.eviction_notices_ = (eviction_notices_ != 0);
+
+            if (negotiate_ < 0 || negotiate_ > 1) {
+                ERROR("/wanproxy/config/codec") << "Negotiate must be 0 or 1.";
+                return (false);
+            }
+            codec_.negotiate_ = (negotiate_ != 0 || family != XCODEC_HASH_FAMILY_LEGACY ||
+                                 segment_length_ != XCODEC_SEGMENT_LENGTH || eviction_notices_ != 0);
+
+            if (bypass_ < 0 || bypass_ > 1) {
+                ERROR("/wanproxy/config/codec") << "Bypass must be 0 or 1.";
+                return (false);
+            }
+            codec_.bypass_ = (bypass_ != 0);
+
+            if (flow_window_ < 0 || flow_window_ > 65536) {
+                ERROR("/wanproxy/config/codec") << "Flow window must be in range 0..65536 KB (inclusive.)";
+                return (false);
+            }
+            codec_.flow_window_ = (size_t) flow_window_ * 1024;
             break;
         case WANProxyConfigCodecNone:
             codec_.xcache_ = 0;
@@ -56,6 +56,21 @@ public:
         std::string cache_path_;
         intmax_t local_size_;
         intmax_t remote_size_;
+        WANProxyConfigChunking chunking_;
+        WANProxyConfigHashFamily hash_family_;
+        intmax_t segment_length_;
+        intmax_t lookup_sample_bits_;
+        intmax_t lookup_budget_;
+        intmax_t reference_runs_;
+        intmax_t delta_encoding_;
+        intmax_t superchunks_;
+        intmax_t peer_references_;
+        intmax_t shared_namespaces_;
+        intmax_t second_pass_;
+        intmax_t eviction_notices_;
+        intmax_t negotiate_;
+        intmax_t bypass_;
+        intmax_t flow_window_;
 
         Instance(void)
                 : codec_type_(WANProxyConfigCodecNone),
@@ -64,7 +79,22 @@ public:
                   byte_counts_(0),
                   cache_type_(WANProxyConfigCacheMemory),
                   local_size_(0),
-                  remote_size_(0) {
+                  remote_size_(0),
+                  chunking_(WANProxyConfigChunkingFixed),
+                  hash_family_(WANProxyConfigHashFamilyLegacy),
+                  segment_length_(XCODEC_SEGMENT_LENGTH),
+                  lookup_sample_bits_(0),
+                  lookup_budget_(0),
+                  reference_runs_(0),
+                  delta_encoding_(0),
+                  superchunks_(0),
+                  peer_references_(0),
+                  shared_namespaces_(0),
+                  second_pass_(0),
+                  eviction_notices_(0),
+                  negotiate_(0),
+                  bypass_(0),
+                  flow_window_(0) {
         }
 
         bool activate(const ConfigObject *);
@@ -81,6 +111,21 @@ public:
         add_member("cache_path", &config_type_string, &Instance::cache_path_);
         add_member("local_size", &config_type_int, &Instance::local_size_);
         add_member("remote_size", &config_type_int, &Instance::remote_size_);
+        add_member("chunking", &wanproxy_config_type_chunking, &Instance::chunking_);
+        add_member("hash_family", &wanproxy_config_type_hash_family, &Instance::hash_family_);
+        add_member("segment_length", &config_type_int, &Instance::segment_length_);
+        add_member("lookup_sample_bits", &config_type_int, &Instance::lookup_sample_bits_);
+        add_member("lookup_budget", &config_type_int, &Instance::lookup_budget_);
+        add_member("reference_runs", &config_type_int, &Instance::reference_runs_);
+        add_member("delta_encoding", &config_type_int, &Instance::delta_encoding_);
+        add_member("superchunks", &config_type_int, &Instance::superchunks_);
+        add_member("peer_references", &config_type_int, &Instance::peer_references_);
+        add_member("shared_namespaces", &config_type_int, &Instance::shared_namespaces_);
+        add_member("second_pass", &config_type_int, &Instance::second_pass_);
+        add_member("eviction_notices", &config_type_int, &Instance::eviction_notices_);
+        add_member("negotiate", &config_type_int, &Instance::negotiate_);
+        add_member("bypass", &config_type_int, &Instance::bypass_);
+        add_member("flow_window", &config_type_int, &Instance::flow_window_);
     }
 
     ~WANProxyConfigClassCodec() {}
@@ -37,8 +37,27 @@ WANProxyConfigTypeCodec
 static struct WANProxyConfigTypeCache::Mapping wanproxy_config_type_cache_map[] = {
         {"Memory", WANProxyConfigCacheMemory},
         {"COSS",   WANProxyConfigCacheCOSS},
+        {"Mapped", WANProxyConfigCacheMapped},
         {NULL,     WANProxyConfigCacheMemory}
 };
 
 WANProxyConfigTypeCache
         wanproxy_config_type_cache("cache", wanproxy_config_type_cache_map);
+
+static struct WANProxyConfigTypeChunking::Mapping wanproxy_config_type_chunking_map[] = {
+        {"Fixed",   WANProxyConfigChunkingFixed},
+        {"Content", WANProxyConfigChunkingContent},
+        {NULL,      WANProxyConfigChunkingFixed}
+};
+
+WANProxyConfigTypeChunking
+        wanproxy_config_type_chunking("chunking", wanproxy_config_type_chunking_map);
+
+static struct WANProxyConfigTypeHashFamily::Mapping wanproxy_config_type_hash_family_map[] = {
+        {"Legacy",     WANProxyConfigHashFamilyLegacy},
+        {"Polynomial", WANProxyConfigHashFamilyPolynomial},
+        {NULL,         WANProxyConfigHashFamilyLegacy}
+};
+
+WANProxyConfigTypeHashFamily
+        wanproxy_config_type_hash_family("hash_family", wanproxy_config_type_hash_family_map);
@@ -39,12 +39,31 @@ extern WANProxyConfigTypeCodec wanproxy_config_type_codec;
 
 enum WANProxyConfigCache {
     WANProxyConfigCacheMemory,
-    WANProxyConfigCacheCOSS
+    WANProxyConfigCacheCOSS,
+    WANProxyConfigCacheMapped
 };
 
 typedef ConfigTypeEnum<WANProxyConfigCache> WANProxyConfigTypeCache;
 
 extern WANProxyConfigTypeCache wanproxy_config_type_cache;
 
+enum WANProxyConfigChunking {
+    WANProxyConfigChunkingFixed,
+    WANProxyConfigChunkingContent
+};
+
+typedef ConfigTypeEnum<WANProxyConfigChunking> WANProxyConfigTypeChunking;
+
+extern WANProxyConfigTypeChunking wanproxy_config_type_chunking;
+
+enum WANProxyConfigHashFamily {
+    WANProxyConfigHashFamilyLegacy,
+    WANProxyConfigHashFamilyPolynomial
+};
+
+typedef ConfigTypeEnum<WANProxyConfigHashFamily> WANProxyConfigTypeHashFamily;
+
+extern WANProxyConfigTypeHashFamily wanproxy_config_type_hash_family;
+
 #endif /* !PROGRAMS_WANPROXY_WANPROXY_CONFIG_TYPE_CODEC_H */
 
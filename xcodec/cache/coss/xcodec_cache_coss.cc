@@ -12,9 +12,14 @@
  */
 
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 
+#include <algorithm>
+
 #include "./xcodec_cache_coss.h"
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -27,9 +32,181 @@
 //                                                                            //
 ////////////////////////////////////////////////////////////////////////////////
 
+static bool
+coss_read(int fd, void *data, size_t size, uint64_t position)
+{
+    size_t n = 0;
+    ssize_t len;
+
+    while (n < size) {
+        len = ::pread(fd, (uint8_t *) data + n, size - n, position + n);
+        if (len < 0 && errno == EINTR)
+            continue;
+        if (len <= 0)
+            return (false);
+        n += len;
+    }
+    return (true);
+}
+
+static bool
+coss_write(int fd, const void *data, size_t size, uint64_t position)
+{
+    size_t n = 0;
+    ssize_t len;
+
+    while (n < size) {
+        len = ::pwrite(fd, (const uint8_t *) data + n, size - n, position + n);
+        if (len < 0 && errno == EINTR)
+            continue;
+        if (len <= 0)
+            return (false);
+        n += len;
+    }
+    return (true);
+}
+
+/*
+ * The snapshot is summed a block at a time, whatever it is written or read
+ * in.
+ */
+static uint64_t
+coss_snapshot_sum(uint64_t sum, const uint8_t *data, size_t size)
+{
+    return ((sum ^ XCodecFingerprint::compute(data, size)) * 0x9e3779b185ebca87ull);
+}
+
+class COSSSnapshotWriter {
+    int fd_;
+    uint64_t position_;
+    uint8_t block_[SNAPSHOT_BLOCK];
+    size_t fill_;
+
+public:
+    uint64_t sum_;
+    bool ok_;
+
+    COSSSnapshotWriter(int fd)
+            : fd_(fd),
+              position_(sizeof(COSSSnapshotHeader)),
+              fill_(0),
+              sum_(0),
+              ok_(true) {}
+
+    void append(const void *data, size_t size) {
+        const uint8_t *p = (const uint8_t *) data;
+        size_t n;
+
+        while (size > 0) {
+            n = std::min(size, sizeof block_ - fill_);
+            memcpy(block_ + fill_, p, n);
+            fill_ += n, p += n, size -= n;
+            if (fill_ == sizeof block_)
+                flush();
+        }
+    }
+
+    void flush() {
+        if (fill_ == 0)
+            return;
+        sum_ = coss_snapshot_sum(sum_, block_, fill_);
+        ok_ = ok_ && coss_write(fd_, block_, fill_, position_);
+        position_ += fill_;
+        fill_ = 0;
+    }
+};
+
+/*
+ * The snapshot is taken on the event loop, into memory, and written by the
+ * I/O thread after the stripes queued before it, which the index it was
+ * taken of refers to.  Only then is the journal started again, by the same
+ * thread that adds to it.
+ */
+class COSSSnapshotTask : public COSSIoTask {
+    std::string path_;
+    std::string journal_path_;
+    int journal_fd_;
+    LogHandle log_;
+
+public:
+    COSSSnapshotHeader header_;
+    std::vector<uint8_t> body_;
+
+    COSSSnapshotTask(const std::string &path, const std::string &journal_path, int journal_fd)
+            : path_(path),
+              journal_path_(journal_path),
+              journal_fd_(journal_fd),
+              log_("xcodec/cache/coss"),
+              header_(),
+              body_() {}
+
+    void perform() {
+        std::string path = path_ + ".new";
+        int fd;
+
+        if ((fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+            ERROR(log_) << "Could not create index snapshot " << path << ": " << strerror(errno);
+            return;
+        }
+
+        COSSSnapshotWriter writer(fd);
+        writer.append(body_.data(), body_.size());
+        writer.flush();
+        header_.sum = writer.sum_;
+
+        if (!writer.ok_ || !coss_write(fd, &header_, sizeof header_, 0)) {
+            ERROR(log_) << "Could not write index snapshot " << path << ": " << strerror(errno);
+            ::close(fd);
+            ::unlink(path.c_str());
+            return;
+        }
+        ::close(fd);
+
+        if (::rename(path.c_str(), path_.c_str()) != 0) {
+            ERROR(log_) << "Could not rename index snapshot " << path << ": " << strerror(errno);
+            ::unlink(path.c_str());
+            return;
+        }
+        if (::ftruncate(journal_fd_, 0) != 0) {
+            ERROR(log_) << "Could not truncate journal " << journal_path_ << ": " << strerror(errno);
+            ::unlink(path_.c_str());
+            return;
+        }
+
+        DEBUG(log_) << "Wrote index snapshot of " << header_.entry_count << " segments";
+    }
+};
+
+/*
+ * A stripe not in the journal would be taken to be as in the snapshot, so
+ * the snapshot goes if the journal cannot be kept.
+ */
+class COSSJournalTask : public COSSIoTask {
+    std::string snapshot_path_;
+    std::string journal_path_;
+    int journal_fd_;
+    uint64_t range_;
+    LogHandle log_;
+
+public:
+    COSSJournalTask(const std::string &snapshot_path, const std::string &journal_path, int journal_fd, uint64_t range)
+            : snapshot_path_(snapshot_path),
+              journal_path_(journal_path),
+              journal_fd_(journal_fd),
+              range_(range),
+              log_("xcodec/cache/coss") {}
+
+    void perform() {
+        if (journal_fd_ >= 0 && ::write(journal_fd_, &range_, sizeof range_) == (ssize_t) sizeof range_)
+            return;
+        if (::unlink(snapshot_path_.c_str()) == 0)
+            ERROR(log_) << "Could not add to journal " << journal_path_ << ", index snapshot discarded";
+    }
+};
 
-XCodecCacheCOSS::XCodecCacheCOSS(const UUID &uuid, const std::string &cache_dir, size_t cache_size)
-        : XCodecCache(uuid, cache_size),
+XCodecCacheCOSS::XCodecCacheCOSS(const UUID &uuid, const std::string &cache_dir, size_t cache_size,
+                                 unsigned family, unsigned segment_length)
+        : XCodecCache(uuid, cache_size, family, segment_length),
           log_("xcodec/cache/coss") {
     uint8_t str[UUID_STRING_SIZE + 1];
     uuid.to_string(str);
@@ -37,15 +214,25 @@ XCodecCacheCOSS::XCodecCacheCOSS(const UUID &uuid, const std::string &cache_dir,
     if (file_path_.size() > 0 && file_path_[file_path_.size() - 1] != '/')
         file_path_.append("/");
     file_path_.append((const char *) str, UUID_STRING_SIZE);
+    snapshot_path_ = file_path_ + ".wpi";
+    journal_path_ = file_path_ + ".wpj";
     file_path_.append(".wpc");
 
     struct stat st;
     if (::stat(file_path_.c_str(), &st) == 0 && (st.st_mode & S_IFREG))
         file_size_ = st.st_size;
-    else {
-        ofstream tmp(file_path_.c_str());
+    else
         file_size_ = 0;
-    }
+
+    fd_ = ::open(file_path_.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd_ < 0)
+        ERROR(log_) << "Could not open cache file " << file_path_ << ": " << strerror(errno);
+    io_ = new COSSIoThread(fd_);
+    io_->start();
+    read_action_ = 0;
+    journal_fd_ = ::open(journal_path_.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (journal_fd_ < 0)
+        ERROR(log_) << "Could not open journal " << journal_path_ << ": " << strerror(errno);
 
     serial_number_ = 0;
     stripe_range_ = 0;
@@ -53,20 +240,33 @@ XCodecCacheCOSS::XCodecCacheCOSS(const UUID &uuid, const std::string &cache_dir,
         cache_size = CACHE_BASIC_SIZE;
     uint64_t size = ROUND_UP((uint64_t) cache_size * 1048576, sizeof(COSSStripe));
     stripe_limit_ = size / sizeof(COSSStripe);
+    snapshot_due_ = std::max<uint64_t>(stripe_limit_ / SNAPSHOT_FRACTION, 1);
     freshness_level_ = 0;
+    memset(loading_, 0, sizeof loading_);
+    fetching_ = 0;
     active_ = 0;
+    next_ = -1;
+    next_range_ = 0;
 
     directory_ = new COSSMetadata[stripe_limit_];
     memset(directory_, 0, sizeof(COSSMetadata) * stripe_limit_);
 
-    if (stream_.rdbuf())
-        stream_.rdbuf()->pubsetbuf(0, 0);
+    filter_.resize(stripe_limit_ * STRIPE_SEGMENT_COUNT);
+    cache_index_.reserve(stripe_limit_ * STRIPE_SEGMENT_COUNT);
 
-    stream_.open(file_path_.c_str(), fstream::in | fstream::out | fstream::binary);
     if (!read_file()) {
-        stream_.close();
-        stream_.open(file_path_.c_str(), fstream::in | fstream::out | fstream::trunc | fstream::binary);
+        /*
+         * Nothing read from a file that is to be started afresh can stay.
+         */
+        cache_index_.clear();
+        filter_.resize(filter_.capacity());
+        memset(directory_, 0, sizeof(COSSMetadata) * stripe_limit_);
+        if (fd_ >= 0 && ::ftruncate(fd_, 0) != 0)
+            ERROR(log_) << "Could not truncate cache file " << file_path_ << ": " << strerror(errno);
         file_size_ = 0;
+        ::unlink(snapshot_path_.c_str());
+        if (journal_fd_ >= 0 && ::ftruncate(journal_fd_, 0) != 0)
+            ERROR(log_) << "Could not truncate journal " << journal_path_ << ": " << strerror(errno);
         initialize_stripe(stripe_range_, active_);
     }
 
@@ -79,11 +279,24 @@ XCodecCacheCOSS::XCodecCacheCOSS(const UUID &uuid, const std::string &cache_dir,
 }
 
 XCodecCacheCOSS::~XCodecCacheCOSS() {
+    if (read_action_)
+        read_action_->cancel();
+
+    for (int i = 0; i < LOADED_STRIPE_COUNT; ++i)
+        if (loading_[i])
+            finish_stripe(i);
+
     for (int i = 0; i < LOADED_STRIPE_COUNT; ++i)
         if (stripe_[i].header.metadata.state == 1)
             store_stripe(i, (i == active_ ? sizeof(COSSStripe) : sizeof(COSSStripeHeader)));
+    write_snapshot();
 
-    stream_.close();
+    io_->stop();
+    delete io_;
+    if (fd_ >= 0)
+        ::close(fd_);
+    if (journal_fd_ >= 0)
+        ::close(journal_fd_);
 
     delete[] directory_;
 
@@ -91,6 +304,8 @@ XCodecCacheCOSS::~XCodecCacheCOSS() {
     INFO(log_) << "Lookups: " << stats_.lookups;
     INFO(log_) << "Matches: " << (stats_.found_1 + stats_.found_2) << " (" << stats_.found_1 << " + " << stats_.found_2
                << ")";
+    INFO(log_) << "Verified: " << stats_.verified;
+    INFO(log_) << "Filtered: " << stats_.filtered;
     INFO(log_) << "File: " << file_path_;
 
     DEBUG(log_) << "Closing coss file: " << file_path_;
@@ -100,69 +315,278 @@ XCodecCacheCOSS::~XCodecCacheCOSS() {
 }
 
 bool XCodecCacheCOSS::read_file() {
-    COSSStripeHeader header;
-    COSSIndexEntry entry;
     uint64_t serial, range, limit, level;
-    uint64_t hash;
+    bool scanned = false;
 
-    serial = range = limit = level = 0;
+    serial = range = level = 0;
     limit = file_size_ / sizeof(COSSStripe);
     if (limit * sizeof(COSSStripe) != file_size_)
         return false;
     if (limit > stripe_limit_)
         limit = stripe_limit_;
-    stream_.seekg(0);
+
+    if (!read_snapshot(limit)) {
+        cache_index_.clear();
+        memset(directory_, 0, sizeof(COSSMetadata) * stripe_limit_);
+        if (!scan_file(limit))
+            return false;
+        scanned = true;
+    }
+
+    for (uint64_t n = 0; n < limit; ++n) {
+        if (directory_[n].serial_number > serial)
+            serial = directory_[n].serial_number, range = n;
+        if (directory_[n].freshness > level)
+            level = directory_[n].freshness;
+    }
+
+    if (serial > 0) {
+        serial_number_ = serial;
+        stripe_range_ = range;
+        freshness_level_ = level;
+        load_stripe(stripe_range_, active_);
+    } else {
+        initialize_stripe(stripe_range_, active_);
+    }
+
+    /*
+     * So that the next time the headers need not be read.
+     */
+    if (scanned)
+        write_snapshot();
+    return true;
+}
+
+/*
+ * Done before anything else is, so the headers are read here rather than
+ * by the thread.
+ */
+bool XCodecCacheCOSS::scan_file(uint64_t limit) {
+    COSSStripeHeader header;
 
     for (uint64_t n = 0; n < limit; ++n) {
-        stream_.read((char *) &header, sizeof header);
-        if (!stream_.good() || stream_.gcount() != sizeof header)
+        if (!coss_read(fd_, &header, sizeof header, n * sizeof(COSSStripe)))
             return false;
         if (header.metadata.signature != CACHE_SIGNATURE)
             return false;
+        if (header.metadata.version != CACHE_VERSION) {
+            INFO(log_) << "Discarding cache file of version " << header.metadata.version;
+            return false;
+        }
         if (header.metadata.segment_count > STRIPE_SEGMENT_COUNT)
             return false;
-        stream_.seekg(sizeof(COSSStripe) - sizeof header, ios::cur);
 
-        if (header.metadata.serial_number > serial)
-            serial = header.metadata.serial_number, range = n;
-        if (header.metadata.freshness > level)
-            level = header.metadata.freshness;
+        directory_[n] = header.metadata;
+        directory_[n].state = 0;
+        index_stripe(n, header);
+    }
+
+    return true;
+}
+
+/*
+ * The snapshot is read whole, and is stale unless it is of a cache of this
+ * size and sums right.  The stripes written since it was taken are then
+ * read again, and the filter is filled from the index at the end.
+ */
+bool XCodecCacheCOSS::read_snapshot(uint64_t limit) {
+    COSSSnapshotHeader header;
+    const COSSSnapshotEntry *entries;
+    std::vector<uint8_t> body;
+    uint64_t size, sum = 0;
+    struct stat st;
+    bool ok;
+    int fd;
+
+    if ((fd = ::open(snapshot_path_.c_str(), O_RDONLY)) < 0)
+        return false;
+
+    size = 0;
+    ok = (::fstat(fd, &st) == 0 && coss_read(fd, &header, sizeof header, 0) &&
+          header.signature == SNAPSHOT_SIGNATURE && header.version == CACHE_VERSION &&
+          header.stripe_size == sizeof(COSSStripe) && header.stripe_count == stripe_limit_ &&
+          header.file_stripes <= limit);
+    if (ok) {
+        size = header.stripe_count * sizeof(COSSMetadata) + header.entry_count * sizeof(COSSSnapshotEntry);
+        ok = ((uint64_t) st.st_size == sizeof header + size);
+    }
+    if (ok) {
+        body.resize(size);
+        ok = coss_read(fd, body.data(), size, sizeof header);
+    }
+    ::close(fd);
+
+    if (ok) {
+        for (uint64_t off = 0; off < size; off += SNAPSHOT_BLOCK)
+            sum = coss_snapshot_sum(sum, &body[off], std::min<uint64_t>(size - off, SNAPSHOT_BLOCK));
+        ok = (sum == header.sum);
+    }
+    if (!ok) {
+        INFO(log_) << "Index snapshot " << snapshot_path_ << " is stale, reading every stripe header";
+        return false;
+    }
+
+    memcpy(directory_, body.data(), stripe_limit_ * sizeof(COSSMetadata));
+    for (uint64_t n = 0; n < stripe_limit_; ++n)
+        directory_[n].state = 0;
+
+    entries = (const COSSSnapshotEntry *) (body.data() + stripe_limit_ * sizeof(COSSMetadata));
+    cache_index_.reserve(header.entry_count);
+    for (uint64_t i = 0; i < header.entry_count; ++i) {
+        if (entries[i].entry.stripe_range >= limit)
+            return false;
+        cache_index_.insert(entries[i].hash, entries[i].entry);
+    }
+
+    if (!replay_journal(limit)) {
+        INFO(log_) << "Journal " << journal_path_ << " does not match the cache file, reading every stripe header";
+        return false;
+    }
+
+    cache_index_.fill(filter_);
+    DEBUG(log_) << "Read index snapshot of " << cache_index_.size() << " segments";
+    return true;
+}
+
+/*
+ * What the index had of a stripe written since the snapshot is let go of,
+ * so a segment it no longer has is not found in an older stripe either.
+ */
+bool XCodecCacheCOSS::replay_journal(uint64_t limit) {
+    std::vector<bool> written(stripe_limit_, false);
+    std::vector<uint64_t> ranges;
+    COSSStripeHeader header;
+    struct stat st;
+    unsigned count = 0;
+
+    if (journal_fd_ < 0 || ::fstat(journal_fd_, &st) != 0)
+        return false;
+    ranges.resize(st.st_size / sizeof(uint64_t));
+    if (ranges.empty())
+        return true;
+    if (!coss_read(journal_fd_, ranges.data(), ranges.size() * sizeof(uint64_t), 0))
+        return false;
 
+    for (std::vector<uint64_t>::const_iterator it = ranges.begin(); it != ranges.end(); ++it) {
+        if (*it >= limit)
+            return false;
+        written[*it] = true;
+    }
+    cache_index_.erase_stripes(written);
+
+    for (uint64_t n = 0; n < limit; ++n) {
+        if (!written[n])
+            continue;
+        if (!coss_read(fd_, &header, sizeof header, n * sizeof(COSSStripe)) ||
+            header.metadata.signature != CACHE_SIGNATURE || header.metadata.version != CACHE_VERSION ||
+            header.metadata.segment_count > STRIPE_SEGMENT_COUNT)
+            return false;
         directory_[n] = header.metadata;
         directory_[n].state = 0;
+        index_stripe(n, header);
+        count++;
+    }
+
+    DEBUG(log_) << "Read " << count << " stripe headers written since the index snapshot";
+    return true;
+}
 
-        for (int i = 0; i < STRIPE_SEGMENT_COUNT; ++i) {
-            if ((hash = header.hash_array[i])) {
-                entry.stripe_range = n;
-                entry.position = i;
-                cache_index_.insert(hash, entry);
-            }
+/*
+ * Everything in the index is to be in the file by the time the snapshot
+ * is, which the I/O thread sees to by writing it after what is queued.  The
+ * snapshot is written aside and then put in place of the last one, and the
+ * journal is started again.
+ */
+void XCodecCacheCOSS::write_snapshot() {
+    COSSSnapshotEntry entry;
+
+    snapshot_due_ = std::max<uint64_t>(stripe_limit_ / SNAPSHOT_FRACTION, 1);
+    if (fd_ < 0 || journal_fd_ < 0)
+        return;
+
+    /*
+     * The directory is behind for stripes that are loaded.
+     */
+    for (int slot = 0; slot < LOADED_STRIPE_COUNT; ++slot) {
+        if (!loading_[slot] && stripe_[slot].header.metadata.state == 1) {
+            uint64_t range = stripe_[slot].header.metadata.stripe_range;
+            directory_[range] = stripe_[slot].header.metadata;
         }
     }
 
-    if (serial > 0) {
-        serial_number_ = serial;
-        stripe_range_ = range;
-        freshness_level_ = level;
-        load_stripe(stripe_range_, active_);
-    } else {
-        initialize_stripe(stripe_range_, active_);
+    COSSSnapshotTask *task = new COSSSnapshotTask(snapshot_path_, journal_path_, journal_fd_);
+    COSSSnapshotHeader &header = task->header_;
+    memset(&header, 0, sizeof header);
+    header.signature = SNAPSHOT_SIGNATURE;
+    header.version = CACHE_VERSION;
+    header.stripe_size = sizeof(COSSStripe);
+    header.stripe_count = stripe_limit_;
+    header.file_stripes = std::min<uint64_t>(file_size_ / sizeof(COSSStripe), stripe_limit_);
+    header.entry_count = cache_index_.size();
+
+    std::vector<uint8_t> &body = task->body_;
+    size_t off = stripe_limit_ * sizeof(COSSMetadata);
+    body.resize(off + cache_index_.size() * sizeof entry);
+    memcpy(body.data(), directory_, off);
+    memset(&entry, 0, sizeof entry);
+    for (COSSIndex::iterator it = cache_index_.begin(); it != cache_index_.end(); ++it) {
+        entry.hash = it->first;
+        entry.entry = it->second;
+        memcpy(&body[off], &entry, sizeof entry);
+        off += sizeof entry;
     }
 
-    return true;
+    io_->run(task);
+}
+
+void XCodecCacheCOSS::journal(uint64_t range) {
+    io_->run(new COSSJournalTask(snapshot_path_, journal_path_, journal_fd_, range));
+}
+
+void XCodecCacheCOSS::index_stripe(uint64_t range, const COSSStripeHeader &header) {
+    COSSIndexEntry entry;
+    const COSSIndexEntry *other;
+    uint64_t hash;
+
+    for (int i = 0; i < STRIPE_SEGMENT_COUNT; ++i) {
+        if ((hash = header.hash_array[i])) {
+            /*
+             * A segment that was replaced stays in its stripe until the
+             * stripe is purged, and the one that replaced it is in a
+             * stripe started later.
+             */
+            if ((other = cache_index_.lookup(hash)) &&
+                directory_[other->stripe_range].serial_number > header.metadata.serial_number)
+                continue;
+            entry.stripe_range = range;
+            entry.touched = 0;
+            entry.position = i;
+            entry.fingerprint = header.fingerprint_array[i];
+            cache_index_.insert(hash, entry);
+            filter_.insert(hash);
+        }
+    }
 }
 
-void XCodecCacheCOSS::enter(const uint64_t &hash, const Buffer &buf, unsigned off) {
+void XCodecCacheCOSS::enter(const uint64_t &hash, const Buffer &buf, unsigned off, unsigned length) {
     COSSIndexEntry entry;
 
+    ASSERT(log_, length > 0 && length <= XCODEC_SEGMENT_LENGTH);
+
     while (stripe_[active_].header.metadata.segment_index >= STRIPE_SEGMENT_COUNT)
         new_active();
 
     COSSStripe &act = stripe_[active_];
     act.header.hash_array[act.header.metadata.segment_index] = hash;
-    buf.copyout(act.segment_array[act.header.metadata.segment_index].bytes, off, XCODEC_SEGMENT_LENGTH);
+    act.header.flags[act.header.metadata.segment_index] =
+            (length < XCODEC_SEGMENT_LENGTH ? length << SEGMENT_LENGTH_SHIFT : 0);
+    buf.copyout(act.segment_array[act.header.metadata.segment_index].bytes, off, length);
+    act.header.fingerprint_array[act.header.metadata.segment_index] =
+            XCodecFingerprint::compute(act.segment_array[act.header.metadata.segment_index].bytes, length);
     entry.stripe_range = act.header.metadata.stripe_range;
+    entry.touched = 0;
     entry.position = act.header.metadata.segment_index;
+    entry.fingerprint = act.header.fingerprint_array[act.header.metadata.segment_index];
 
     act.header.metadata.segment_index++;
     while (act.header.metadata.segment_index < STRIPE_SEGMENT_COUNT &&
@@ -170,20 +594,48 @@ void XCodecCacheCOSS::enter(const uint64_t &hash, const Buffer &buf, unsigned of
         act.header.metadata.segment_index++;
     act.header.metadata.segment_count++;
     act.header.metadata.freshness = ++freshness_level_;
+    if (next_ < 0 && act.header.metadata.segment_index >= STRIPE_PREPARE_INDEX)
+        prepare_active();
 
     cache_index_.insert(hash, entry);
+
+    /*
+     * Segments purged from the cache are still in the filter, build it
+     * again from the index once they are too many, a part of it with each
+     * stripe made active.
+     */
+    filter_.insert(hash);
+    if (filter_.saturated() && !filter_.rebuilding())
+        cache_index_.rebuild(filter_);
+}
+
+/*
+ * The segment replaced stays where it is, out of the index, until its stripe
+ * is purged.
+ */
+void XCodecCacheCOSS::replace(const uint64_t &hash, const Buffer &buf, unsigned off, unsigned length) {
+#ifdef USING_XCODEC_CACHE_RECENT_WINDOW
+    forget(hash);
+#endif
+    enter(hash, buf, off, length);
 }
 
 bool XCodecCacheCOSS::lookup(const uint64_t &hash, Buffer &buf) {
     const COSSIndexEntry *entry;
     const uint8_t *data;
+    unsigned length;
     int slot;
 
     stats_.lookups++;
 
+    if (!filter_.maybe_contains(hash)) {
+        stats_.filtered++;
+        return false;
+    }
+
 #ifdef USING_XCODEC_CACHE_RECENT_WINDOW
-    if ((data = find_recent(hash))) {
-        buf.append(data, XCODEC_SEGMENT_LENGTH);
+    if ((data = find_recent(hash, &length))) {
+        buf.append(data, length);
         stats_.found_1++;
         return true;
     }
@@ -192,14 +644,15 @@ bool XCodecCacheCOSS::lookup(const uint64_t &hash, Buffer &buf) {
     if (!(entry = cache_index_.lookup(hash)))
         return false;
 
-    for (slot = 0; slot < LOADED_STRIPE_COUNT; ++slot)
-        if (stripe_[slot].header.metadata.stripe_range == entry->stripe_range)
-            break;
-
-    if (slot >= LOADED_STRIPE_COUNT) {
-        slot = best_unloadable_slot();
-        detach_stripe(slot);
-        load_stripe(entry->stripe_range, slot);
+    collect();
+    if ((slot = loaded_slot(entry->stripe_range)) < 0) {
+        if ((slot = loading_slot(entry->stripe_range)) >= 0) {
+            finish_stripe(slot);
+        } else {
+            slot = best_unloadable_slot();
+            detach_stripe(slot);
+            load_stripe(entry->stripe_range, slot);
+        }
     }
 
     if (stripe_[slot].header.hash_array[entry->position] != hash)
@@ -209,17 +662,93 @@ bool XCodecCacheCOSS::lookup(const uint64_t &hash, Buffer &buf) {
     stripe_[slot].header.metadata.uses++;
     stripe_[slot].header.metadata.credits++;
     stripe_[slot].header.metadata.load_uses++;
-    stripe_[slot].header.flags[entry->position] |= 3;
+    stripe_[slot].header.flags[entry->position] |= SEGMENT_FLAG_LOADED_USE | SEGMENT_FLAG_PURGE_USE;
 
     data = stripe_[slot].segment_array[entry->position].bytes;
+    if (!(length = stripe_[slot].header.flags[entry->position] >> SEGMENT_LENGTH_SHIFT))
+        length = XCODEC_SEGMENT_LENGTH;
 #ifdef USING_XCODEC_CACHE_RECENT_WINDOW
-    remember(hash, data);
+    remember(hash, data, length);
 #endif
-    buf.append(data, XCODEC_SEGMENT_LENGTH);
+    buf.append(data, length);
     stats_.found_2++;
     return true;
 }
 
+bool XCodecCacheCOSS::contains(const uint64_t &hash) {
+    if (!filter_.maybe_contains(hash)) {
+        stats_.filtered++;
+        return false;
+    }
+    return (cache_index_.lookup(hash) != 0);
+}
+
+/*
+ * The fingerprint is in the index, so a hit is confirmed without reading the
+ * stripe.  If the stripe is not loaded the use of the segment is noted in the
+ * index entry and transferred to the stripe header when it is next loaded.
+ */
+bool XCodecCacheCOSS::verify(const uint64_t &hash, uint64_t fingerprint) {
+    COSSIndexEntry *entry;
+    int slot;
+
+    if (!(entry = cache_index_.lookup(hash)) || entry->fingerprint != fingerprint)
+        return false;
+
+    for (slot = 0; slot < LOADED_STRIPE_COUNT; ++slot)
+        if (!loading_[slot] && stripe_[slot].header.metadata.state == 1 &&
+            stripe_[slot].header.metadata.stripe_range == entry->stripe_range)
+            break;
+
+    if (slot < LOADED_STRIPE_COUNT) {
+        stripe_[slot].header.metadata.freshness = ++freshness_level_;
+        stripe_[slot].header.metadata.uses++;
+        stripe_[slot].header.metadata.credits++;
+        stripe_[slot].header.metadata.load_uses++;
+        stripe_[slot].header.flags[entry->position] |= SEGMENT_FLAG_PURGE_USE;
+    } else {
+        directory_[entry->stripe_range].freshness = ++freshness_level_;
+        directory_[entry->stripe_range].uses++;
+        entry->touched = 1;
+    }
+
+    stats_.verified++;
+    return true;
+}
+
+/*
+ * A segment whose stripe is not loaded is ready once it is, which is left
+ * to the thread unless enough stripes are being read already, and those
+ * waiting are called back from on_read.
+ */
+bool XCodecCacheCOSS::ready(const uint64_t &hash) {
+    const COSSIndexEntry *entry;
+    int slot;
+
+    if (!filter_.maybe_contains(hash) || !(entry = cache_index_.lookup(hash)))
+        return true;
+
+#ifdef USING_XCODEC_CACHE_RECENT_WINDOW
+    unsigned length;
+    if (find_recent(hash, &length))
+        return true;
+#endif
+
+    collect();
+    if (loaded_slot(entry->stripe_range) >= 0 || entry->stripe_range * sizeof(COSSStripe) >= file_size_)
+        return true;
+
+    if (loading_slot(entry->stripe_range) < 0 && fetching_ < FETCHED_STRIPE_COUNT) {
+        slot = best_unloadable_slot();
+        detach_stripe(slot);
+        fetch_stripe(entry->stripe_range, slot);
+    }
+
+    if (!read_action_)
+        read_action_ = event_system.track(io_->notifier(), StreamModeRead, callback(this, &XCodecCacheCOSS::on_read));
+    return false;
+}
+
 void XCodecCacheCOSS::initialize_stripe(uint64_t range, int slot) {
     memset(&stripe_[slot].header, 0, sizeof(COSSStripeHeader));
     stripe_[slot].header.metadata.signature = CACHE_SIGNATURE;
@@ -231,42 +760,156 @@ void XCodecCacheCOSS::initialize_stripe(uint64_t range, int slot) {
 }
 
 bool XCodecCacheCOSS::load_stripe(uint64_t range, int slot) {
-    uint64_t pos = range * sizeof(COSSStripe);
-    if (pos < file_size_) {
-        stream_.seekg(pos);
-        stream_.read((char *) &stripe_[slot], sizeof(COSSStripe));
-        if (stream_.gcount() == sizeof(COSSStripe)) {
-            stripe_[slot].header.metadata.stripe_range = range;
-            stripe_[slot].header.metadata.load_uses = 0;
-            stripe_[slot].header.metadata.state = 1;
-            directory_[range].state = 1;
-            return true;
+    if (range * sizeof(COSSStripe) >= file_size_)
+        return false;
+    fetch_stripe(range, slot);
+    return finish_stripe(slot);
+}
+
+/*
+ * The slot is the thread's until the read is finished, and is passed over
+ * by everything else meanwhile.  The stripe is taken as loaded from the
+ * start, so that it is not chosen to be rewritten.
+ */
+void XCodecCacheCOSS::fetch_stripe(uint64_t range, int slot) {
+    directory_[range].state = 1;
+    loading_[slot] = io_->read(range * sizeof(COSSStripe), &stripe_[slot], sizeof(COSSStripe));
+    fetching_++;
+}
+
+/*
+ * Waits for the read into the slot if it is not done yet.
+ */
+bool XCodecCacheCOSS::finish_stripe(int slot) {
+    COSSIoRequest *req = loading_[slot];
+    uint64_t range = req->position / sizeof(COSSStripe);
+    bool ok;
+
+    io_->wait(req);
+    ok = req->ok;
+    delete req;
+    loading_[slot] = 0;
+    fetching_--;
+
+    if (!ok) {
+        stripe_[slot].header.metadata.signature = 0;
+        stripe_[slot].header.metadata.state = 0;
+        directory_[range].state = 0;
+        return false;
+    }
+
+    stripe_[slot].header.metadata.stripe_range = range;
+    stripe_[slot].header.metadata.version = CACHE_VERSION;
+    stripe_[slot].header.metadata.freshness = ++freshness_level_;
+    stripe_[slot].header.metadata.load_uses = 0;
+    stripe_[slot].header.metadata.state = 1;
+
+    for (int i = 0; i < STRIPE_SEGMENT_COUNT; ++i) {
+        COSSIndexEntry *entry;
+        uint64_t hash = stripe_[slot].header.hash_array[i];
+        if (hash && (entry = cache_index_.lookup(hash)) && entry->touched &&
+            entry->stripe_range == range && entry->position == (unsigned) i) {
+            stripe_[slot].header.flags[i] |= SEGMENT_FLAG_PURGE_USE;
+            entry->touched = 0;
         }
     }
+    return true;
+}
 
-    stream_.clear();
-    return false;
+void XCodecCacheCOSS::collect() {
+    if (fetching_ == 0)
+        return;
+    for (int slot = 0; slot < LOADED_STRIPE_COUNT; ++slot)
+        if (loading_[slot] && io_->done(loading_[slot]))
+            finish_stripe(slot);
+}
+
+void XCodecCacheCOSS::on_read(Event e) {
+    if (read_action_)
+        read_action_->cancel(), read_action_ = 0;
+
+    io_->drain();
+    collect();
+    fetched();
 }
 
+/*
+ * Stripes are written from a copy, so the slot can be reused at once.
+ */
 void XCodecCacheCOSS::store_stripe(int slot, size_t size) {
     uint64_t pos = stripe_[slot].header.metadata.stripe_range * sizeof(COSSStripe);
-    if (pos != (uint64_t) stream_.tellp())
-        stream_.seekp(pos);
-    stream_.write((char *) &stripe_[slot], size);
-    if (stream_.good() && pos + sizeof(COSSStripe) > file_size_)
+    journal(stripe_[slot].header.metadata.stripe_range);
+    io_->write(pos, &stripe_[slot], size);
+    if (pos + sizeof(COSSStripe) > file_size_)
         file_size_ = pos + sizeof(COSSStripe);
-    stream_.clear();
+}
+
+/*
+ * The slot and the stripe that come after the active one are chosen once
+ * it is mostly full, so that the stripe is read by the time it is needed.
+ */
+void XCodecCacheCOSS::prepare_active() {
+    next_ = best_unloadable_slot();
+    detach_stripe(next_);
+    next_range_ = best_erasable_stripe();
+
+    /*
+     * An older copy of the stripe may still be in another slot, where
+     * lookups would find it before the one about to be rewritten.
+     */
+    for (int slot = 0; slot < LOADED_STRIPE_COUNT; ++slot) {
+        if (slot != active_ && slot != next_ && !loading_[slot] &&
+            stripe_[slot].header.metadata.signature == CACHE_SIGNATURE &&
+            stripe_[slot].header.metadata.stripe_range == next_range_) {
+            detach_stripe(slot);
+            stripe_[slot].header.metadata.signature = 0;
+        }
+    }
+
+    if (next_range_ * sizeof(COSSStripe) < file_size_)
+        fetch_stripe(next_range_, next_);
 }
 
 void XCodecCacheCOSS::new_active() {
     store_stripe(active_, sizeof(COSSStripe));
-    active_ = best_unloadable_slot();
-    detach_stripe(active_);
-    stripe_range_ = best_erasable_stripe();
-    if (load_stripe(stripe_range_, active_))
+    if (next_ < 0)
+        prepare_active();
+    active_ = next_;
+    stripe_range_ = next_range_;
+    next_ = -1;
+
+    bool loaded = (loading_[active_] ? finish_stripe(active_) : stripe_[active_].header.metadata.state == 1);
+
+    /*
+     * Lookups may have used the slot while it was waiting.
+     */
+    forget_stripe(active_);
+    if (loaded)
         purge_stripe(active_);
     else
         initialize_stripe(stripe_range_, active_);
+
+    if (filter_.rebuilding())
+        cache_index_.carry(filter_);
+
+    if (--snapshot_due_ == 0)
+        write_snapshot();
+}
+
+int XCodecCacheCOSS::loaded_slot(uint64_t range) {
+    for (int slot = 0; slot < LOADED_STRIPE_COUNT; ++slot)
+        if (!loading_[slot] &&
+            stripe_[slot].header.metadata.signature == CACHE_SIGNATURE &&
+            stripe_[slot].header.metadata.stripe_range == range)
+            return slot;
+    return -1;
+}
+
+int XCodecCacheCOSS::loading_slot(uint64_t range) {
+    for (int slot = 0; slot < LOADED_STRIPE_COUNT; ++slot)
+        if (loading_[slot] && loading_[slot]->position == range * sizeof(COSSStripe))
+            return slot;
+    return -1;
 }
 
 int XCodecCacheCOSS::best_unloadable_slot() {
@@ -274,7 +917,7 @@ int XCodecCacheCOSS::best_unloadable_slot() {
     int j = 0;
 
     for (int i = 0; i < LOADED_STRIPE_COUNT; ++i) {
-        if (i == active_)
+        if (i == active_ || i == next_ || loading_[i])
             continue;
         if (stripe_[i].header.metadata.signature == 0)
             return i;
@@ -302,37 +945,57 @@ uint64_t XCodecCacheCOSS::best_erasable_stripe() {
     return j;
 }
 
+/*
+ * A detached stripe may still be found by lookups until the slot is taken,
+ * so what they remember of it is forgotten whatever its state.
+ */
 void XCodecCacheCOSS::detach_stripe(int slot) {
+    forget_stripe(slot);
+
     if (stripe_[slot].header.metadata.state == 1) {
         uint64_t range = stripe_[slot].header.metadata.stripe_range;
         directory_[range] = stripe_[slot].header.metadata;
         directory_[range].state = 2;
 
-        for (int i = 0; i < STRIPE_SEGMENT_COUNT; ++i) {
-            if (stripe_[slot].header.flags[i] & 1) {
+        stripe_[slot].header.metadata.state = 0;
+        store_stripe(slot, sizeof(COSSStripeHeader));
+    }
+}
+
+void XCodecCacheCOSS::forget_stripe(int slot) {
+    for (int i = 0; i < STRIPE_SEGMENT_COUNT; ++i) {
+        if (stripe_[slot].header.flags[i] & SEGMENT_FLAG_LOADED_USE) {
 #ifdef USING_XCODEC_CACHE_RECENT_WINDOW
-                forget(stripe_[slot].header.hash_array[i]);
+            forget(stripe_[slot].header.hash_array[i]);
 #endif
-                stripe_[slot].header.flags[i] &= ~1;
-            }
+            stripe_[slot].header.flags[i] &= ~SEGMENT_FLAG_LOADED_USE;
         }
-
-        stripe_[slot].header.metadata.state = 0;
-        store_stripe(slot, sizeof(COSSStripeHeader));
     }
 }
 
 void XCodecCacheCOSS::purge_stripe(int slot) {
+    uint64_t range = stripe_[slot].header.metadata.stripe_range;
+    const COSSIndexEntry *entry;
+
     for (int i = STRIPE_SEGMENT_COUNT - 1; i >= 0; --i) {
         uint64_t hash = stripe_[slot].header.hash_array[i];
-        if (hash && !(stripe_[slot].header.flags[i] & 2)) {
+        if (hash && !((entry = cache_index_.lookup(hash)) &&
+                      entry->stripe_range == range && entry->position == (unsigned) i)) {
+            /*
+             * Replaced by a segment elsewhere, which keeps the hash.
+             */
+            stripe_[slot].header.hash_array[i] = 0;
+            stripe_[slot].header.flags[i] = 0;
+            stripe_[slot].header.metadata.segment_count--;
+        } else if (hash && !(stripe_[slot].header.flags[i] & SEGMENT_FLAG_PURGE_USE)) {
             cache_index_.erase(hash);
+            evicted(hash);
             stripe_[slot].header.hash_array[i] = 0;
             stripe_[slot].header.flags[i] = 0;
             stripe_[slot].header.metadata.segment_count--;
         }
 
-        stripe_[slot].header.flags[i] &= ~2;
+        stripe_[slot].header.flags[i] &= ~SEGMENT_FLAG_PURGE_USE;
         if (!stripe_[slot].header.hash_array[i])
             stripe_[slot].header.metadata.segment_index = i;
     }
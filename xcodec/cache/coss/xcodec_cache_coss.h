@@ -14,13 +14,16 @@
 #ifndef    XCODEC_XCODEC_CACHE_COSS_H
 #define    XCODEC_XCODEC_CACHE_COSS_H
 
+#include <algorithm>
 #include <string>
 #include <map>
-#include <fstream>
+#include <vector>
 
 #include "../../../common/buffer.h"
+#include "../../../event/event_system.h"
 #include "../../../xcodec/xcodec.h"
 #include "../../../xcodec/xcodec_cache.h"
+#include "./xcodec_cache_coss_io.h"
 
 ////////////////////////////////////////////////////////////////////////////////
 //                                                                            //
@@ -58,6 +61,11 @@ using namespace std;
  *
  * - When we reach the EOF, first stripe is zeroed and becomes active.
  *
+ * - The file is read and written by a thread of its own, see
+ * xcodec_cache_coss_io.h.  Stripes and headers are written behind from a
+ * copy, and a stripe that a segment is wanted from is read while other
+ * streams go on, as is the next one to be made active.
+ *
  */
 
 // Changes introduced in version 2:
@@ -72,46 +80,148 @@ using namespace std;
 // - when no more place is available, the LRU stripe is purged and any segments 
 //   no used during the last period are erased
 
+// Changes introduced in version 3:
+//
+// - segments produced by content-defined chunking may be shorter than
+//   XCODEC_SEGMENT_LENGTH; their length is kept in the upper half of the flags
+//   word (zero meaning a full segment) so version 2 files remain readable;
+//   so are those of caches with shorter segments, which take a slot each all
+//   the same
+
+// Changes introduced in version 4:
+//
+// - the header holds a strong fingerprint of each segment, which is also kept
+//   in the index so that hits can be confirmed without loading the stripe;
+//   files from earlier versions are started afresh
+//
+// - the index and the directory are saved to a snapshot file next to the
+//   cache, which is read instead of every stripe header when it is opened;
+//   the stripes written since the snapshot was taken are listed in a
+//   journal file, and only their headers are read again
+
 /*
  * This values should be page aligned.
  */
 
 #define CACHE_SIGNATURE                0xF150E964
-#define CACHE_VERSION                2
+#define CACHE_VERSION                4
 #define STRIPE_SEGMENT_COUNT        512        // segments of XCODEC_SEGMENT_LENGTH per stripe (must fit into 16 bits)
 #define LOADED_STRIPE_COUNT        16            // number of stripes held in memory (must be greater than 1)
+#define FETCHED_STRIPE_COUNT        4            // most stripes being read at a time for lookups
+#define STRIPE_PREPARE_INDEX        (STRIPE_SEGMENT_COUNT * 3 / 4)    // segment from which the next active stripe is read
 #define CACHE_BASIC_SIZE            1024        // MB
+#define SNAPSHOT_SIGNATURE            0xF150E965
+#define SNAPSHOT_FRACTION            8            // part of the stripes made active between snapshots
+#define SNAPSHOT_BLOCK                65536        // bytes summed at a time
+#define FILTER_SWEEP_STRIPES        64            // stripes made active while the filter is built again
+
+#define SEGMENT_FLAG_LOADED_USE    0x00000001    // used since the stripe was loaded
+#define SEGMENT_FLAG_PURGE_USE        0x00000002    // used since the stripe was last purged
+#define SEGMENT_LENGTH_SHIFT        16
 
 #define CACHE_ALIGNEMENT            4096
-#define HEADER_ARRAY_SIZE            (STRIPE_SEGMENT_COUNT * (sizeof (uint64_t) + sizeof (uint32_t)))
+#define HEADER_ARRAY_SIZE            (STRIPE_SEGMENT_COUNT * (2 * sizeof (uint64_t) + sizeof (uint32_t)))
 #define METADATA_SIZE                (sizeof (COSSMetadata))
 #define ROUND_UP(N, S)                ((((N) + (S) - 1) / (S)) * (S))
 #define HEADER_ALIGNED_SIZE        ROUND_UP(HEADER_ARRAY_SIZE + METADATA_SIZE, CACHE_ALIGNEMENT)
 #define METADATA_PADDING            (HEADER_ALIGNED_SIZE - HEADER_ARRAY_SIZE - METADATA_SIZE)
 
+/*
+ * Sixteen bytes, so that with the hash and the control byte a slot of the
+ * index takes 25 bytes.  The index is reserved for a full cache from the
+ * start, which is about 33 bytes an entry once it is full.
+ */
 struct COSSIndexEntry {
-    uint64_t stripe_range: 48;
+    uint64_t stripe_range: 47;
+    uint64_t touched: 1;            // verified while its stripe was not loaded
     uint64_t position: 16;
+    uint64_t fingerprint;
 };
 
 class COSSIndex {
-    typedef __gnu_cxx::hash_map<Hash64, COSSIndexEntry> index_t;
+    typedef XCodecIndex<COSSIndexEntry> index_t;
     index_t index;
+    size_t sweep_;
+    unsigned sweep_rebuilds_;
 
 public:
+    typedef index_t::iterator iterator;
+
+    COSSIndex()
+            : index(),
+              sweep_(0),
+              sweep_rebuilds_(0) {}
+
     void insert(const uint64_t &hash, const COSSIndexEntry &entry) {
-        index[hash] = entry;
+        index.insert(hash) = entry;
     }
 
-    const COSSIndexEntry *lookup(const uint64_t &hash) {
-        index_t::iterator it = index.find(hash);
-        return (it != index.end() ? &it->second : 0);
+    COSSIndexEntry *lookup(const uint64_t &hash) {
+        return (index.find(hash));
     }
 
     void erase(const uint64_t &hash) {
         index.erase(hash);
     }
 
+    void clear() {
+        index.clear();
+    }
+
+    void reserve(size_t count) {
+        index.reserve(count);
+    }
+
+    /*
+     * Erases every entry in one of the stripes marked.
+     */
+    void erase_stripes(const std::vector<bool> &stripes) {
+        for (iterator it = index.begin(); it != index.end(); ++it)
+            if (stripes[it->second.stripe_range])
+                index.erase(it);
+    }
+
+    iterator begin() {
+        return index.begin();
+    }
+
+    iterator end() {
+        return index.end();
+    }
+
+    void fill(XCodecBloomFilter &filter) {
+        for (iterator it = index.begin(); it != index.end(); ++it)
+            filter.insert(it->first);
+    }
+
+    /*
+     * Once the filter is saturated it is built again as stripes are made
+     * active, a part of the index each time, so as to be done in about
+     * FILTER_SWEEP_STRIPES of them.  Entries move when the index is
+     * rebuilt, so then it is gone through again from the start.
+     */
+    void rebuild(XCodecBloomFilter &filter) {
+        filter.rebuild(filter.capacity());
+        sweep_ = 0;
+        sweep_rebuilds_ = index.rebuilds();
+    }
+
+    void carry(XCodecBloomFilter &filter) {
+        size_t end;
+        uint64_t hash;
+
+        if (index.rebuilds() != sweep_rebuilds_) {
+            sweep_ = 0;
+            sweep_rebuilds_ = index.rebuilds();
+        }
+        end = std::min(index.slots(), sweep_ + index.slots() / FILTER_SWEEP_STRIPES + 1);
+        for (; sweep_ < end; sweep_++)
+            if (index.hash_at(sweep_, &hash))
+                filter.carry(hash);
+        if (sweep_ == index.slots())
+            filter.rebuilt();
+    }
+
     size_t size() {
         return index.size();
     }
@@ -151,6 +261,7 @@ struct COSSStripeHeader {
     char padding[METADATA_PADDING];
     uint32_t flags[STRIPE_SEGMENT_COUNT];
     uint64_t hash_array[STRIPE_SEGMENT_COUNT];
+    uint64_t fingerprint_array[STRIPE_SEGMENT_COUNT];
 };
 
 struct COSSStripe {
@@ -161,20 +272,49 @@ public:
     COSSStripe() { memset(&header, 0, sizeof header); }
 };
 
+/*
+ * The snapshot is this header, the metadata of each stripe, and then the
+ * index, one COSSSnapshotEntry for each segment.  The sum is of all that
+ * follows the header.  The journal is the range of each stripe written
+ * since, as a uint64_t.
+ */
+struct COSSSnapshotHeader {
+    uint32_t signature;
+    uint32_t version;
+    uint64_t stripe_size;
+    uint64_t stripe_count;
+    uint64_t file_stripes;
+    uint64_t entry_count;
+    uint64_t sum;
+};
+
+struct COSSSnapshotEntry {
+    uint64_t hash;
+    COSSIndexEntry entry;
+};
+
 struct COSSStats {
     uint64_t lookups;
     uint64_t found_1;
     uint64_t found_2;
+    uint64_t verified;
+    uint64_t filtered;
 
 public:
-    COSSStats() { lookups = found_1 = found_2 = 0; }
+    COSSStats() { lookups = found_1 = found_2 = verified = filtered = 0; }
 };
 
 
 class XCodecCacheCOSS : public XCodecCache {
     std::string file_path_;
     uint64_t file_size_;
-    fstream stream_;
+    int fd_;
+    COSSIoThread *io_;
+    Action *read_action_;
+    std::string snapshot_path_;
+    std::string journal_path_;
+    int journal_fd_;
+    uint64_t snapshot_due_;
 
     uint64_t serial_number_;
     uint64_t stripe_range_;
@@ -182,7 +322,11 @@ class XCodecCacheCOSS : public XCodecCache {
     uint64_t freshness_level_;
 
     COSSStripe stripe_[LOADED_STRIPE_COUNT];
+    COSSIoRequest *loading_[LOADED_STRIPE_COUNT];
+    unsigned fetching_;
     int active_;
+    int next_;
+    uint64_t next_range_;
 
     COSSMetadata *directory_;
     COSSIndex cache_index_;
@@ -190,31 +334,68 @@ class XCodecCacheCOSS : public XCodecCache {
     LogHandle log_;
 
 public:
-    XCodecCacheCOSS(const UUID &uuid, const std::string &cache_dir, size_t cache_size);
+    XCodecCacheCOSS(const UUID &uuid, const std::string &cache_dir, size_t cache_size,
+                    unsigned family = XCODEC_HASH_FAMILY_LEGACY, unsigned segment_length = XCODEC_SEGMENT_LENGTH);
 
     ~XCodecCacheCOSS();
 
-    virtual void enter(const uint64_t &hash, const Buffer &buf, unsigned off);
+    virtual void enter(const uint64_t &hash, const Buffer &buf, unsigned off, unsigned length);
+
+    virtual void replace(const uint64_t &hash, const Buffer &buf, unsigned off, unsigned length);
 
     virtual bool lookup(const uint64_t &hash, Buffer &buf);
 
+    virtual bool contains(const uint64_t &hash);
+
+    virtual bool verify(const uint64_t &hash, uint64_t fingerprint);
+
+    virtual bool ready(const uint64_t &hash);
+
 private:
     bool read_file();
 
+    bool scan_file(uint64_t limit);
+
+    bool read_snapshot(uint64_t limit);
+
+    bool replay_journal(uint64_t limit);
+
+    void write_snapshot();
+
+    void journal(uint64_t range);
+
+    void index_stripe(uint64_t range, const COSSStripeHeader &header);
+
     void initialize_stripe(uint64_t range, int slot);
 
     bool load_stripe(uint64_t range, int slot);
 
+    void fetch_stripe(uint64_t range, int slot);
+
+    bool finish_stripe(int slot);
+
+    void collect();
+
+    void on_read(Event e);
+
     void store_stripe(int slot, size_t size);
 
+    void prepare_active();
+
     void new_active();
 
+    int loaded_slot(uint64_t range);
+
+    int loading_slot(uint64_t range);
+
     int best_unloadable_slot();
 
     uint64_t best_erasable_stripe();
 
     void detach_stripe(int slot);
 
+    void forget_stripe(int slot);
+
     void purge_stripe(int slot);
 };
 
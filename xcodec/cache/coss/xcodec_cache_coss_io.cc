@@ -0,0 +1,212 @@
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include "./xcodec_cache_coss_io.h"
+
+////////////////////////////////////////////////////////////////////////////////
+//                                                                            //
+// File:           xcodec_cache_coss_io.cc                                    //
+// Description:    thread doing the disk access of a persistent cache         //
+// Project:        WANProxy XTech                                             //
+// Last modified:  2026-10-18                                                 //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+
+COSSIoThread::COSSIoThread(int fd)
+        : Thread("COSSIoThread"),
+          fd_(fd),
+          rfd_(-1),
+          wfd_(-1),
+          queue_(),
+          backlog_(0),
+          log_("/xcodec/cache/coss/io") {
+    pthread_mutex_init(&mutex_, 0);
+    pthread_cond_init(&queued_, 0);
+    pthread_cond_init(&done_, 0);
+
+    int fd2[2];
+    if (::pipe(fd2) == 0) {
+        rfd_ = fd2[0], wfd_ = fd2[1];
+        ::fcntl(rfd_, F_SETFL, ::fcntl(rfd_, F_GETFL, 0) | O_NONBLOCK);
+        ::fcntl(wfd_, F_SETFL, ::fcntl(wfd_, F_GETFL, 0) | O_NONBLOCK);
+    } else {
+        ERROR(log_) << "Could not create pipe: " << strerror(errno);
+    }
+}
+
+COSSIoThread::~COSSIoThread() {
+    if (rfd_ >= 0)
+        ::close(rfd_);
+    if (wfd_ >= 0)
+        ::close(wfd_);
+    pthread_mutex_destroy(&mutex_);
+    pthread_cond_destroy(&queued_);
+    pthread_cond_destroy(&done_);
+}
+
+void COSSIoThread::main() {
+    COSSIoRequest *req;
+    bool ok;
+
+    pthread_mutex_lock(&mutex_);
+    for (;;) {
+        while (queue_.empty() && !stop_)
+            pthread_cond_wait(&queued_, &mutex_);
+        if (queue_.empty())
+            break;
+        req = queue_.front();
+        pthread_mutex_unlock(&mutex_);
+
+        if (req->task != NULL) {
+            req->task->perform();
+            ok = true;
+        } else {
+            ok = perform(req);
+        }
+
+        pthread_mutex_lock(&mutex_);
+        queue_.pop_front();
+        if (req->writing) {
+            backlog_ -= req->size;
+            delete[] req->data;
+            delete req->task;
+            delete req;
+        } else {
+            req->ok = ok;
+            req->done = true;
+            if (wfd_ >= 0 && ::write(wfd_, "", 1) < 0 && errno != EAGAIN)
+                ERROR(log_) << "Could not tell of a read done: " << strerror(errno);
+        }
+        pthread_cond_broadcast(&done_);
+    }
+    pthread_mutex_unlock(&mutex_);
+}
+
+void COSSIoThread::stop() {
+    pthread_mutex_lock(&mutex_);
+    stop_ = true;
+    pthread_cond_signal(&queued_);
+    pthread_mutex_unlock(&mutex_);
+    Thread::stop();
+}
+
+void COSSIoThread::write(uint64_t position, const void *data, size_t size) {
+    COSSIoRequest *req = new COSSIoRequest;
+
+    req->position = position;
+    req->size = size;
+    req->data = new uint8_t[size];
+    req->task = NULL;
+    req->writing = true;
+    req->done = req->ok = false;
+    memcpy(req->data, data, size);
+
+    pthread_mutex_lock(&mutex_);
+    while (backlog_ > COSS_IO_BACKLOG)
+        pthread_cond_wait(&done_, &mutex_);
+    backlog_ += size;
+    pthread_mutex_unlock(&mutex_);
+
+    queue(req);
+}
+
+void COSSIoThread::run(COSSIoTask *task) {
+    COSSIoRequest *req = new COSSIoRequest;
+
+    req->position = 0;
+    req->size = 0;
+    req->data = NULL;
+    req->task = task;
+    req->writing = true;
+    req->done = req->ok = false;
+
+    queue(req);
+}
+
+void COSSIoThread::flush() {
+    pthread_mutex_lock(&mutex_);
+    while (!queue_.empty())
+        pthread_cond_wait(&done_, &mutex_);
+    pthread_mutex_unlock(&mutex_);
+}
+
+COSSIoRequest *COSSIoThread::read(uint64_t position, void *data, size_t size) {
+    COSSIoRequest *req = new COSSIoRequest;
+
+    req->position = position;
+    req->size = size;
+    req->data = (uint8_t *) data;
+    req->task = NULL;
+    req->writing = false;
+    req->done = req->ok = false;
+
+    queue(req);
+    return (req);
+}
+
+bool COSSIoThread::done(COSSIoRequest *req) {
+    bool done;
+
+    pthread_mutex_lock(&mutex_);
+    done = req->done;
+    pthread_mutex_unlock(&mutex_);
+    return (done);
+}
+
+void COSSIoThread::wait(COSSIoRequest *req) {
+    pthread_mutex_lock(&mutex_);
+    while (!req->done)
+        pthread_cond_wait(&done_, &mutex_);
+    pthread_mutex_unlock(&mutex_);
+}
+
+void COSSIoThread::drain() {
+    uint8_t buf[64];
+    ssize_t len;
+
+    if (rfd_ < 0)
+        return;
+    do {
+        len = ::read(rfd_, buf, sizeof buf);
+    } while (len > 0 || (len < 0 && errno == EINTR));
+    if (len < 0 && errno != EAGAIN)
+        ERROR(log_) << "Could not empty the pipe: " << strerror(errno);
+}
+
+void COSSIoThread::queue(COSSIoRequest *req) {
+    pthread_mutex_lock(&mutex_);
+    queue_.push_back(req);
+    if (queue_.size() == 1)
+        pthread_cond_signal(&queued_);
+    pthread_mutex_unlock(&mutex_);
+}
+
+bool COSSIoThread::perform(COSSIoRequest *req) {
+    uint8_t scratch[65536];
+    size_t n = 0;
+    ssize_t len;
+
+    while (n < req->size) {
+        if (req->writing)
+            len = ::pwrite(fd_, req->data + n, req->size - n, req->position + n);
+        else if (req->data == NULL)
+            len = ::pread(fd_, scratch, std::min(req->size - n, sizeof scratch), req->position + n);
+        else
+            len = ::pread(fd_, req->data + n, req->size - n, req->position + n);
+        if (len < 0 && errno == EINTR)
+            continue;
+        if (len < 0) {
+            ERROR(log_) << "Could not " << (req->writing ? "write " : "read ") << req->size << " bytes at "
+                        << req->position << ": " << strerror(errno);
+            return (false);
+        }
+        if (len == 0)
+            return (false);
+        n += len;
+    }
+    return (true);
+}
@@ -0,0 +1,122 @@
+#ifndef    XCODEC_XCODEC_CACHE_COSS_IO_H
+#define    XCODEC_XCODEC_CACHE_COSS_IO_H
+
+#include <deque>
+#include <pthread.h>
+
+#include "../../../common/thread/thread.h"
+
+////////////////////////////////////////////////////////////////////////////////
+//                                                                            //
+// File:           xcodec_cache_coss_io.h                                     //
+// Description:    thread doing the disk access of a persistent cache         //
+// Project:        WANProxy XTech                                             //
+// Last modified:  2026-10-18                                                 //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+
+/*
+ * Bytes of writes that may be queued before the writer waits for the disk
+ * to catch up, some eight stripes.
+ */
+#define COSS_IO_BACKLOG            (8 << 20)
+
+/*
+ * Work on the other files kept with the cache, done by the thread in turn
+ * with the reads and writes queued before and after it, and then deleted.
+ */
+class COSSIoTask {
+public:
+    virtual ~COSSIoTask() {}
+
+    virtual void perform() = 0;
+};
+
+/*
+ * A read into memory of the cache, or a write of a copy of some of it, or
+ * a task, which the thread takes over.
+ */
+struct COSSIoRequest {
+    uint64_t position;
+    size_t size;
+    uint8_t *data;
+    COSSIoTask *task;
+    bool writing;
+    bool done;
+    bool ok;
+};
+
+/*
+ * Reads and writes of the cache file are done in the order they are asked
+ * for by a thread of their own, so that the event loop goes on with other
+ * streams meanwhile.  Writes are of copies and are not waited for, a read
+ * sees what was written before it was asked for, and the end of each read
+ * is told through a pipe that the event system can watch.
+ */
+class COSSIoThread : public Thread {
+    int fd_;
+    int rfd_;
+    int wfd_;
+    std::deque<COSSIoRequest *> queue_;
+    size_t backlog_;
+    pthread_mutex_t mutex_;
+    pthread_cond_t queued_;
+    pthread_cond_t done_;
+    LogHandle log_;
+
+public:
+    COSSIoThread(int fd);
+
+    ~COSSIoThread();
+
+    virtual void main();
+
+    /*
+     * Returns once everything queued is done.
+     */
+    virtual void stop();
+
+    void write(uint64_t position, const void *data, size_t size);
+
+    /*
+     * Like a write, not waited for.
+     */
+    void run(COSSIoTask *task);
+
+    /*
+     * Returns once everything queued so far is done.
+     */
+    void flush();
+
+    /*
+     * The memory read into is not to be touched until the request is done,
+     * after which it is the caller's to delete.  With no memory to read
+     * into the data is only brought into the page cache, for a mapping of
+     * the file to find it there.
+     */
+    COSSIoRequest *read(uint64_t position, void *data, size_t size);
+
+    bool done(COSSIoRequest *req);
+
+    void wait(COSSIoRequest *req);
+
+    /*
+     * Readable once a read is done since it was last read from.
+     */
+    int notifier() const {
+        return rfd_;
+    }
+
+    /*
+     * Empties the notifier, to be done before looking at which reads are
+     * done, so that it is readable again only once another one is.
+     */
+    void drain();
+
+private:
+    void queue(COSSIoRequest *req);
+
+    bool perform(COSSIoRequest *req);
+};
+
+#endif /* !XCODEC_XCODEC_CACHE_COSS_IO_H */
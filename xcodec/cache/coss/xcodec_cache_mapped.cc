@@ -0,0 +1,556 @@
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "./xcodec_cache_mapped.h"
+
+////////////////////////////////////////////////////////////////////////////////
+//                                                                            //
+// File:           xcodec_cache_mapped.cc                                     //
+// Description:    persistent cache in a file mapped into memory              //
+// Project:        WANProxy XTech                                             //
+// Last modified:  2026-10-18                                                 //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+
+XCodecCacheMapped::XCodecCacheMapped(const UUID &uuid, const std::string &cache_dir, size_t cache_size,
+                                     unsigned family, unsigned segment_length)
+        : XCodecCache(uuid, cache_size, family, segment_length),
+          log_("xcodec/cache/mapped") {
+    uint8_t str[UUID_STRING_SIZE + 1];
+    uuid.to_string(str);
+    file_path_ = cache_dir;
+    if (file_path_.size() > 0 && file_path_[file_path_.size() - 1] != '/')
+        file_path_.append("/");
+    file_path_.append((const char *) str, UUID_STRING_SIZE);
+
+    /*
+     * The index snapshot of COSS would not be kept up to date.
+     */
+    ::unlink((file_path_ + ".wpi").c_str());
+    file_path_.append(".wpc");
+
+    serial_number_ = 0;
+    stripe_range_ = 0;
+    if (!cache_size)
+        cache_size = CACHE_BASIC_SIZE;
+    map_size_ = ROUND_UP((uint64_t) cache_size * 1048576, sizeof(COSSStripe));
+    stripe_limit_ = map_size_ / sizeof(COSSStripe);
+    page_size_ = ::sysconf(_SC_PAGESIZE);
+    freshness_level_ = 0;
+    prefetch_due_ = new uint64_t[stripe_limit_];
+    memset(prefetch_due_, 0, sizeof(uint64_t) * stripe_limit_);
+    next_ = false;
+    next_range_ = 0;
+    read_action_ = 0;
+    memset(warming_, 0, sizeof warming_);
+
+    filter_.resize(stripe_limit_ * STRIPE_SEGMENT_COUNT);
+    cache_index_.reserve(stripe_limit_ * STRIPE_SEGMENT_COUNT);
+
+    fd_ = ::open(file_path_.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd_ < 0)
+        ERROR(log_) << "Could not open cache file " << file_path_ << ": " << strerror(errno);
+    if (!map_file()) {
+        ERROR(log_) << "Cache " << file_path_ << " is kept in memory only.";
+        if (fd_ >= 0)
+            ::close(fd_), fd_ = -1;
+        stripes_ = (COSSStripe *) ::mmap(0, map_size_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (stripes_ == MAP_FAILED)
+            HALT(log_) << "Could not allocate " << map_size_ << " bytes of cache: " << strerror(errno);
+    }
+    io_ = new COSSIoThread(fd_);
+    io_->start();
+    warm_ = (fd_ >= 0);
+
+    if (!read_file()) {
+        /*
+         * Nothing read from a file that is to be started afresh can stay,
+         * and the file is zeroed under the mapping.
+         */
+        cache_index_.clear();
+        filter_.resize(filter_.capacity());
+        serial_number_ = freshness_level_ = 0;
+        if (fd_ >= 0 && (::ftruncate(fd_, 0) != 0 || ::ftruncate(fd_, map_size_) != 0))
+            HALT(log_) << "Could not truncate cache file " << file_path_ << ": " << strerror(errno);
+        stripe_range_ = 0;
+        initialize_stripe(stripe_range_);
+    }
+
+    DEBUG(log_) << "Cache file: " << file_path_;
+    DEBUG(log_) << "Max size: " << map_size_;
+    DEBUG(log_) << "Stripe size: " << sizeof(COSSStripe);
+    DEBUG(log_) << "Serial: " << serial_number_;
+    DEBUG(log_) << "Stripe number: " << stripe_range_;
+}
+
+XCodecCacheMapped::~XCodecCacheMapped() {
+    if (read_action_)
+        read_action_->cancel();
+
+    for (int i = 0; i < FETCHED_STRIPE_COUNT; ++i) {
+        if (warming_[i]) {
+            io_->wait(warming_[i]);
+            delete warming_[i];
+        }
+    }
+    io_->stop();
+    delete io_;
+
+    /*
+     * What was written to the mapping is written back to the file by the
+     * kernel, as what COSS writes is.
+     */
+    ::munmap(stripes_, map_size_);
+    if (fd_ >= 0)
+        ::close(fd_);
+
+    delete[] prefetch_due_;
+
+    INFO(log_) << "Cache statistics: ";
+    INFO(log_) << "Lookups: " << stats_.lookups;
+    INFO(log_) << "Matches: " << (stats_.found_1 + stats_.found_2) << " (" << stats_.found_1 << " + " << stats_.found_2
+               << ")";
+    INFO(log_) << "Verified: " << stats_.verified;
+    INFO(log_) << "Filtered: " << stats_.filtered;
+    INFO(log_) << "File: " << file_path_;
+
+    DEBUG(log_) << "Closing mapped file: " << file_path_;
+    DEBUG(log_) << "Serial: " << serial_number_;
+    DEBUG(log_) << "Stripe number: " << stripe_range_;
+    DEBUG(log_) << "Index size: " << cache_index_.size();
+}
+
+/*
+ * A file that is not a whole number of stripes is started afresh, and one
+ * of another size is cut or extended to that of the cache.
+ */
+bool XCodecCacheMapped::map_file() {
+    struct stat st;
+    void *p;
+
+    if (fd_ < 0)
+        return false;
+    if (::fstat(fd_, &st) != 0 || (uint64_t) st.st_size % sizeof(COSSStripe) != 0) {
+        INFO(log_) << "Discarding cache file " << file_path_;
+        if (::ftruncate(fd_, 0) != 0)
+            return false;
+    }
+    if (::ftruncate(fd_, map_size_) != 0) {
+        ERROR(log_) << "Could not size cache file " << file_path_ << ": " << strerror(errno);
+        return false;
+    }
+
+    p = ::mmap(0, map_size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+    if (p == MAP_FAILED) {
+        ERROR(log_) << "Could not map cache file " << file_path_ << ": " << strerror(errno);
+        return false;
+    }
+    stripes_ = (COSSStripe *) p;
+
+    /*
+     * Segments are looked up from all over the file, the kernel is told
+     * what to read ahead by prefetch_stripe.
+     */
+    advise(stripes_, map_size_, MADV_RANDOM);
+    return true;
+}
+
+bool XCodecCacheMapped::read_file() {
+    COSSIndexEntry entry;
+    const COSSIndexEntry *other;
+    uint64_t serial, range, level;
+    uint64_t hash;
+
+    serial = range = level = 0;
+
+    for (uint64_t n = 0; n < stripe_limit_; ++n)
+        advise(&stripes_[n].header, sizeof(COSSStripeHeader), MADV_WILLNEED);
+
+    for (uint64_t n = 0; n < stripe_limit_; ++n) {
+        COSSStripeHeader &header = stripes_[n].header;
+
+        if (header.metadata.signature == 0)
+            continue;
+        if (header.metadata.signature != CACHE_SIGNATURE)
+            return false;
+        if (header.metadata.version != CACHE_VERSION) {
+            INFO(log_) << "Discarding cache file of version " << header.metadata.version;
+            return false;
+        }
+        if (header.metadata.segment_count > STRIPE_SEGMENT_COUNT)
+            return false;
+        if (header.metadata.stripe_range != n)
+            header.metadata.stripe_range = n;
+
+        if (header.metadata.serial_number > serial)
+            serial = header.metadata.serial_number, range = n;
+        if (header.metadata.freshness > level)
+            level = header.metadata.freshness;
+
+        for (int i = 0; i < STRIPE_SEGMENT_COUNT; ++i) {
+            if ((hash = header.hash_array[i])) {
+                /*
+                 * As in COSS, the latest stripe to hold a hash has it.
+                 */
+                if ((other = cache_index_.lookup(hash)) &&
+                    stripes_[other->stripe_range].header.metadata.serial_number > header.metadata.serial_number)
+                    continue;
+                entry.stripe_range = n;
+                entry.touched = 0;
+                entry.position = i;
+                entry.fingerprint = header.fingerprint_array[i];
+                cache_index_.insert(hash, entry);
+                filter_.insert(hash);
+            }
+        }
+    }
+
+    if (serial > 0) {
+        serial_number_ = serial;
+        stripe_range_ = range;
+        freshness_level_ = level;
+    } else {
+        initialize_stripe(stripe_range_);
+    }
+
+    return true;
+}
+
+void XCodecCacheMapped::enter(const uint64_t &hash, const Buffer &buf, unsigned off, unsigned length) {
+    COSSIndexEntry entry;
+
+    ASSERT(log_, length > 0 && length <= XCODEC_SEGMENT_LENGTH);
+
+    while (stripes_[stripe_range_].header.metadata.segment_index >= STRIPE_SEGMENT_COUNT)
+        new_active();
+
+    COSSStripe &act = stripes_[stripe_range_];
+    act.header.hash_array[act.header.metadata.segment_index] = hash;
+    act.header.flags[act.header.metadata.segment_index] =
+            (length < XCODEC_SEGMENT_LENGTH ? length << SEGMENT_LENGTH_SHIFT : 0);
+    buf.copyout(act.segment_array[act.header.metadata.segment_index].bytes, off, length);
+    act.header.fingerprint_array[act.header.metadata.segment_index] =
+            XCodecFingerprint::compute(act.segment_array[act.header.metadata.segment_index].bytes, length);
+    entry.stripe_range = stripe_range_;
+    entry.touched = 0;
+    entry.position = act.header.metadata.segment_index;
+    entry.fingerprint = act.header.fingerprint_array[act.header.metadata.segment_index];
+
+    act.header.metadata.segment_index++;
+    while (act.header.metadata.segment_index < STRIPE_SEGMENT_COUNT &&
+           act.header.hash_array[act.header.metadata.segment_index])
+        act.header.metadata.segment_index++;
+    act.header.metadata.segment_count++;
+    act.header.metadata.freshness = ++freshness_level_;
+    if (!next_ && act.header.metadata.segment_index >= STRIPE_PREPARE_INDEX)
+        prepare_active();
+
+    cache_index_.insert(hash, entry);
+
+    filter_.insert(hash);
+    if (filter_.saturated() && !filter_.rebuilding())
+        cache_index_.rebuild(filter_);
+}
+
+void XCodecCacheMapped::replace(const uint64_t &hash, const Buffer &buf, unsigned off, unsigned length) {
+#ifdef USING_XCODEC_CACHE_RECENT_WINDOW
+    forget(hash);
+#endif
+    enter(hash, buf, off, length);
+}
+
+/*
+ * The segment is appended from the mapping, and the recent window points
+ * into it.
+ */
+bool XCodecCacheMapped::lookup(const uint64_t &hash, Buffer &buf) {
+    const COSSIndexEntry *entry;
+    const uint8_t *data;
+    unsigned length;
+
+    stats_.lookups++;
+
+    if (!filter_.maybe_contains(hash)) {
+        stats_.filtered++;
+        return false;
+    }
+
+#ifdef USING_XCODEC_CACHE_RECENT_WINDOW
+    if ((data = find_recent(hash, &length))) {
+        buf.append(data, length);
+        stats_.found_1++;
+        return true;
+    }
+#endif
+
+    if (!(entry = cache_index_.lookup(hash)))
+        return false;
+
+    COSSStripe &stripe = stripes_[entry->stripe_range];
+    if (stripe.header.hash_array[entry->position] != hash)
+        return false;
+    prefetch_stripe(entry->stripe_range);
+
+    stripe.header.metadata.freshness = ++freshness_level_;
+    stripe.header.metadata.uses++;
+    stripe.header.metadata.credits++;
+    stripe.header.metadata.load_uses++;
+    stripe.header.flags[entry->position] |= SEGMENT_FLAG_LOADED_USE | SEGMENT_FLAG_PURGE_USE;
+
+    data = stripe.segment_array[entry->position].bytes;
+    if (!(length = stripe.header.flags[entry->position] >> SEGMENT_LENGTH_SHIFT))
+        length = XCODEC_SEGMENT_LENGTH;
+#ifdef USING_XCODEC_CACHE_RECENT_WINDOW
+    remember(hash, data, length);
+#endif
+    buf.append(data, length);
+    stats_.found_2++;
+    return true;
+}
+
+bool XCodecCacheMapped::contains(const uint64_t &hash) {
+    if (!filter_.maybe_contains(hash)) {
+        stats_.filtered++;
+        return false;
+    }
+    return (cache_index_.lookup(hash) != 0);
+}
+
+/*
+ * Only the header of the stripe is touched, which is used often enough to
+ * stay in memory.
+ */
+bool XCodecCacheMapped::verify(const uint64_t &hash, uint64_t fingerprint) {
+    const COSSIndexEntry *entry;
+
+    if (!(entry = cache_index_.lookup(hash)) || entry->fingerprint != fingerprint)
+        return false;
+
+    COSSStripe &stripe = stripes_[entry->stripe_range];
+    stripe.header.metadata.freshness = ++freshness_level_;
+    stripe.header.metadata.uses++;
+    stripe.header.metadata.credits++;
+    stripe.header.flags[entry->position] |= SEGMENT_FLAG_PURGE_USE;
+
+    stats_.verified++;
+    return true;
+}
+
+/*
+ * A segment is ready if its page is in the page cache.  Otherwise the
+ * thread reads the rest of the stripe along with it, unless enough stripes
+ * are being read already, and those waiting are called back from on_read.
+ */
+bool XCodecCacheMapped::ready(const uint64_t &hash) {
+    const COSSIndexEntry *entry;
+    int slot;
+
+    if (!warm_ || !filter_.maybe_contains(hash) || !(entry = cache_index_.lookup(hash)))
+        return true;
+
+#ifdef USING_XCODEC_CACHE_RECENT_WINDOW
+    unsigned length;
+    if (find_recent(hash, &length))
+        return true;
+#endif
+
+    collect();
+    if (!warm_ || entry->stripe_range == stripe_range_ || resident(entry))
+        return true;
+
+    if (warming_slot(entry->stripe_range) < 0) {
+        for (slot = 0; slot < FETCHED_STRIPE_COUNT; ++slot) {
+            if (!warming_[slot]) {
+                warming_[slot] = io_->read(entry->stripe_range * sizeof(COSSStripe) + offsetof(COSSStripe, segment_array),
+                                           NULL, sizeof stripes_[0].segment_array);
+                break;
+            }
+        }
+    }
+
+    if (!read_action_)
+        read_action_ = event_system.track(io_->notifier(), StreamModeRead, callback(this, &XCodecCacheMapped::on_read));
+    return false;
+}
+
+void XCodecCacheMapped::initialize_stripe(uint64_t range) {
+    COSSStripeHeader &header = stripes_[range].header;
+
+    memset(&header, 0, sizeof header);
+    header.metadata.signature = CACHE_SIGNATURE;
+    header.metadata.version = CACHE_VERSION;
+    header.metadata.serial_number = ++serial_number_;
+    header.metadata.stripe_range = range;
+}
+
+/*
+ * Advice is given in whole pages, those the range is in.
+ */
+void XCodecCacheMapped::advise(const void *addr, size_t length, int advice) {
+    uintptr_t start = (uintptr_t) addr;
+    uintptr_t end = start + length;
+
+    start -= start % page_size_;
+    if (::madvise((void *) start, end - start, advice) != 0)
+        DEBUG(log_) << "Could not advise " << length << " bytes of the mapping: " << strerror(errno);
+}
+
+/*
+ * Neighbours of a segment looked up are likely to be looked up next, so
+ * the kernel is asked to read the whole stripe, and to read it again after
+ * a while in case it was let go of meanwhile.
+ */
+void XCodecCacheMapped::prefetch_stripe(uint64_t range) {
+    if (prefetch_due_[range] > freshness_level_)
+        return;
+    prefetch_due_[range] = freshness_level_ + MAPPED_PREFETCH_AGE;
+    advise(stripes_[range].segment_array, sizeof stripes_[range].segment_array, MADV_WILLNEED);
+}
+
+bool XCodecCacheMapped::resident(const COSSIndexEntry *entry) {
+    uintptr_t start = (uintptr_t) stripes_[entry->stripe_range].segment_array[entry->position].bytes;
+    uintptr_t end = start + XCODEC_SEGMENT_LENGTH;
+    unsigned char vec[XCODEC_SEGMENT_LENGTH / 4096 + 2];
+
+    start -= start % page_size_;
+    if (::mincore((void *) start, end - start, vec) != 0)
+        return true;
+    for (size_t i = 0; i < (end - start + page_size_ - 1) / page_size_; ++i)
+        if (!(vec[i] & 1))
+            return false;
+    return true;
+}
+
+int XCodecCacheMapped::warming_slot(uint64_t range) {
+    for (int slot = 0; slot < FETCHED_STRIPE_COUNT; ++slot)
+        if (warming_[slot] && warming_[slot]->position / sizeof(COSSStripe) == range)
+            return slot;
+    return -1;
+}
+
+/*
+ * After a failed read, segments are left to be read when they are looked
+ * up rather than asked for again and again.
+ */
+void XCodecCacheMapped::collect() {
+    for (int slot = 0; slot < FETCHED_STRIPE_COUNT; ++slot) {
+        if (warming_[slot] && io_->done(warming_[slot])) {
+            if (!warming_[slot]->ok) {
+                ERROR(log_) << "Could not read stripe " << warming_[slot]->position / sizeof(COSSStripe)
+                            << " of cache file " << file_path_;
+                warm_ = false;
+            }
+            delete warming_[slot];
+            warming_[slot] = 0;
+        }
+    }
+}
+
+void XCodecCacheMapped::on_read(Event e) {
+    if (read_action_)
+        read_action_->cancel(), read_action_ = 0;
+
+    io_->drain();
+    collect();
+    fetched();
+}
+
+/*
+ * The next active stripe is chosen once the active one is mostly full, so
+ * that what is kept of it is in memory by the time it is needed.
+ */
+void XCodecCacheMapped::prepare_active() {
+    next_range_ = best_erasable_stripe();
+    next_ = true;
+    if (stripes_[next_range_].header.metadata.signature == CACHE_SIGNATURE)
+        advise(&stripes_[next_range_], sizeof(COSSStripe), MADV_WILLNEED);
+}
+
+/*
+ * The pages of the stripe that is no longer active are let go of by the
+ * mapping, and are written back and then reclaimed by the kernel before
+ * those still mapped unless they are looked up again.  Pages of a mapping
+ * of no file would be zeroed instead, under the segments still indexed.
+ */
+void XCodecCacheMapped::new_active() {
+    if (fd_ >= 0)
+        advise(stripes_[stripe_range_].segment_array, sizeof stripes_[stripe_range_].segment_array, MADV_DONTNEED);
+    prefetch_due_[stripe_range_] = 0;
+
+    if (!next_)
+        prepare_active();
+    stripe_range_ = next_range_;
+    next_ = false;
+
+    if (stripes_[stripe_range_].header.metadata.signature == CACHE_SIGNATURE)
+        purge_stripe(stripe_range_);
+    else
+        initialize_stripe(stripe_range_);
+
+    if (filter_.rebuilding())
+        cache_index_.carry(filter_);
+}
+
+uint64_t XCodecCacheMapped::best_erasable_stripe() {
+    uint64_t v, n = 0xFFFFFFFFFFFFFFFFull;
+    uint64_t i, j = 0;
+
+    for (i = 0; i < stripe_limit_; ++i) {
+        const COSSMetadata &m = stripes_[i].header.metadata;
+        if (i == stripe_range_ && stripe_limit_ > 1)
+            continue;
+        if (m.signature == 0)
+            return i;
+        if ((v = m.freshness + m.uses) < n)
+            j = i, n = v;
+    }
+
+    return j;
+}
+
+/*
+ * As in COSS, but what the recent window has of the stripe is forgotten
+ * here, before its segments are written over.
+ */
+void XCodecCacheMapped::purge_stripe(uint64_t range) {
+    COSSStripeHeader &header = stripes_[range].header;
+    const COSSIndexEntry *entry;
+
+    for (int i = STRIPE_SEGMENT_COUNT - 1; i >= 0; --i) {
+        uint64_t hash = header.hash_array[i];
+#ifdef USING_XCODEC_CACHE_RECENT_WINDOW
+        if (header.flags[i] & SEGMENT_FLAG_LOADED_USE)
+            forget(hash);
+#endif
+        if (hash && !((entry = cache_index_.lookup(hash)) &&
+                      entry->stripe_range == range && entry->position == (unsigned) i)) {
+            header.hash_array[i] = 0;
+            header.flags[i] = 0;
+            header.metadata.segment_count--;
+        } else if (hash && !(header.flags[i] & SEGMENT_FLAG_PURGE_USE)) {
+            cache_index_.erase(hash);
+            evicted(hash);
+            header.hash_array[i] = 0;
+            header.flags[i] = 0;
+            header.metadata.segment_count--;
+        }
+
+        header.flags[i] &= ~(SEGMENT_FLAG_LOADED_USE | SEGMENT_FLAG_PURGE_USE);
+        if (!header.hash_array[i])
+            header.metadata.segment_index = i;
+    }
+
+    header.metadata.serial_number = ++serial_number_;
+    header.metadata.uses = header.metadata.credits;
+    header.metadata.credits = 0;
+    header.metadata.load_uses = 0;
+
+    if (header.metadata.segment_count >= STRIPE_SEGMENT_COUNT)
+        INFO(log_) << "No more space available in cache";
+}
@@ -0,0 +1,125 @@
+#ifndef    XCODEC_XCODEC_CACHE_MAPPED_H
+#define    XCODEC_XCODEC_CACHE_MAPPED_H
+
+#include <string>
+
+#include "../../../event/event_system.h"
+#include "../../../xcodec/xcodec.h"
+#include "../../../xcodec/xcodec_cache.h"
+#include "./xcodec_cache_coss.h"
+#include "./xcodec_cache_coss_io.h"
+
+////////////////////////////////////////////////////////////////////////////////
+//                                                                            //
+// File:           xcodec_cache_mapped.h                                      //
+// Description:    persistent cache in a file mapped into memory              //
+// Project:        WANProxy XTech                                             //
+// Last modified:  2026-10-18                                                 //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+
+/*
+ * - The file is that of COSS, stripes of the same layout one after the
+ * other, but it is mapped whole into memory rather than read a stripe at a
+ * time into slots.  Which parts of it are in memory is left to the page
+ * cache of the kernel, so it follows what is used however many stripes
+ * that is.
+ *
+ * - Segments are entered straight into the active stripe in the mapping,
+ * and looked up from wherever they are in it.  Stripe headers are kept
+ * up to date in place, so there is nothing to write back on a change of
+ * active stripe or on closing, and no directory besides them.
+ *
+ * - The file is made as long as the cache is from the start.  Stripes
+ * never written have zeroes for a header and are taken first when a new
+ * active stripe is wanted.  A file left by COSS is used as it is, but one
+ * that is not full yet is started afresh by COSS.
+ *
+ * - The stripe a segment is looked up from is asked of the kernel whole,
+ * as COSS would read it into a slot, and so is the next active stripe
+ * once the active one is mostly full.  A stripe that is no longer active
+ * is given up first when memory is short, unless it is used meanwhile.
+ *
+ * - A segment not in memory is read by the thread of COSS into the page
+ * cache before it is said to be ready, so that a lookup of it does not
+ * stop the event loop for the disk.
+ *
+ */
+
+/*
+ * Freshness a stripe may go without being looked up from before the
+ * kernel is asked for it again, the segments that would pass through as
+ * many slots as COSS has.
+ */
+#define MAPPED_PREFETCH_AGE        (STRIPE_SEGMENT_COUNT * LOADED_STRIPE_COUNT)
+
+class XCodecCacheMapped : public XCodecCache {
+    std::string file_path_;
+    int fd_;
+    COSSStripe *stripes_;
+    size_t map_size_;
+    size_t page_size_;
+    COSSIoThread *io_;
+    Action *read_action_;
+    COSSIoRequest *warming_[FETCHED_STRIPE_COUNT];
+    bool warm_;
+
+    uint64_t serial_number_;
+    uint64_t stripe_range_;
+    uint64_t stripe_limit_;
+    uint64_t freshness_level_;
+    uint64_t *prefetch_due_;
+    bool next_;
+    uint64_t next_range_;
+
+    COSSIndex cache_index_;
+    COSSStats stats_;
+    LogHandle log_;
+
+public:
+    XCodecCacheMapped(const UUID &uuid, const std::string &cache_dir, size_t cache_size,
+                      unsigned family = XCODEC_HASH_FAMILY_LEGACY, unsigned segment_length = XCODEC_SEGMENT_LENGTH);
+
+    ~XCodecCacheMapped();
+
+    virtual void enter(const uint64_t &hash, const Buffer &buf, unsigned off, unsigned length);
+
+    virtual void replace(const uint64_t &hash, const Buffer &buf, unsigned off, unsigned length);
+
+    virtual bool lookup(const uint64_t &hash, Buffer &buf);
+
+    virtual bool contains(const uint64_t &hash);
+
+    virtual bool verify(const uint64_t &hash, uint64_t fingerprint);
+
+    virtual bool ready(const uint64_t &hash);
+
+private:
+    bool map_file();
+
+    bool read_file();
+
+    void initialize_stripe(uint64_t range);
+
+    void advise(const void *addr, size_t length, int advice);
+
+    void prefetch_stripe(uint64_t range);
+
+    bool resident(const COSSIndexEntry *entry);
+
+    int warming_slot(uint64_t range);
+
+    void collect();
+
+    void on_read(Event e);
+
+    void prepare_active();
+
+    void new_active();
+
+    uint64_t best_erasable_stripe();
+
+    void purge_stripe(uint64_t range);
+};
+
+#endif /* !XCODEC_XCODEC_CACHE_MAPPED_H */
@@ -50,14 +50,17 @@
 
 /*
  * Usage:
- * 	<MAGIC> <OP_EXTRACT> data[uint8_t x XCODEC_SEGMENT_LENGTH]
+ * 	<MAGIC> <OP_EXTRACT> data[uint8_t x segment length]
  *
  * Effects:
- * 	The `data' is hashed, the hash is associated with the data if possible
+ * 	The `data', as long as the segments of the cache of the encoder, as
+ * 	told in <HELLO>, is hashed, the hash is associated with the data if possible
  * 	and the data is inserted into the output stream.
  *
- * 	If other data is already known by the hash of `data', error will be
- * 	indicated from the decoder.
+ * 	If other data is already known by the hash of `data', the decoder
+ * 	replaces it with `data'.  An encoder that finds the hash of `data'
+ * 	taken by other data counts the collision and sends `data' otherwise,
+ * 	as OP_EXTRACT_TAGGED if a collision counter is left for it.
  *
  */
 #define    XCODEC_OP_EXTRACT    ((uint8_t)0x01)
@@ -75,6 +78,178 @@
  */
 #define    XCODEC_OP_REF        ((uint8_t)0x02)
 
-#define    XCODEC_SEGMENT_LENGTH    (2048)
+/*
+ * Usage:
+ * 	<MAGIC> <OP_CHUNK> length[uint16_t] data[uint8_t x length]
+ *
+ * Effects:
+ * 	Same as OP_EXTRACT for a content-defined chunk of `length' bytes, which
+ * 	must not exceed the segment length.  Chunks of exactly that length are
+ * 	sent with OP_EXTRACT instead.
+ *
+ * 	Chunks are referenced with OP_REF like any other segment.
+ *
+ */
+#define    XCODEC_OP_CHUNK        ((uint8_t)0x03)
+
+/*
+ * Usage:
+ * 	<MAGIC> <OP_REF_RUN> hash[uint64_t] count[uint16_t]
+ *
+ * Effects:
+ * 	Same as `count' OP_REFs, the first one to `hash' and each of the others
+ * 	to the segment that followed the previous one when it was last declared
+ * 	or referenced in this stream.  `count' is at least 2 and no more than
+ * 	XCODEC_RUN_MAX.
+ *
+ * 	If any of the hashes is not known, OP_ASKs will be sent in response
+ * 	and none of the run is inserted until all of them are.
+ *
+ */
+#define    XCODEC_OP_REF_RUN    ((uint8_t)0x04)
+
+/*
+ * Usage:
+ * 	<MAGIC> <OP_REF_RANGE> hash[uint64_t] offset[uint16_t] length[uint16_t]
+ *
+ * Effects:
+ * 	The `length' bytes at `offset' of the data associated with the hash
+ * 	`hash' are inserted into the output stream.  Unlike OP_REF it does not
+ * 	count as a reference to the segment for the purposes of OP_REF_RUN.
+ *
+ * 	If the `hash' is not known, an OP_ASK will be sent in response.
+ *
+ */
+#define    XCODEC_OP_REF_RANGE    ((uint8_t)0x05)
+
+/*
+ * Usage:
+ * 	<MAGIC> <OP_DELTA> base[uint64_t] length[uint16_t] size[uint16_t] patch[size]
+ *
+ * Effects:
+ * 	The `length' bytes that the patch builds out of the data associated
+ * 	with the hash `base' are inserted into the output stream, as described
+ * 	in xcodec_delta.h.  They are also associated with their own hash, as
+ * 	with OP_EXTRACT, unless that hash is already in use, which may be
+ * 	because they collide with the base.  Unlike OP_EXTRACT it does not
+ * 	count as a declaration for the purposes of OP_REF_RUN.
+ *
+ * 	If the `base' is not known, an OP_ASK will be sent in response.
+ *
+ */
+#define    XCODEC_OP_DELTA    ((uint8_t)0x06)
+
+/*
+ * Usage:
+ * 	<MAGIC> <OP_BACKREF> index[uint8_t]
+ *
+ * Effects:
+ * 	Same as OP_REF to the segment `index' places back in the window of
+ * 	the segments last declared or referenced in this stream, 0 being the
+ * 	last one, as described in xcodec_window.h.  Only sent if the peer has
+ * 	agreed to a window of more than `index' segments.
+ *
+ */
+#define    XCODEC_OP_BACKREF    ((uint8_t)0x07)
+
+/*
+ * Usage:
+ * 	<MAGIC> <OP_REF_SUPER> name[uint64_t] start[uint16_t] count[uint16_t]
+ *
+ * Effects:
+ * 	Same as `count' OP_REFs to the segments from `start' on of the
+ * 	superchunk `name', as described in xcodec_super.h.  `count' is at
+ * 	least 2.
+ *
+ * 	If the superchunk is not known, an OP_ASK_SUPER will be sent in
+ * 	response and decoding waits for the OP_LEARN_SUPER.  If any of its
+ * 	segments is not known, OP_ASKs will be sent as for OP_REF_RUN.
+ *
+ */
+#define    XCODEC_OP_REF_SUPER    ((uint8_t)0x08)
+
+/*
+ * Usage:
+ * 	<MAGIC> <OP_EXTRACT_TAGGED> tag[uint8_t] length[uint16_t] data[uint8_t x length]
+ *
+ * Effects:
+ * 	Same as OP_EXTRACT, or OP_CHUNK if `length' is less than the segment
+ * 	length, for data whose hash is already in use by other
+ * 	data.  The data is associated with its hash tagged with the collision
+ * 	counter `tag', as described in xcodec_hash.h, and is referenced by
+ * 	that name.  `tag' is from 1 to XCODEC_TAG_MAX.
+ *
+ */
+#define    XCODEC_OP_EXTRACT_TAGGED    ((uint8_t)0x09)
+
+/*
+ * Usage:
+ * 	<MAGIC> <OP_REF_PEER> hash[uint64_t] fingerprint[uint64_t]
+ *
+ * Effects:
+ * 	The data associated with the hash `hash' in the namespace of the
+ * 	decoder, that is data the decoder itself has sent to the encoder, is
+ * 	inserted into the output stream.  Its fingerprint, as described in
+ * 	xcodec_fingerprint.h, must be `fingerprint'.  Unlike OP_REF it does
+ * 	not count as a reference for the purposes of OP_REF_RUN, OP_BACKREF
+ * 	or superchunks, which are all of the namespace of the encoder.
+ *
+ * 	If the decoder no longer has the segment, an OP_ASK_PEER will be sent
+ * 	in response.
+ *
+ */
+#define    XCODEC_OP_REF_PEER    ((uint8_t)0x0a)
+
+/*
+ * Usage:
+ * 	<MAGIC> <OP_REF_SHARED> namespace[uint8_t] hash[uint64_t] fingerprint[uint64_t]
+ *
+ * Effects:
+ * 	Same as OP_REF_PEER for the data associated with the hash `hash' in
+ * 	the cache of a third side that both the encoder and the decoder hold
+ * 	a copy of.  `namespace' is the place of its UUID in the list the
+ * 	encoder sent in <HELLO>, as described in xcodec_hello.h.
+ *
+ * 	If the decoder does not have the segment in its copy, an
+ * 	OP_ASK_SHARED will be sent in response.
+ *
+ */
+#define    XCODEC_OP_REF_SHARED    ((uint8_t)0x0b)
+
+/*
+ * Each cache has segments of one of these lengths, all of them powers of two,
+ * and the two directions of a connection may use different ones.  The
+ * longest is also the default, and what a 3.0.x peer uses.
+ */
+#define    XCODEC_SEGMENT_LENGTH        (2048)
+#define    XCODEC_SEGMENT_LENGTH_MIN    (512)
+#define    XCODEC_SEGMENT_LENGTHS        (3)
+
+#define    XCODEC_SEGMENT_LENGTH_VALID(l)    ((l) >= XCODEC_SEGMENT_LENGTH_MIN && (l) <= XCODEC_SEGMENT_LENGTH && \
+                                         ((l) & ((l) - 1)) == 0)
+
+#define    XCODEC_RUN_MAX        (1024)
+
+#define    XCODEC_TAG_MAX        (3)
+
+/*
+ * Hash functions that segments can be named by.  The encoder uses that of
+ * its cache, and the decoder that of the peer, as told in <HELLO>.
+ */
+#define    XCODEC_HASH_FAMILY_LEGACY    (0x01)    /* Two Adler-style sums.  */
+#define    XCODEC_HASH_FAMILY_POLYNOMIAL    (0x02)    /* Polynomial mod 2^61 - 1, then mixed.  */
+
+#define    XCODEC_HASH_FAMILIES_ALL    (XCODEC_HASH_FAMILY_LEGACY | XCODEC_HASH_FAMILY_POLYNOMIAL)
+
+/*
+ * Optional behaviour of the encoder.  The decoder accepts all of the opcodes
+ * above regardless.
+ */
+#define    XCODEC_OPTION_CHUNKING    (0x0001)    /* Content-defined chunks.  */
+#define    XCODEC_OPTION_RUNS        (0x0002)    /* Runs and match extension.  */
+#define    XCODEC_OPTION_DELTA        (0x0004)    /* Patches against similar segments.  */
+#define    XCODEC_OPTION_SUPER        (0x0008)    /* Runs along recorded superchunks.  */
+#define    XCODEC_OPTION_PEER        (0x0010)    /* References to the peer's segments.  */
+#define    XCODEC_OPTION_SHARED        (0x0020)    /* References to shared namespaces.  */
 
 #endif /* !XCODEC_XCODEC_H */
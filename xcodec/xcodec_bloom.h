@@ -0,0 +1,161 @@
+#ifndef    XCODEC_XCODEC_BLOOM_H
+#define    XCODEC_XCODEC_BLOOM_H
+
+#include <vector>
+
+////////////////////////////////////////////////////////////////////////////////
+//                                                                            //
+// File:           xcodec_bloom.h                                             //
+// Description:    negative lookup filter in front of the xcodec caches       //
+// Project:        WANProxy XTech                                             //
+// Last modified:  2026-10-18                                                 //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+
+#define    XCODEC_BLOOM_BITS_PER_ENTRY    16
+#define    XCODEC_BLOOM_MIN_CAPACITY      65536
+
+/*
+ * Blocked Bloom filter: each hash sets or tests one bit in each of the eight
+ * words of a single 32-byte block, so a probe touches one cache line.  With
+ * sixteen bits per entry fewer than one in a hundred misses get through to the
+ * cache index.
+ *
+ * Bits cannot be taken out, so entries evicted from the cache linger in the
+ * filter until the owner rebuilds it from its index, which it should do once
+ * saturated() tells that more entries went in than it was sized for.  So as
+ * not to stop for it, the owner may instead rebuild it a part at a time:
+ * once begun, entries inserted go into the filter being built as well as
+ * into this one, the owner carries over what it still holds bit by bit, and
+ * the new filter is taken up once it is all there.
+ */
+class XCodecBloomFilter {
+    struct Block {
+        uint32_t words_[8];
+    } __attribute__((aligned(32)));
+
+    std::vector<Block> blocks_;
+    size_t capacity_;
+    size_t count_;
+    std::vector<Block> next_;
+    size_t next_capacity_;
+    size_t next_count_;
+
+public:
+    XCodecBloomFilter(void)
+            : blocks_(),
+              capacity_(0),
+              count_(0),
+              next_(),
+              next_capacity_(0),
+              next_count_(0) {}
+
+    ~XCodecBloomFilter() {}
+
+    size_t capacity(void) const {
+        return (capacity_);
+    }
+
+    /*
+     * Empties the filter and sizes it for `capacity' entries.
+     */
+    void resize(size_t capacity) {
+        size(blocks_, capacity);
+        capacity_ = capacity;
+        count_ = 0;
+        std::vector<Block>().swap(next_);
+    }
+
+    void insert(const uint64_t &hash) {
+        set(blocks_, hash);
+        count_++;
+        if (!next_.empty())
+            carry(hash);
+    }
+
+    bool maybe_contains(const uint64_t &hash) const {
+        uint32_t mask[8];
+        const Block &b = blocks_[locate(blocks_, hash, mask)];
+        uint32_t miss = 0;
+
+        for (unsigned i = 0; i < 8; i++)
+            miss |= mask[i] & ~b.words_[i];
+        return (miss == 0);
+    }
+
+    bool saturated(void) const {
+        return (count_ > capacity_ + capacity_ / 4);
+    }
+
+    /*
+     * Starts building a filter for `capacity' entries to take the place of
+     * this one.
+     */
+    void rebuild(size_t capacity) {
+        size(next_, capacity);
+        next_capacity_ = capacity;
+        next_count_ = 0;
+    }
+
+    bool rebuilding(void) const {
+        return (!next_.empty());
+    }
+
+    /*
+     * Puts an entry the owner still holds into the filter being built.
+     */
+    void carry(const uint64_t &hash) {
+        set(next_, hash);
+        next_count_++;
+    }
+
+    /*
+     * Takes up the filter being built, once all the owner holds is in it.
+     */
+    void rebuilt(void) {
+        blocks_.swap(next_);
+        capacity_ = next_capacity_;
+        count_ = next_count_;
+        std::vector<Block>().swap(next_);
+    }
+
+private:
+    static void size(std::vector<Block> &blocks, size_t capacity) {
+        size_t n = (capacity * XCODEC_BLOOM_BITS_PER_ENTRY + 255) / 256;
+
+        blocks.assign(n > 0 ? n : 1, Block());
+    }
+
+    static void set(std::vector<Block> &blocks, const uint64_t &hash) {
+        uint32_t mask[8];
+        Block &b = blocks[locate(blocks, hash, mask)];
+
+        for (unsigned i = 0; i < 8; i++)
+            b.words_[i] |= mask[i];
+    }
+
+    /*
+     * The rolling hashes have few bits of entropy in some places, so they
+     * are mixed before picking the block and the bits within it.
+     */
+    static size_t locate(const std::vector<Block> &blocks, uint64_t hash, uint32_t *mask) {
+        static const uint32_t salt[8] = {
+            0x47b6137bu, 0x44974d91u, 0x8824ad5bu, 0xa2b7289du,
+            0x705495c7u, 0x2df1424bu, 0x9efc4947u, 0x5c6bfb31u
+        };
+
+        hash ^= hash >> 33;
+        hash *= 0xff51afd7ed558ccdull;
+        hash ^= hash >> 33;
+        hash *= 0xc4ceb9fe1a85ec53ull;
+        hash ^= hash >> 33;
+
+        uint32_t key = (uint32_t) hash;
+        for (unsigned i = 0; i < 8; i++)
+            mask[i] = 1u << ((key * salt[i]) >> 27);
+
+        return (((hash >> 32) * blocks.size()) >> 32);
+    }
+};
+
+#endif /* !XCODEC_XCODEC_BLOOM_H */
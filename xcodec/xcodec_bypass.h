@@ -0,0 +1,160 @@
+#ifndef    XCODEC_XCODEC_BYPASS_H
+#define    XCODEC_XCODEC_BYPASS_H
+
+#include <cmath>
+
+#include "../common/buffer.h"
+
+////////////////////////////////////////////////////////////////////////////////
+//                                                                            //
+// File:           xcodec_bypass.h                                            //
+// Description:    detection of data not worth encoding in an xcodec stream   //
+// Project:        WANProxy XTech                                             //
+// Last modified:  2026-10-18                                                 //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+
+/*
+ * Bytes of each input whose entropy is measured, and the least that make a
+ * measure worth taking.  Fewer than a few times 256 bytes cannot come near
+ * 8 bits per byte however random they are.
+ */
+#define    XCODEC_BYPASS_SAMPLE        (4096)
+#define    XCODEC_BYPASS_SAMPLE_MIN    (1024)
+
+/*
+ * Bits per byte above which data is taken for encrypted or compressed.
+ */
+#define    XCODEC_BYPASS_ENTROPY        (7.5)
+
+/*
+ * Bytes encoded before each decision, and the share of them that must have
+ * matched the cache for encoding to go on, as a fraction 1 / n.
+ */
+#define    XCODEC_BYPASS_PROBE        (65536)
+#define    XCODEC_BYPASS_MATCH_SHARE    (16)
+
+/*
+ * Bytes sent as they are before probing again, doubled each time that the
+ * probe finds nothing to gain, up to the maximum.
+ */
+#define    XCODEC_BYPASS_SPAN        (1 << 20)
+#define    XCODEC_BYPASS_SPAN_MAX        (8 << 20)
+
+/*
+ * Tells, for each input of a stream, whether to encode it or to send it as
+ * it is.  Data is encoded for a probe, after which it is sent as it is for a
+ * span if it was nearly all of high entropy and hardly any of it was found
+ * in the cache.  Each input of low entropy is encoded, and puts an end to
+ * the span, as the stream has gone on to data of another kind.
+ */
+class XCodecBypass {
+    bool bypassing_;
+    bool dense_;
+    uint64_t probed_;
+    uint64_t probed_dense_;
+    uint64_t matched_;
+    uint64_t remaining_;
+    uint64_t span_;
+    uint64_t bypassed_bytes_;
+    uint64_t regions_;
+
+public:
+    XCodecBypass(void)
+            : bypassing_(false),
+              dense_(false),
+              probed_(0),
+              probed_dense_(0),
+              matched_(0),
+              remaining_(0),
+              span_(XCODEC_BYPASS_SPAN),
+              bypassed_bytes_(0),
+              regions_(0) {}
+
+    ~XCodecBypass() {}
+
+    bool bypass(const Buffer &input) {
+        unsigned length = input.length();
+
+        if (length >= XCODEC_BYPASS_SAMPLE_MIN)
+            dense_ = (entropy(input) >= XCODEC_BYPASS_ENTROPY);
+        else
+            dense_ = bypassing_;
+
+        if (!bypassing_)
+            return (false);
+
+        if (!dense_) {
+            bypassing_ = false;
+            span_ = XCODEC_BYPASS_SPAN;
+            return (false);
+        }
+
+        bypassed_bytes_ += length;
+        remaining_ -= std::min<uint64_t>(remaining_, length);
+        if (remaining_ == 0)
+            bypassing_ = false;
+        return (true);
+    }
+
+    /*
+     * After an input given to bypass() is encoded, of whose `length' bytes
+     * `matched' were sent as references.
+     */
+    void encoded(unsigned length, uint64_t matched) {
+        probed_ += length;
+        if (dense_)
+            probed_dense_ += length;
+        matched_ += matched;
+        if (probed_ < XCODEC_BYPASS_PROBE)
+            return;
+
+        if (probed_dense_ * 8 >= probed_ * 7 && matched_ * XCODEC_BYPASS_MATCH_SHARE < probed_) {
+            bypassing_ = true;
+            remaining_ = span_;
+            span_ = std::min<uint64_t>(span_ * 2, XCODEC_BYPASS_SPAN_MAX);
+            regions_++;
+        } else {
+            span_ = XCODEC_BYPASS_SPAN;
+        }
+        probed_ = probed_dense_ = matched_ = 0;
+    }
+
+    uint64_t bypassed_bytes(void) const {
+        return (bypassed_bytes_);
+    }
+
+    uint64_t regions(void) const {
+        return (regions_);
+    }
+
+    /*
+     * Shannon entropy in bits per byte of the first bytes of the buffer.
+     */
+    static double entropy(const Buffer &buf) {
+        unsigned count[256];
+        unsigned total = 0;
+        unsigned i;
+
+        memset(count, 0, sizeof count);
+        for (Buffer::SegmentIterator it = buf.segments(); !it.end() && total < XCODEC_BYPASS_SAMPLE; it.next()) {
+            const BufferSegment *seg = *it;
+            const uint8_t *p = seg->data();
+            unsigned n = std::min<unsigned>(seg->length(), XCODEC_BYPASS_SAMPLE - total);
+
+            for (i = 0; i < n; i++)
+                count[p[i]]++;
+            total += n;
+        }
+        if (total == 0)
+            return (0.0);
+
+        double sum = 0.0;
+        for (i = 0; i < 256; i++)
+            if (count[i] != 0)
+                sum += count[i] * std::log2((double) count[i]);
+        return (std::log2((double) total) - sum / total);
+    }
+};
+
+#endif /* !XCODEC_XCODEC_BYPASS_H */
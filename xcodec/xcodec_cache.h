@@ -27,12 +27,20 @@
 #define    XCODEC_XCODEC_CACHE_H
 
 #include <ext/hash_map>
+#include <ext/hash_set>
+#include <list>
 #include <map>
+#include <vector>
 #include <cstdint>
 
 #include "../common/buffer.h"
 #include "../common/uuid/uuid.h"
+#include "../event/callback_queue.h"
 #include "./xcodec.h"
+#include "./xcodec_bloom.h"
+#include "./xcodec_delta.h"
+#include "./xcodec_fingerprint.h"
+#include "./xcodec_index.h"
 
 ////////////////////////////////////////////////////////////////////////////////
 //                                                                            //
@@ -48,6 +56,29 @@
 
 #define XCODEC_WINDOW_COUNT  64  // must be binary
 
+#define XCODEC_FEATURE_LIMIT  262144
+
+#define XCODEC_PRESENCE_LIMIT  262144
+
+#define XCODEC_EVICTION_LIMIT  65536
+
+#define XCODEC_SUPER_LIMIT  8192
+
+#define XCODEC_MEMORY_SLAB_SIZE  1048576  // bytes of segments in a slab
+
+/*
+ * A slab is held until half as many slabs of new segments as there may be
+ * have been entered since it was filled or last found in, unless all the
+ * others are held too, so with this many at least 32 MB is entered between
+ * sending a reference and a slab being emptied under the <ASK> for it, more
+ * than a 1 Gbit/s link carries in a quarter of a second.
+ */
+#define XCODEC_MEMORY_MIN_SLABS  64
+
+#define XCODEC_MEMORY_BASIC_SIZE  1024  // MB, when no size is given, as for COSS
+
+#define XCODEC_MEMORY_SWEEP_SLABS  4  // carried into a filter being built per slab taken
+
 /*
  * XXX
  * GCC supports hash<unsigned long> but not hash<unsigned long long>.  On some
@@ -79,24 +110,90 @@ namespace __gnu_cxx {
     };
 }
 
+/*
+ * The encoder takes a peer to hold every segment it has declared to it, but
+ * for those the peer has since said it evicted, which are kept here.  When
+ * there are too many to keep they are all let go, at the cost of an <ASK>
+ * for each one that is referenced again.
+ */
+class XCodecPresence {
+    typedef __gnu_cxx::hash_set<Hash64> hash_set_t;
+    hash_set_t absent_;
+
+public:
+    XCodecPresence(void)
+            : absent_() {}
+
+    ~XCodecPresence() {}
+
+    void forget(const uint64_t &hash) {
+        if (absent_.size() >= XCODEC_PRESENCE_LIMIT)
+            absent_.clear();
+        absent_.insert(hash);
+    }
+
+    void declare(const uint64_t &hash) {
+        absent_.erase(hash);
+    }
+
+    bool absent(const uint64_t &hash) const {
+        return (absent_.find(hash) != absent_.end());
+    }
+};
 
 class XCodecCache {
 private:
     UUID uuid_;
     size_t size_;
+    unsigned family_;
+    unsigned segment_length_;
 #ifdef USING_XCODEC_CACHE_RECENT_WINDOW
     struct WindowItem {
         uint64_t hash;
         const uint8_t *data;
+        unsigned length;
     };
     WindowItem window_[XCODEC_WINDOW_COUNT];
     unsigned cursor_;
 #endif
+    typedef __gnu_cxx::hash_map<Hash64, uint64_t> feature_map_t;
+    feature_map_t features_;
+    std::map<UUID, XCodecPresence> peers_;
+    std::vector<uint64_t> evictions_;
+    struct SuperMember {
+        uint64_t name;
+        unsigned position;
+    };
+    struct SuperChunk {
+        std::vector<uint64_t> hashes;
+        std::list<uint64_t>::iterator age;
+    };
+    typedef __gnu_cxx::hash_map<Hash64, SuperChunk> super_map_t;
+    typedef __gnu_cxx::hash_map<Hash64, SuperMember> member_map_t;
+    super_map_t supers_;
+    std::list<uint64_t> super_ages_;    // least recently used first
+    member_map_t members_;
+    CallbackQueue waiters_;
 
 protected:
-    XCodecCache(const UUID &uuid, size_t size)
+    /*
+     * Nearly every lookup from the encoder is a miss, so caches are to
+     * reject hashes not in this filter before anything else.
+     */
+    XCodecBloomFilter filter_;
+
+    XCodecCache(const UUID &uuid, size_t size, unsigned family, unsigned segment_length)
             : uuid_(uuid),
-              size_(size) {
+              size_(size),
+              family_(family),
+              segment_length_(segment_length),
+              features_(),
+              peers_(),
+              evictions_(),
+              supers_(),
+              super_ages_(),
+              members_(),
+              waiters_() {
 #ifdef USING_XCODEC_CACHE_RECENT_WINDOW
         memset(window_, 0, sizeof window_);
         cursor_ = 0;
@@ -114,25 +211,254 @@ public:
         return size_;
     }
 
-    virtual void enter(const uint64_t &hash, const Buffer &buf, unsigned off) = 0;
+    /*
+     * The hash family segments in the cache are named by.
+     */
+    unsigned family() const {
+        return family_;
+    }
+
+    /*
+     * A cache whose segments are named by a family other than the legacy
+     * one goes by a UUID derived from that of the codec, so that its file
+     * and the mirror of it at the peer are apart from those of the legacy
+     * cache.
+     */
+    static UUID family_identifier(const UUID &uuid, unsigned family) {
+        UUID derived = uuid;
+        if (family != XCODEC_HASH_FAMILY_LEGACY)
+            derived.uuid_[sizeof derived.uuid_ - 2] ^= family;
+        return (derived);
+    }
+
+    /*
+     * The length of the segments the encoder cuts for the cache, and so of
+     * those the peer declares with <EXTRACT> into its copy of it.
+     */
+    unsigned segment_length() const {
+        return segment_length_;
+    }
+
+    /*
+     * Likewise a cache with segments shorter than XCODEC_SEGMENT_LENGTH
+     * goes by a UUID of its own, so that changing the length starts a new
+     * namespace rather than mixing segments of both lengths in one.
+     */
+    static UUID length_identifier(const UUID &uuid, unsigned segment_length) {
+        UUID derived = uuid;
+        if (segment_length != XCODEC_SEGMENT_LENGTH)
+            derived.uuid_[sizeof derived.uuid_ - 3] ^= XCODEC_SEGMENT_LENGTH / segment_length;
+        return (derived);
+    }
+
+    /*
+     * Segments of the second encoding pass over a stream are kept apart
+     * from those of the first, in a cache of their own that goes by a UUID
+     * derived from that of the first.
+     */
+    static UUID pass_identifier(const UUID &uuid) {
+        UUID pass = uuid;
+        pass.uuid_[sizeof pass.uuid_ - 1] ^= 0xff;
+        return (pass);
+    }
+
+    /*
+     * Segments are segment_length() bytes long unless they come from
+     * content-defined chunking, in which case they may be shorter.  The
+     * length is kept by the cache and given back by lookup.
+     */
+    virtual void enter(const uint64_t &hash, const Buffer &buf, unsigned off, unsigned length) = 0;
+
+    /*
+     * Enters a segment in place of the one known by the same hash, which
+     * the peer no longer has if it declares another one by that hash.
+     */
+    virtual void replace(const uint64_t &hash, const Buffer &buf, unsigned off, unsigned length) = 0;
 
     virtual bool lookup(const uint64_t &hash, Buffer &buf) = 0;
 
-#ifdef USING_XCODEC_CACHE_RECENT_WINDOW
+    /*
+     * Tells if there is a segment known by `hash' without fetching it.
+     */
+    virtual bool contains(const uint64_t &hash) = 0;
+
+    /*
+     * Tells if the segment known by `hash' has the given fingerprint, in
+     * which case it is as good as found by lookup and is counted as used,
+     * but its data need not be read.
+     */
+    virtual bool verify(const uint64_t &hash, uint64_t fingerprint) = 0;
+
+    /*
+     * Tells if lookup can have the data of the segment known by `hash'
+     * without waiting for the disk.  If not, reading it is started, and
+     * the lookup is best put off until a callback given to wait is called.
+     */
+    virtual bool ready(const uint64_t &hash) {
+        return (true);
+    }
+
+    /*
+     * Calls `cb' once some read started by ready is done, the action
+     * returned being cancelled by the caller either way.
+     */
+    Action *wait(Callback *cb) {
+        return (waiters_.schedule(cb));
+    }
+
+    /*
+     * Segments the encoder declares are also indexed by their super-features
+     * so that one like some new data can be found to send that data as a
+     * patch against.  The index is only a hint, the segment it gives may be
+     * gone by the time it is looked up.
+     */
+    void resemble(const uint64_t &hash, const uint64_t *features) {
+        unsigned i;
+
+        if (features_.size() >= XCODEC_FEATURE_LIMIT)
+            features_.clear();
+        for (i = 0; i < XCODEC_DELTA_FEATURES; i++)
+            features_[features[i]] = hash;
+    }
+
+    /*
+     * What each peer that decodes from this cache has said it no longer has.
+     */
+    XCodecPresence *presence(const UUID &peer) {
+        return (&peers_[peer]);
+    }
+
+    /*
+     * Hands over the hashes evicted since the last call, for the decoder to
+     * tell the peer whose segments these are.
+     */
+    bool evictions(std::vector<uint64_t> &hashes) {
+        hashes.clear();
+        hashes.swap(evictions_);
+        return (!hashes.empty());
+    }
+
+    /*
+     * Superchunks recorded by the streams using this cache, as a second
+     * level of index over it.  The encoder also indexes them by their
+     * segments, each of which is taken to be part of the last superchunk
+     * recorded with it.  Like the feature index this is only a hint, and
+     * when it is full the superchunk least recently recorded or referenced
+     * is let go of to make room.
+     */
+    void record(const uint64_t &name, const std::vector<uint64_t> &hashes, bool indexed) {
+        unsigned i;
+
+        super_map_t::iterator it = supers_.find(name);
+        if (it != supers_.end()) {
+            super_ages_.splice(super_ages_.end(), super_ages_, it->second.age);
+        } else {
+            if (supers_.size() >= XCODEC_SUPER_LIMIT)
+                let_go(super_ages_.front());
+            it = supers_.insert(super_map_t::value_type(name, SuperChunk())).first;
+            it->second.age = super_ages_.insert(super_ages_.end(), name);
+        }
+        it->second.hashes = hashes;
+        if (!indexed)
+            return;
+        for (i = 0; i < hashes.size(); i++) {
+            SuperMember &member = members_[hashes[i]];
+            member.name = name;
+            member.position = i;
+        }
+    }
+
+    /*
+     * The encoder tells of each superchunk it references, which keeps it
+     * from being the next one let go of.
+     */
+    void referenced(const uint64_t &name) {
+        super_map_t::iterator it = supers_.find(name);
+        if (it != supers_.end())
+            super_ages_.splice(super_ages_.end(), super_ages_, it->second.age);
+    }
+
+    const std::vector<uint64_t> *sequence(const uint64_t &name) const {
+        super_map_t::const_iterator it = supers_.find(name);
+        if (it == supers_.end())
+            return (NULL);
+        return (&it->second.hashes);
+    }
+
+    /*
+     * Finds a superchunk that the segment is part of, and where in it.
+     */
+    const std::vector<uint64_t> *member(const uint64_t &hash, uint64_t *namep, unsigned *positionp) const {
+        member_map_t::const_iterator it = members_.find(hash);
+        if (it == members_.end())
+            return (NULL);
+
+        const std::vector<uint64_t> *hashes = sequence(it->second.name);
+        if (hashes == NULL || it->second.position >= hashes->size() || (*hashes)[it->second.position] != hash)
+            return (NULL);
+        *namep = it->second.name;
+        *positionp = it->second.position;
+        return (hashes);
+    }
+
+    bool similar(const uint64_t *features, uint64_t *basep) const {
+        feature_map_t::const_iterator it;
+        unsigned i;
+
+        for (i = 0; i < XCODEC_DELTA_FEATURES; i++) {
+            if ((it = features_.find(features[i])) != features_.end()) {
+                *basep = it->second;
+                return true;
+            }
+        }
+        return false;
+    }
+
+private:
+    void let_go(const uint64_t &name) {
+        super_map_t::iterator it = supers_.find(name);
+        member_map_t::iterator mit;
+        unsigned i;
+
+        for (i = 0; i < it->second.hashes.size(); i++) {
+            mit = members_.find(it->second.hashes[i]);
+            if (mit != members_.end() && mit->second.name == name)
+                members_.erase(mit);
+        }
+        super_ages_.erase(it->second.age);
+        supers_.erase(it);
+    }
+
 protected:
-    void remember(const uint64_t &hash, const uint8_t *data) {
+    void evicted(const uint64_t &hash) {
+        if (evictions_.size() < XCODEC_EVICTION_LIMIT)
+            evictions_.push_back(hash);
+    }
+
+    /*
+     * Calls back those waiting, once a read started by ready is done.
+     */
+    void fetched(void) {
+        waiters_.drain();
+    }
+
+#ifdef USING_XCODEC_CACHE_RECENT_WINDOW
+    void remember(const uint64_t &hash, const uint8_t *data, unsigned length) {
         window_[cursor_].hash = hash;
         window_[cursor_].data = data;
+        window_[cursor_].length = length;
         cursor_ = (cursor_ + 1) & (XCODEC_WINDOW_COUNT - 1);
     }
 
-    const uint8_t *find_recent(const uint64_t &hash) {
+    const uint8_t *find_recent(const uint64_t &hash, unsigned *lengthp) {
         WindowItem *w;
         int n;
 
         for (w = window_, n = XCODEC_WINDOW_COUNT; n > 0; --n, ++w)
-            if (w->hash == hash)
+            if (w->hash == hash) {
+                *lengthp = w->length;
                 return w->data;
+            }
 
         return 0;
     }
@@ -150,48 +476,253 @@ protected:
 };
 
 
+/*
+ * The memory cache holds no more than its nominal size of segments, which
+ * is XCODEC_MEMORY_BASIC_SIZE when none is given, as by a peer of a version
+ * that sends none in its <HELLO>.  They are copied one after the other into
+ * slabs of XCODEC_MEMORY_SLAB_SIZE, allocated as they are needed up to as
+ * many as fit in that size, and once there are that many a whole slab is
+ * taken back for each new one wanted.  The slab taken is chosen by CLOCK:
+ * a slab a segment was found in since the hand last passed it is passed
+ * again, and the first one that was not is emptied.  Slabs filled or found
+ * in lately are held out of it, as the peer may still <ASK> for what they
+ * hold; when every slab is, the one held longest is emptied.  What is
+ * evicted is told to the peer like what COSS evicts, and a reference to it
+ * that the peer sends meanwhile is answered by <ASK>.
+ */
 class XCodecMemoryCache : public XCodecCache {
-    typedef __gnu_cxx::hash_map<Hash64, const uint8_t *> segment_hash_map_t;
-    segment_hash_map_t segment_hash_map_;
+    struct MemorySegment {
+        const uint8_t *data;
+        unsigned length;
+        unsigned slab;
+        uint64_t fingerprint;
+    };
+    struct MemorySlab {
+        uint8_t *data;
+        size_t used;
+        bool referenced;
+        uint64_t used_at;               // entered_ when last filled or found in
+        std::vector<uint64_t> hashes;   // in the order entered, replaced ones too
+    };
+    typedef XCodecIndex<MemorySegment> segment_index_t;
+    segment_index_t segment_index_;
+    std::vector<MemorySlab> slabs_;
+    size_t slab_limit_;
+    size_t active_;
+    size_t hand_;
+    uint64_t entered_;
+    uint64_t held_for_;
+    size_t sweep_;
     LogHandle log_;
 
 public:
-    XCodecMemoryCache(const UUID &uuid, size_t size)
-            : XCodecCache(uuid, size),
-              log_("/xcodec/cache/memory") {}
+    XCodecMemoryCache(const UUID &uuid, size_t size, unsigned family = XCODEC_HASH_FAMILY_LEGACY,
+                      unsigned segment_length = XCODEC_SEGMENT_LENGTH)
+            : XCodecCache(uuid, size ? size : XCODEC_MEMORY_BASIC_SIZE, family, segment_length),
+              slabs_(),
+              slab_limit_(nominal_size() * 1048576 / XCODEC_MEMORY_SLAB_SIZE),
+              active_(0),
+              hand_(0),
+              entered_(0),
+              held_for_(0),
+              sweep_(0),
+              log_("/xcodec/cache/memory") {
+        size_t capacity = nominal_size() * 1048576 / segment_length;
+        filter_.resize(capacity > XCODEC_BLOOM_MIN_CAPACITY ? capacity : XCODEC_BLOOM_MIN_CAPACITY);
+        if (slab_limit_ < XCODEC_MEMORY_MIN_SLABS) {
+            INFO(log_) << "Holding " << XCODEC_MEMORY_MIN_SLABS * XCODEC_MEMORY_SLAB_SIZE / 1048576 << " MB rather than " << nominal_size() << " MB, the least a memory cache holds.";
+            slab_limit_ = XCODEC_MEMORY_MIN_SLABS;
+        }
+        held_for_ = (uint64_t) (slab_limit_ / 2) * XCODEC_MEMORY_SLAB_SIZE;
+        slabs_.reserve(slab_limit_);
+    }
 
     ~XCodecMemoryCache() {
-        segment_hash_map_t::const_iterator it;
-        for (it = segment_hash_map_.begin(); it != segment_hash_map_.end(); ++it)
-            delete[] it->second;
-        segment_hash_map_.clear();
+        for (size_t s = 0; s < slabs_.size(); s++)
+            delete[] slabs_[s].data;
+        segment_index_.clear();
+    }
+
+    void enter(const uint64_t &hash, const Buffer &buf, unsigned off, unsigned length) {
+        ASSERT(log_, segment_index_.find(hash) == 0);
+        ASSERT(log_, length > 0 && length <= XCODEC_SEGMENT_LENGTH);
+        uint8_t *data = allocate(length);
+        buf.copyout(data, off, length);
+        MemorySegment &seg = segment_index_.insert(hash);
+        seg.data = data;
+        seg.length = length;
+        seg.slab = active_;
+        seg.fingerprint = XCodecFingerprint::compute(data, length);
+        slabs_[active_].hashes.push_back(hash);
+
+        filter_.insert(hash);
+        if (filter_.saturated() && !filter_.rebuilding()) {
+            /*
+             * Mostly with what was evicted since the filter was last built,
+             * as there is only so much in the cache.  It is built again a
+             * few slabs at a time as new ones are taken.
+             */
+            size_t capacity = filter_.capacity();
+            if (segment_index_.size() > capacity / 2)
+                capacity *= 2;
+            filter_.rebuild(capacity);
+            sweep_ = 0;
+        }
     }
 
-    void enter(const uint64_t &hash, const Buffer &buf, unsigned off) {
-        ASSERT(log_, segment_hash_map_.find(hash) == segment_hash_map_.end());
-        uint8_t *data = new uint8_t[XCODEC_SEGMENT_LENGTH];
-        buf.copyout(data, off, XCODEC_SEGMENT_LENGTH);
-        segment_hash_map_[hash] = data;
+    /*
+     * The replaced segment is left in its slab until the slab is emptied.
+     */
+    void replace(const uint64_t &hash, const Buffer &buf, unsigned off, unsigned length) {
+        if (segment_index_.find(hash) != 0) {
+#ifdef USING_XCODEC_CACHE_RECENT_WINDOW
+            forget(hash);
+#endif
+            segment_index_.erase(hash);
+        }
+        enter(hash, buf, off, length);
     }
 
     bool lookup(const uint64_t &hash, Buffer &buf) {
+        if (!filter_.maybe_contains(hash))
+            return false;
 #ifdef USING_XCODEC_CACHE_RECENT_WINDOW
         const uint8_t *data;
-        if ((data = find_recent(hash))) {
-            buf.append(data, XCODEC_SEGMENT_LENGTH);
+        unsigned length;
+        if ((data = find_recent(hash, &length))) {
+            buf.append(data, length);
             return true;
         }
 #endif
-        segment_hash_map_t::const_iterator it = segment_hash_map_.find(hash);
-        if (it != segment_hash_map_.end()) {
-            buf.append(it->second, XCODEC_SEGMENT_LENGTH);
+        const MemorySegment *seg = segment_index_.find(hash);
+        if (seg != 0) {
+            buf.append(seg->data, seg->length);
+            use(seg->slab);
 #ifdef USING_XCODEC_CACHE_RECENT_WINDOW
-            remember(hash, it->second);
+            remember(hash, seg->data, seg->length);
 #endif
             return true;
         }
         return false;
     }
+
+    bool contains(const uint64_t &hash) {
+        if (!filter_.maybe_contains(hash))
+            return false;
+        return (segment_index_.find(hash) != 0);
+    }
+
+    bool verify(const uint64_t &hash, uint64_t fingerprint) {
+        const MemorySegment *seg = segment_index_.find(hash);
+        if (seg == 0 || seg->fingerprint != fingerprint)
+            return false;
+        use(seg->slab);
+        return true;
+    }
+
+private:
+    void use(size_t s) {
+        slabs_[s].referenced = true;
+        slabs_[s].used_at = entered_;
+    }
+
+    bool held(size_t s) const {
+        return (entered_ - slabs_[s].used_at < held_for_);
+    }
+
+    /*
+     * Room for `length' bytes in the active slab, which is changed for
+     * another when it has not that much left.
+     */
+    uint8_t *allocate(unsigned length) {
+        if (slabs_.empty() || slabs_[active_].used + length > XCODEC_MEMORY_SLAB_SIZE) {
+            if (slabs_.size() < slab_limit_) {
+                MemorySlab slab;
+                slab.data = new uint8_t[XCODEC_MEMORY_SLAB_SIZE];
+                slab.used = 0;
+                slab.referenced = false;
+                slab.used_at = entered_;
+                slabs_.push_back(slab);
+                active_ = slabs_.size() - 1;
+            } else {
+                active_ = reclaim();
+            }
+            if (filter_.rebuilding())
+                carry(XCODEC_MEMORY_SWEEP_SLABS);
+        }
+
+        MemorySlab &slab = slabs_[active_];
+        uint8_t *data = slab.data + slab.used;
+        slab.used += length;
+        slab.used_at = entered_;
+        entered_ += length;
+        return (data);
+    }
+
+    /*
+     * Carries what the next `count' slabs hold into the filter being built,
+     * which is taken up once every slab has been.
+     */
+    void carry(unsigned count) {
+        for (; count > 0 && sweep_ < slabs_.size(); count--, sweep_++) {
+            const std::vector<uint64_t> &hashes = slabs_[sweep_].hashes;
+            for (size_t i = 0; i < hashes.size(); i++) {
+                const MemorySegment *seg = segment_index_.find(hashes[i]);
+                if (seg != 0 && seg->slab == sweep_)
+                    filter_.carry(hashes[i]);
+            }
+        }
+        if (sweep_ == slabs_.size())
+            filter_.rebuilt();
+    }
+
+    /*
+     * Moves the hand on to a slab not used since it last came by, other
+     * than the one just filled, and empties it.  Once it has passed all
+     * the others in a row as held, the one held longest is taken.
+     */
+    size_t reclaim(void) {
+        size_t s, oldest = active_, passed = 0;
+
+        for (;;) {
+            s = hand_;
+            hand_ = (hand_ + 1) % slabs_.size();
+            if (s == active_)
+                continue;
+            if (held(s)) {
+                if (passed++ == 0 || slabs_[s].used_at < slabs_[oldest].used_at)
+                    oldest = s;
+                if (passed < slabs_.size() - 1)
+                    continue;
+                s = oldest;
+                break;
+            }
+            passed = 0;
+            if (slabs_[s].referenced) {
+                slabs_[s].referenced = false;
+                continue;
+            }
+            break;
+        }
+
+        MemorySlab &slab = slabs_[s];
+        DEBUG(log_) << "Evicting slab " << s << " of " << slab.hashes.size() << " segments.";
+        for (size_t i = 0; i < slab.hashes.size(); i++) {
+            const uint64_t &hash = slab.hashes[i];
+            const MemorySegment *seg = segment_index_.find(hash);
+            if (seg == 0 || seg->slab != s)
+                continue;       /* replaced */
+#ifdef USING_XCODEC_CACHE_RECENT_WINDOW
+            forget(hash);
+#endif
+            segment_index_.erase(hash);
+            evicted(hash);
+        }
+        slab.hashes.clear();
+        slab.used = 0;
+        slab.referenced = false;
+        return (s);
+    }
 };
 
 #endif /* !XCODEC_XCODEC_CACHE_H */
@@ -0,0 +1,167 @@
+////////////////////////////////////////////////////////////////////////////////
+//                                                                            //
+// File:           xcodec_chunker.cc                                          //
+// Description:    content-defined chunk boundaries for the xcodec encoder    //
+// Project:        WANProxy XTech                                             //
+// Last modified:  2026-10-18                                                 //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+
+#include "../common/buffer.h"
+
+#include "./xcodec.h"
+#include "./xcodec_chunker.h"
+
+/*
+ * Eleven and nine bits respectively, spread over the upper half of the
+ * fingerprint where every bit depends on at least 32 bytes of input.  These
+ * are for the longest segments, whose chunks have a normal length of 2^10;
+ * shorter ones drop as many of their lowest bits as their normal length has
+ * fewer.
+ */
+#define    XCODEC_CHUNK_MASK_SMALL    0x4924924900000000ull
+#define    XCODEC_CHUNK_MASK_LARGE    0x2222222220000000ull
+
+static uint64_t
+xcodec_chunk_mask(uint64_t mask, unsigned segment_length)
+{
+    while (segment_length < XCODEC_SEGMENT_LENGTH) {
+        mask &= mask - 1;
+        segment_length <<= 1;
+    }
+    return (mask);
+}
+
+/*
+ * Random values for each byte, from splitmix64.  Boundaries are decided by
+ * the encoder alone, so changing these would only cost some deduplication
+ * against data chunked before the change.
+ */
+static const uint64_t xcodec_chunk_gear[256] = {
+    0x5cf049fb70b34853ull, 0xd081fbcd4289e0feull, 0xf73d5d2d77f846c0ull,
+    0x849964565dfa9834ull, 0x495516f9949bc9e7ull, 0xbc93c87a34a38ee2ull,
+    0xc5101a3097d0732bull, 0x866d28ad83fecdc5ull, 0x6f581df4689610c3ull,
+    0x0bc12cea88935ce0ull, 0x4db78ed3420fd9d3ull, 0x545330875ec69ab9ull,
+    0x52a1566769177260ull, 0xeea7fa990f2b83e2ull, 0xf613a0784522eafeull,
+    0xfe155b384a0c31e2ull, 0x8ff438b17d0e7eeaull, 0xd417ce98ed15f9f6ull,
+    0x92ee0428c752b35dull, 0xdf7830d9ddc37170ull, 0x9214de13b14b74c2ull,
+    0xad529151c2e5ed68ull, 0xcdaf19ca7c768e10ull, 0x2ad3e47f908951a3ull,
+    0x76e911d34ad54362ull, 0x60d68126c2182802ull, 0xa178b9671264e8e3ull,
+    0xe12e1b223ffc60caull, 0xc950fb5fcd07e92aull, 0xaffeda2f3d0e790dull,
+    0xbe13d2421e490e94ull, 0xa1adb1b9d807baeeull, 0x6f34a3e6b8241c98ull,
+    0x0172b9abc7c5140aull, 0xe922ac35bda47084ull, 0xd94ef98c7e8d74c5ull,
+    0x945f7026934ccbb0ull, 0x2b625e963684265eull, 0xa4c889c649b2eb29ull,
+    0xa95dd9240857c323ull, 0x38ec4fcc2a50ee3bull, 0x95d2345da2ad91a1ull,
+    0x33805e871bc15ee2ull, 0x1318ac4c65dd7e98ull, 0x89c023d57b138bcaull,
+    0x23f03a753ac20293ull, 0x623bf9b424e6b265ull, 0x2bcbce306695d8bbull,
+    0xf95ded47f5b71b4dull, 0x4ddb0067bfe54b05ull, 0xac00c29f233a0093ull,
+    0x6fa7893fe8525770ull, 0xbce8038aa81e67f1ull, 0x0cbbb9191f13751dull,
+    0xf48cce51f28fe29full, 0x6c684030daab51dbull, 0x47313b40981677b1ull,
+    0xe2b6964d5ac419e0ull, 0xb99327d75e0c02dbull, 0x6d14e8a3f36d0ef7ull,
+    0xae2f49a1cb9bdb12ull, 0x0a8b1d7330767944ull, 0xecf3ccb8cec8a99dull,
+    0x7678a5e7e337e62cull, 0x6b2dbe9242701b1dull, 0x822604246fff100bull,
+    0xc16429d203180706ull, 0x7335b5c64e58232eull, 0xd8b14b67c361bc2bull,
+    0x145caf5a389c12bbull, 0xc52997fa79696769ull, 0xddf602ee9c18f88eull,
+    0x53163c18390accd2ull, 0xc476ee796b9cb456ull, 0x588978e6d4aa3b61ull,
+    0x1ba919142fbda9edull, 0xeeb25d09aef54c31ull, 0xd5ba205d19a88016ull,
+    0xcf8381c2c1dbfa36ull, 0x33665fd4d58578c8ull, 0xff63c6fa27d0c18aull,
+    0x5223413a62866f1cull, 0x8bf49785adcda66bull, 0xaf27fa98dcf993ecull,
+    0x85cbe316e16b3109ull, 0xd7ec28799970da22ull, 0x5803c154fe92d325ull,
+    0x4bce34f567972945ull, 0x6cfcc9ed0916f760ull, 0xd7d29cfdb0b908d9ull,
+    0xab5812a833545882ull, 0x038b7c8ef9166a8bull, 0xd0f0c406fcb255a2ull,
+    0xbdd7cddd31a18babull, 0x61f1bdfab2074434ull, 0x4abd1edfe2277fc1ull,
+    0xdbc463fc1fe9d4aeull, 0xbc7c61079b5db2bfull, 0xbaa8cc1b5a509e13ull,
+    0x95de710f5b39c60full, 0xb8176235ba45a8f9ull, 0xda88db6290c5923bull,
+    0x1306079a6b289e90ull, 0xa7a12328fcfe5605ull, 0xf8f36dc343571039ull,
+    0x2f0b1a95d9aaee5full, 0xa60b9cf43dca256dull, 0x72cd141c2e4e3950ull,
+    0x61bee35da5e08e71ull, 0x0f546089b79ff109ull, 0x7052adbec92e668eull,
+    0x1269b47ae154feecull, 0x2de57a66b0923fa4ull, 0xab6251e3c84bb38full,
+    0xfc8fa70f8ce24416ull, 0x5535157231fcca1bull, 0xb9d447cb35d4d3e6ull,
+    0xff77a45f208c27d8ull, 0x5c2437ef6dbc745dull, 0xb47800eedf1bd61aull,
+    0x1c969ca639f9149bull, 0x19b2b6bc984ab49eull, 0x5890741dddb389f1ull,
+    0x27454e75ecb42948ull, 0xeb4754a76ec3d243ull, 0xa849765f8d70ec87ull,
+    0x21744321e1d14ce7ull, 0x5a1e5bc1e6dee031ull, 0x6f71710edd5b47deull,
+    0xc6c8ac1d89e14f15ull, 0xadc1e89e20bd49f0ull, 0xf935edceddf2a132ull,
+    0x196316fce0a704d4ull, 0x8325e1ac9f8c3d95ull, 0xceda235a322f9a24ull,
+    0x116b2bae125b68c0ull, 0x728bfb452a00e743ull, 0x58f85619ba287db6ull,
+    0xd2979e673c58ebc9ull, 0xbac2d44dc23c4611ull, 0xd1b2d3a139a9a2e5ull,
+    0x4552be7519709861ull, 0x78eddd56e096509eull, 0xeec8212906f790d5ull,
+    0x1dc12c63c247dba5ull, 0xc3c5cefc35fa4ec0ull, 0xf72033e4b9950fc8ull,
+    0x3884c55b0a0305e6ull, 0xca40445c2aa28a9dull, 0xd3b1fb11332c096aull,
+    0xe40762ff221ae2eeull, 0xa7d4f9d575b1bc8full, 0x9f685c4a903ebcb2ull,
+    0xcd8b52dc3743adb7ull, 0x711f27a8541fb968ull, 0x26cae1fbfa19edaeull,
+    0xea71ba473fa10475ull, 0x1b8dbcf356941836ull, 0xfe2279a8a51227ecull,
+    0x4e9801639193e4fcull, 0x1b0eb295689421c9ull, 0xe06374ca2fdcc577ull,
+    0xe49e209082e0fcccull, 0x799822ce38549d4dull, 0x9e25e330ad03a1a8ull,
+    0x0ccb0507a0cf696aull, 0xd53c8790264627c5ull, 0xa960a3ba77fdb1d4ull,
+    0xce5aa8c2b0e90906ull, 0x2176fbd6e484a331ull, 0xb6b258205f333c51ull,
+    0x12ef62db5a837db2ull, 0xad6464bef79db5c4ull, 0x99a2114ee5272f93ull,
+    0x38b45663c77926c9ull, 0x477d26bd20a896dbull, 0x76564ec3bfb565b4ull,
+    0x293802efcbae65c7ull, 0x3dc21e04c5f32fe0ull, 0x874d7ac8a5fe662cull,
+    0x578ef3d84f12da02ull, 0xfa68ef7b6180c8ddull, 0xc07f00a9556071acull,
+    0xefeb5d655a80709aull, 0x0ee6b53d785b786full, 0x4289e6d44df54b1eull,
+    0xc595dd273c2b37f0ull, 0x2a5fda5f9e18ccb1ull, 0xa582ecd294232a57ull,
+    0xf2fa1e0b58b85a29ull, 0x271c80b299ad2325ull, 0xf376f46378ecf178ull,
+    0x9db28ba4e34ca306ull, 0x0326e3f6e4ecdf9full, 0x51ca198a58a6d73full,
+    0x584f44c6942417d2ull, 0x56e4ca415e0a7480ull, 0x01c0bc070e26251dull,
+    0x39cacb788e21d2acull, 0xd17b4e97f05515a5ull, 0xa60c66729d2a43f1ull,
+    0xd8b44a449f99d857ull, 0x87fc63a8c037e842ull, 0xe16f6c98b943aa9bull,
+    0xfb14e1b249e80238ull, 0x3ec171c22b998347ull, 0x056933298c610418ull,
+    0x0b3ca1b5d05d91d7ull, 0xa01ec1c2c3ca2730ull, 0xfaa3dd22485f04baull,
+    0x8a318279b92f61c1ull, 0xb2de83fbda019704ull, 0xccf4951f4dc87bd9ull,
+    0xfbab01397c8567adull, 0xb7cb0ad052210c98ull, 0xdaf70ab1f009ffaeull,
+    0xa92be9d8cf85dc61ull, 0x1ffa73c268a02e7bull, 0xfb2d4a63de7f07b3ull,
+    0x07893a1a09edd668ull, 0xa3f4c677c679df11ull, 0x889e437619b1d2edull,
+    0xe78b3c2ef79cc7fbull, 0x42e7ff05e2936cbbull, 0x7df4609a1a1b81e4ull,
+    0x8c2bd83f1b5b6c3bull, 0xf2d3c9d857719346ull, 0xe38a830ba037f09bull,
+    0xc7b25641482f17f9ull, 0x38234223a568b23full, 0xed30f847024c764eull,
+    0x1e3d7b22a7659bf1ull, 0xa6218aae1ee49ba7ull, 0xd8e3c3a394ff1321ull,
+    0x8e54cd1b94dd4d96ull, 0xbf512725c485d82cull, 0x1ea5e6b161ca5cbfull,
+    0xd1ddd4d27ff27d5bull, 0x52a7686be87977d7ull, 0x3795a3cd6de7cefdull,
+    0x27c024b78aa7780dull, 0x3a94f1a6b9069219ull, 0x7f9ddaccf46fc2a4ull,
+    0x52e2da40f17d83b0ull, 0x220000fd1ed85feeull, 0x81e920d0bfc00f2full,
+    0xbe3c2de504071910ull, 0x03c01444f67012d4ull, 0x32d01e3c15b28d2bull,
+    0xe264dcb497faca06ull, 0x6ec1b4517fe63517ull, 0xaa20dc01b311544bull,
+    0xdfa10e2a63697c0eull, 0xb590bccb9438e405ull, 0x82869456dd9e2cf6ull,
+    0x216f4079d1144bcdull,};
+
+XCodecChunker::XCodecChunker(unsigned segment_length)
+        : segment_length_(segment_length),
+          mask_small_(xcodec_chunk_mask(XCODEC_CHUNK_MASK_SMALL, segment_length)),
+          mask_large_(xcodec_chunk_mask(XCODEC_CHUNK_MASK_LARGE, segment_length)),
+          fingerprint_(0),
+          length_(0) {}
+
+unsigned XCodecChunker::scan(const uint8_t *data, unsigned count, bool *boundary) {
+    const uint8_t *p = data, *q = data + count;
+    uint64_t fp = fingerprint_;
+    unsigned len = length_;
+
+    *boundary = false;
+
+    /*
+     * No boundary can fall before the minimum length, so there is no need
+     * to hash those bytes.
+     */
+    if (len < XCODEC_CHUNK_MIN_LENGTH(segment_length_)) {
+        unsigned n = std::min<unsigned>(count, XCODEC_CHUNK_MIN_LENGTH(segment_length_) - len);
+        p += n;
+        len += n;
+    }
+
+    while (p < q) {
+        fp = (fp << 1) + xcodec_chunk_gear[*p++];
+        len++;
+
+        if ((fp & (len < XCODEC_CHUNK_NORMAL_LENGTH(segment_length_) ? mask_small_ : mask_large_)) == 0 ||
+            len == XCODEC_CHUNK_MAX_LENGTH(segment_length_)) {
+            *boundary = true;
+            break;
+        }
+    }
+
+    fingerprint_ = fp;
+    length_ = len;
+
+    return (p - data);
+}
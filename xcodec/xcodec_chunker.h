@@ -0,0 +1,63 @@
+#ifndef    XCODEC_XCODEC_CHUNKER_H
+#define    XCODEC_XCODEC_CHUNKER_H
+
+////////////////////////////////////////////////////////////////////////////////
+//                                                                            //
+// File:           xcodec_chunker.h                                           //
+// Description:    content-defined chunk boundaries for the xcodec encoder    //
+// Project:        WANProxy XTech                                             //
+// Last modified:  2026-10-18                                                 //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+
+/*
+ * Chunks are never longer than a segment, so that they fit wherever a segment
+ * does, and are cut more reluctantly below the normal length and more eagerly
+ * above it, which keeps their lengths close to the normal one.
+ */
+#define    XCODEC_CHUNK_MIN_LENGTH(l)    ((l) / 4)
+#define    XCODEC_CHUNK_NORMAL_LENGTH(l)    ((l) / 2)
+#define    XCODEC_CHUNK_MAX_LENGTH(l)    (l)
+
+/*
+ * Gear fingerprint over the last 64 bytes of the stream, as in FastCDC.  A
+ * chunk ends where the masked bits of the fingerprint are all zero, so the
+ * boundaries depend on the content alone and an insertion or a deletion only
+ * moves the boundaries next to it.
+ */
+class XCodecChunker {
+    unsigned segment_length_;
+    uint64_t mask_small_;
+    uint64_t mask_large_;
+    uint64_t fingerprint_;
+    unsigned length_;
+
+public:
+    /*
+     * Chunks are cut to fit the segments of a cache of `segment_length'.
+     */
+    XCodecChunker(unsigned);
+
+    ~XCodecChunker() {}
+
+    /*
+     * Number of bytes in the current chunk so far.
+     */
+    unsigned length(void) const {
+        return (length_);
+    }
+
+    void reset(void) {
+        fingerprint_ = 0;
+        length_ = 0;
+    }
+
+    /*
+     * Adds up to `count' bytes of `data' to the current chunk and returns
+     * how many were taken.  If the chunk ends with the last of them, sets
+     * `*boundary' and the caller is expected to reset() before going on.
+     */
+    unsigned scan(const uint8_t *, unsigned, bool *);
+};
+
+#endif /* !XCODEC_XCODEC_CHUNKER_H */
@@ -29,6 +29,7 @@
 #include "./xcodec.h"
 #include "./xcodec_cache.h"
 #include "./xcodec_decoder.h"
+#include "./xcodec_delta.h"
 #include "./xcodec_encoder.h"
 #include "./xcodec_hash.h"
 
@@ -44,25 +45,69 @@
 
 XCodecDecoder::XCodecDecoder(XCodecCache *cache)
         : log_("/xcodec/decoder"),
-          cache_(cache) {}
+          cache_(cache),
+          history_(),
+          window_(),
+          supers_(cache, false),
+          held_(),
+          held_length_(0),
+          waiters_(),
+          reads_(),
+          learned_(),
+          namespaces_(),
+          unknown_foreign_(),
+          learned_foreign_(),
+          reading_(NULL),
+          fetching_(NULL) {}
 
 XCodecDecoder::~XCodecDecoder() {}
 
+void XCodecDecoder::set_shared(const std::vector<XCodecCache *> &caches) {
+    std::map<unsigned, XCodecCache *>::iterator it;
+    unsigned ns;
+
+    for (it = namespaces_.begin(); it != namespaces_.end(); ) {
+        if (it->first != XCODEC_NAMESPACE_OWN)
+            namespaces_.erase(it++);
+        else
+            ++it;
+    }
+    for (ns = 0; ns < caches.size(); ns++)
+        namespaces_[ns] = caches[ns];
+}
+
+unsigned XCodecDecoder::segment_length(unsigned ns) const {
+    std::map<unsigned, XCodecCache *>::const_iterator it = namespaces_.find(ns);
+
+    if (it != namespaces_.end() && it->second != NULL)
+        return (it->second->segment_length());
+    return (cache_->segment_length());
+}
+
+bool XCodecDecoder::foreign_unknown(void) const {
+    std::map<unsigned, std::set<uint64_t> >::const_iterator it;
+
+    for (it = unknown_foreign_.begin(); it != unknown_foreign_.end(); ++it)
+        if (!it->second.empty())
+            return (true);
+    return (false);
+}
+
 /*
- * XXX These comments are out-of-date.
- *
  * Decode an XCodec-encoded stream.  Returns false if there was an
  * inconsistency, error or unrecoverable condition in the stream.
  * Returns true if we were able to process the stream entirely or
  * expect to be able to finish processing it once more data arrives.
  * The input buffer is cleared of anything we can parse right now.
  *
- * Since some events later in the stream (i.e. ASK or LEARN) may need
- * to be processed before some earlier in the stream (i.e. REF), we
- * parse the stream into a list of actions to take, performing them
- * as we go if possible, otherwise queueing them to occur until the
- * action that is blocking the stream has been satisfied or the stream
- * has been closed.
+ * An op that needs a segment we do not have does not stop decoding:
+ * its hash is added to the unknown hashes for the caller to <ASK> for
+ * and the op is held in place while decoding goes on, so that all the
+ * hashes missing from a burst of data are asked for at once.  Output
+ * from that point on is held behind it and goes out in order as the
+ * held ops are done, each of which is tried again on the next call once
+ * its segment has been learned or read.  Only when too much output is
+ * held does decoding wait.
  *
  * XXX For now we will ASK in every stream where an unknown hash has
  * occurred and expect a LEARN in all of them.  In the future, it is
@@ -71,22 +116,42 @@ XCodecDecoder::~XCodecDecoder() {}
  * share an originator.
  */
 
-bool XCodecDecoder::decode(Buffer &output, Buffer &input, std::set<uint64_t> &unknown_hashes) {
+bool XCodecDecoder::decode(Buffer &output, Buffer &input, std::set<uint64_t> &unknown_hashes, std::set<uint64_t> &unknown_supers) {
     uint8_t data[XCODEC_SEGMENT_LENGTH];
-    Buffer old;
+    std::vector<uint64_t> run;
     uint64_t behash;
     uint64_t hash;
+    uint16_t length;
+    uint16_t offset;
+    uint16_t count;
+    uint64_t fingerprint;
+    uint16_t size;
+    uint16_t start;
     unsigned off;
+    uint8_t index;
+    uint8_t tag;
     uint8_t op;
+    Buffer ref;
+
+    fetching_ = NULL;
+    if (!resolve(output, unknown_hashes))
+        return (false);
 
     while (!input.empty()) {
+        if (held_length() >= XCODEC_HOLD_LIMIT) {
+            DEBUG(log_) << "Holding too much output, waiting for <LEARN>.";
+            return (true);
+        }
+
+        Buffer &out = sink(output);
+
         if (!input.find(XCODEC_MAGIC, &off)) {
-            input.moveout(&output);
+            input.moveout(&out);
             break;
         }
 
         if (off > 0) {
-            output.append(input, off);
+            out.append(input, off);
             input.skip(off);
         }
         ASSERT(log_, !input.empty());
@@ -101,31 +166,66 @@ bool XCodecDecoder::decode(Buffer &output, Buffer &input, std::set<uint64_t> &un
 
         switch (op) {
             case XCODEC_OP_ESCAPE:
-                output.append(XCODEC_MAGIC);
+                out.append(XCODEC_MAGIC);
                 input.skip(sizeof(XCODEC_MAGIC) + sizeof op);
                 break;
 
             case XCODEC_OP_EXTRACT:
-                if (input.length() < sizeof(XCODEC_MAGIC) + sizeof op + XCODEC_SEGMENT_LENGTH)
+                if (input.length() < sizeof(XCODEC_MAGIC) + sizeof op + cache_->segment_length())
                     return (true);
 
                 input.skip(sizeof(XCODEC_MAGIC) + sizeof op);
-                input.copyout(data, XCODEC_SEGMENT_LENGTH);
-                hash = XCodecHash::hash(data);
-
-                if (cache_->lookup(hash, old)) {
-                    if (old.equal(data, sizeof data)) {
-                        DEBUG(log_) << "Declaring segment already in cache.";
-                    } else {
-                        ERROR(log_) << "Collision in <EXTRACT>.";
-                        return (false);
-                    }
-                    old.clear();
-                } else
-                    cache_->enter(hash, input, 0);
+                input.copyout(data, cache_->segment_length());
+                hash = XCodecHash::hash(cache_->family(), data, cache_->segment_length());
+                declare(hash, input, data, cache_->segment_length());
+
+                out.append(input, cache_->segment_length());
+                input.skip(cache_->segment_length());
+                break;
+
+            case XCODEC_OP_CHUNK:
+                if (input.length() < sizeof(XCODEC_MAGIC) + sizeof op + sizeof length)
+                    return (true);
+
+                input.extract(&length, sizeof(XCODEC_MAGIC) + sizeof op);
+                length = BigEndian::decode(length);
+                if (length == 0 || length > cache_->segment_length()) {
+                    ERROR(log_) << "Invalid <CHUNK> length: " << length;
+                    return (false);
+                }
+                if (input.length() < sizeof(XCODEC_MAGIC) + sizeof op + sizeof length + length)
+                    return (true);
+
+                input.skip(sizeof(XCODEC_MAGIC) + sizeof op + sizeof length);
+                input.copyout(data, length);
+                hash = XCodecHash::hash(cache_->family(), data, length);
+                declare(hash, input, data, length);
 
-                output.append(input, XCODEC_SEGMENT_LENGTH);
-                input.skip(XCODEC_SEGMENT_LENGTH);
+                out.append(input, length);
+                input.skip(length);
+                break;
+
+            case XCODEC_OP_EXTRACT_TAGGED:
+                if (input.length() < sizeof(XCODEC_MAGIC) + sizeof op + sizeof tag + sizeof length)
+                    return (true);
+
+                input.extract(&tag, sizeof(XCODEC_MAGIC) + sizeof op);
+                input.extract(&length, sizeof(XCODEC_MAGIC) + sizeof op + sizeof tag);
+                length = BigEndian::decode(length);
+                if (tag == 0 || tag > XCODEC_TAG_MAX || length == 0 || length > cache_->segment_length()) {
+                    ERROR(log_) << "Invalid <EXTRACT_TAGGED> tag " << (unsigned) tag << " or length " << length;
+                    return (false);
+                }
+                if (input.length() < sizeof(XCODEC_MAGIC) + sizeof op + sizeof tag + sizeof length + length)
+                    return (true);
+
+                input.skip(sizeof(XCODEC_MAGIC) + sizeof op + sizeof tag + sizeof length);
+                input.copyout(data, length);
+                hash = XCodecHash::tag(XCodecHash::hash(cache_->family(), data, length), tag);
+                declare(hash, input, data, length);
+
+                out.append(input, length);
+                input.skip(length);
                 break;
 
             case XCODEC_OP_REF:
@@ -135,17 +235,194 @@ bool XCodecDecoder::decode(Buffer &output, Buffer &input, std::set<uint64_t> &un
                 input.extract(&behash, sizeof(XCODEC_MAGIC) + sizeof op);
                 hash = BigEndian::decode(behash);
 
-                if (cache_->lookup(hash, output)) {
-                    input.skip(sizeof(XCODEC_MAGIC) + sizeof op + sizeof behash);
-                } else {
-                    if (unknown_hashes.find(hash) == unknown_hashes.end()) {
-                        DEBUG(log_) << "Sending <ASK>, waiting for <LEARN>.";
-                        unknown_hashes.insert(hash);
-                    } else {
-                        DEBUG(log_) << "Already sent <ASK>, waiting for <LEARN>.";
+                /*
+                 * The history only needs the hash, so it is noted
+                 * right away even if the segment is still to come.
+                 */
+                history_.note(hash);
+                window_.note(hash);
+                supers_.note(hash);
+
+                ref.clear();
+                input.moveout(&ref, sizeof(XCODEC_MAGIC) + sizeof op + sizeof behash);
+                if (!place(output, ref, unknown_hashes))
+                    return (false);
+                break;
+
+            case XCODEC_OP_BACKREF:
+                if (input.length() < sizeof(XCODEC_MAGIC) + sizeof op + sizeof index)
+                    return (true);
+
+                input.extract(&index, sizeof(XCODEC_MAGIC) + sizeof op);
+                if (!window_.at(index, &hash)) {
+                    ERROR(log_) << "Invalid <BACKREF> index: " << (unsigned) index;
+                    return (false);
+                }
+                input.skip(sizeof(XCODEC_MAGIC) + sizeof op + sizeof index);
+
+                history_.note(hash);
+                window_.note(hash);
+                supers_.note(hash);
+
+                behash = BigEndian::encode(hash);
+                ref.clear();
+                ref.append(XCODEC_MAGIC);
+                ref.append(XCODEC_OP_REF);
+                ref.append(&behash);
+                if (!place(output, ref, unknown_hashes))
+                    return (false);
+                break;
+
+            case XCODEC_OP_REF_RUN:
+                if (input.length() < sizeof(XCODEC_MAGIC) + sizeof op + sizeof behash + sizeof count)
+                    return (true);
+
+                input.extract(&behash, sizeof(XCODEC_MAGIC) + sizeof op);
+                hash = BigEndian::decode(behash);
+                input.extract(&count, sizeof(XCODEC_MAGIC) + sizeof op + sizeof behash);
+                count = BigEndian::decode(count);
+                if (count < 2 || count > XCODEC_RUN_MAX) {
+                    ERROR(log_) << "Invalid <REF_RUN> count: " << count;
+                    return (false);
+                }
+
+                if (!history_.follow(hash, count, run)) {
+                    ERROR(log_) << "Unknown successor in <REF_RUN>.";
+                    return (false);
+                }
+                input.skip(sizeof(XCODEC_MAGIC) + sizeof op + sizeof behash + sizeof count);
+
+                /*
+                 * A run is done as the <REF>s it stands for, so that
+                 * only the segments of it that are missing are held.
+                 */
+                for (std::vector<uint64_t>::const_iterator it = run.begin(); it != run.end(); ++it) {
+                    history_.note(*it);
+                    window_.note(*it);
+                    supers_.note(*it);
+
+                    behash = BigEndian::encode(*it);
+                    ref.clear();
+                    ref.append(XCODEC_MAGIC);
+                    ref.append(XCODEC_OP_REF);
+                    ref.append(&behash);
+                    if (!place(output, ref, unknown_hashes))
+                        return (false);
+                }
+                break;
+
+            case XCODEC_OP_REF_SUPER:
+                if (input.length() < sizeof(XCODEC_MAGIC) + sizeof op + sizeof behash + sizeof start + sizeof count)
+                    return (true);
+
+                input.extract(&behash, sizeof(XCODEC_MAGIC) + sizeof op);
+                hash = BigEndian::decode(behash);
+                input.extract(&start, sizeof(XCODEC_MAGIC) + sizeof op + sizeof behash);
+                start = BigEndian::decode(start);
+                input.extract(&count, sizeof(XCODEC_MAGIC) + sizeof op + sizeof behash + sizeof start);
+                count = BigEndian::decode(count);
+                if (count < 2) {
+                    ERROR(log_) << "Invalid <REF_SUPER> count: " << count;
+                    return (false);
+                }
+
+                /*
+                 * Nothing after a superchunk we do not have can be
+                 * decoded, since the segments it stands for are to be
+                 * noted before those that follow.
+                 */
+                {
+                    const std::vector<uint64_t> *hashes = cache_->sequence(hash);
+                    if (hashes == NULL) {
+                        if (unknown_supers.find(hash) == unknown_supers.end()) {
+                            DEBUG(log_) << "Sending <ASK_SUPER>, waiting for <LEARN_SUPER>.";
+                            unknown_supers.insert(hash);
+                        }
+                        return (true);
                     }
+                    if ((unsigned) start + count > hashes->size()) {
+                        ERROR(log_) << "Invalid <REF_SUPER> range " << start << "+" << count << " of " << hashes->size() << ".";
+                        return (false);
+                    }
+                    run.assign(hashes->begin() + start, hashes->begin() + start + count);
+                }
+                input.skip(sizeof(XCODEC_MAGIC) + sizeof op + sizeof behash + sizeof start + sizeof count);
+
+                for (std::vector<uint64_t>::const_iterator it = run.begin(); it != run.end(); ++it) {
+                    history_.note(*it);
+                    window_.note(*it);
+                    supers_.note(*it);
+
+                    behash = BigEndian::encode(*it);
+                    ref.clear();
+                    ref.append(XCODEC_MAGIC);
+                    ref.append(XCODEC_OP_REF);
+                    ref.append(&behash);
+                    if (!place(output, ref, unknown_hashes))
+                        return (false);
+                }
+                break;
+
+            case XCODEC_OP_REF_RANGE:
+                if (input.length() < sizeof(XCODEC_MAGIC) + sizeof op + sizeof behash + sizeof offset + sizeof length)
+                    return (true);
+
+                ref.clear();
+                input.moveout(&ref, sizeof(XCODEC_MAGIC) + sizeof op + sizeof behash + sizeof offset + sizeof length);
+                if (!place(output, ref, unknown_hashes))
+                    return (false);
+                break;
+
+            case XCODEC_OP_REF_PEER:
+                if (input.length() < sizeof(XCODEC_MAGIC) + sizeof op + sizeof behash + sizeof fingerprint)
                     return (true);
+
+                if (namespaces_.find(XCODEC_NAMESPACE_OWN) == namespaces_.end()) {
+                    ERROR(log_) << "Got <REF_PEER> without a cache of our own.";
+                    return (false);
+                }
+
+                ref.clear();
+                input.moveout(&ref, sizeof(XCODEC_MAGIC) + sizeof op + sizeof behash + sizeof fingerprint);
+                if (!place(output, ref, unknown_hashes))
+                    return (false);
+                break;
+
+            case XCODEC_OP_REF_SHARED:
+                if (input.length() < sizeof(XCODEC_MAGIC) + sizeof op + sizeof index + sizeof behash + sizeof fingerprint)
+                    return (true);
+
+                input.extract(&index, sizeof(XCODEC_MAGIC) + sizeof op);
+                if (namespaces_.find(index) == namespaces_.end()) {
+                    ERROR(log_) << "Invalid <REF_SHARED> namespace: " << (unsigned) index;
+                    return (false);
+                }
+
+                ref.clear();
+                input.moveout(&ref, sizeof(XCODEC_MAGIC) + sizeof op + sizeof index + sizeof behash + sizeof fingerprint);
+                if (!place(output, ref, unknown_hashes))
+                    return (false);
+                break;
+
+            case XCODEC_OP_DELTA:
+                if (input.length() < sizeof(XCODEC_MAGIC) + sizeof op + sizeof behash + sizeof length + sizeof size)
+                    return (true);
+
+                input.extract(&length, sizeof(XCODEC_MAGIC) + sizeof op + sizeof behash);
+                length = BigEndian::decode(length);
+                input.extract(&size, sizeof(XCODEC_MAGIC) + sizeof op + sizeof behash + sizeof length);
+                size = BigEndian::decode(size);
+                if (length == 0 || length > cache_->segment_length() || size == 0 || size > cache_->segment_length()) {
+                    ERROR(log_) << "Invalid <DELTA> length " << length << " or size " << size << ".";
+                    return (false);
                 }
+                if (input.length() < sizeof(XCODEC_MAGIC) + sizeof op + sizeof behash + sizeof length + sizeof size + size)
+                    return (true);
+
+                ref.clear();
+                input.moveout(&ref, sizeof(XCODEC_MAGIC) + sizeof op + sizeof behash + sizeof length + sizeof size + size);
+                if (!place(output, ref, unknown_hashes))
+                    return (false);
                 break;
 
             default:
@@ -156,3 +433,370 @@ bool XCodecDecoder::decode(Buffer &output, Buffer &input, std::set<uint64_t> &un
 
     return (true);
 }
+
+/*
+ * Enters the `length' bytes at the start of the input, a copy of which is in
+ * `data', under `hash'.  Other data by the same name is data the encoder no
+ * longer has, or it would have referenced it or tagged the hash, so it gives
+ * way rather than failing the stream.
+ */
+void XCodecDecoder::declare(const uint64_t &hash, const Buffer &input, const uint8_t *data, unsigned length) {
+    Buffer ref;
+
+    if (cache_->contains(hash)) {
+        if (cache_->verify(hash, XCodecFingerprint::compute(data, length))) {
+            DEBUG(log_) << "Declaring segment already in cache.";
+        } else {
+            DEBUG(log_) << "Declaring segment in place of another by the same hash.";
+            cache_->replace(hash, input, 0, length);
+        }
+    } else
+        cache_->enter(hash, input, 0, length);
+    ref.append(input, length);
+    history_.note(hash);
+    window_.note(hash, ref);
+    supers_.note(hash);
+    learned(hash);
+}
+
+/*
+ * Where output goes: straight out while nothing is held, and otherwise to
+ * the end of what is held.
+ */
+Buffer &XCodecDecoder::sink(Buffer &output) {
+    if (held_.empty())
+        return (output);
+    if (!held_.back().ready_)
+        held_.push_back(XCodecHeld(true));
+    return (held_.back().data_);
+}
+
+/*
+ * Counts what has been added to the last stretch held since it was counted.
+ */
+void XCodecDecoder::settle(void) {
+    if (held_.empty() || !held_.back().ready_)
+        return;
+    held_length_ += held_.back().data_.length() - held_.back().length_;
+    held_.back().length_ = held_.back().data_.length();
+}
+
+/*
+ * How long the output of a waiting op will be, or at most.
+ */
+size_t XCodecDecoder::expanded(const Buffer &op) const {
+    uint16_t length;
+    uint8_t code;
+    uint8_t ns;
+
+    op.extract(&code, sizeof(XCODEC_MAGIC));
+    switch (code) {
+        case XCODEC_OP_REF_RANGE:
+            op.extract(&length, sizeof(XCODEC_MAGIC) + sizeof code + sizeof(uint64_t) + sizeof(uint16_t));
+            return (BigEndian::decode(length));
+        case XCODEC_OP_DELTA:
+            op.extract(&length, sizeof(XCODEC_MAGIC) + sizeof code + sizeof(uint64_t));
+            return (BigEndian::decode(length));
+        case XCODEC_OP_REF_PEER:
+            return (segment_length(XCODEC_NAMESPACE_OWN));
+        case XCODEC_OP_REF_SHARED:
+            op.extract(&ns, sizeof(XCODEC_MAGIC) + sizeof code);
+            return (segment_length(ns));
+        default:
+            return (cache_->segment_length());
+    }
+}
+
+/*
+ * Does the <REF>, <REF_RANGE>, <DELTA>, <REF_PEER> or <REF_SHARED> in `op'
+ * if its segment is known, and holds it otherwise.
+ */
+bool XCodecDecoder::place(Buffer &output, Buffer &op, std::set<uint64_t> &unknown_hashes) {
+    uint64_t hash;
+    bool ready;
+    Buffer data;
+
+    if (!reconstruct(data, op, &ready, &hash))
+        return (false);
+
+    if (ready) {
+        data.moveout(&sink(output));
+        return (true);
+    }
+
+    settle();
+    held_.push_back(XCodecHeld(false, expanded(op)));
+    held_length_ += held_.back().length_;
+    wait(--held_.end(), hash);
+
+    if (reading_) {
+        DEBUG(log_) << "Holding output until the segment is read.";
+        fetching_ = reading_;
+    } else {
+        std::set<uint64_t> &unknown = unknown_for(op, unknown_hashes);
+        if (unknown.find(hash) == unknown.end()) {
+            DEBUG(log_) << "Sending <ASK>, holding output until <LEARN>.";
+            unknown.insert(hash);
+        } else {
+            DEBUG(log_) << "Already sent <ASK>, holding output until <LEARN>.";
+        }
+    }
+
+    op.moveout(&held_.back().data_);
+    return (true);
+}
+
+/*
+ * A held op waits to be tried again either for a read from disk, which the
+ * caller waits for before calling again, or for its segment to be learned.
+ */
+void XCodecDecoder::wait(held_iterator it, const uint64_t &hash) {
+    if (reading_)
+        reads_.push_back(it);
+    else
+        waiters_.insert(std::make_pair(hash, it));
+}
+
+/*
+ * Does what it can of the held ops whose segments have been read or learned
+ * since, and outputs whatever is no longer held behind one still waiting.
+ */
+bool XCodecDecoder::resolve(Buffer &output, std::set<uint64_t> &unknown_hashes) {
+    std::multimap<uint64_t, held_iterator>::iterator wit, wend;
+    std::set<uint64_t>::const_iterator lit;
+    std::vector<held_iterator> retry;
+    held_iterator it;
+    uint64_t hash;
+    bool ready;
+
+    retry.swap(reads_);
+    for (lit = learned_.begin(); lit != learned_.end(); ++lit) {
+        wend = waiters_.upper_bound(*lit);
+        for (wit = waiters_.lower_bound(*lit); wit != wend; ++wit)
+            retry.push_back(wit->second);
+        waiters_.erase(waiters_.lower_bound(*lit), wend);
+    }
+    learned_.clear();
+
+    for (size_t i = 0; i < retry.size(); i++) {
+        it = retry[i];
+
+        Buffer data;
+        if (!reconstruct(data, it->data_, &ready, &hash))
+            return (false);
+        if (!ready && reading_) {
+            fetching_ = reading_;
+            wait(it, hash);
+            continue;
+        }
+        if (!ready) {
+            /*
+             * A segment that was learned may have been pushed out of
+             * the cache again before its op was done, in which case
+             * it has to be asked for again.
+             */
+            std::set<uint64_t> &unknown = unknown_for(it->data_, unknown_hashes);
+            if (unknown.find(hash) == unknown.end()) {
+                DEBUG(log_) << "Asking again for a segment lost from the cache.";
+                unknown.insert(hash);
+            }
+            wait(it, hash);
+            continue;
+        }
+
+        held_length_ += data.length() - it->length_;
+        it->length_ = data.length();
+        it->data_.clear();
+        data.moveout(&it->data_);
+        it->ready_ = true;
+    }
+
+    settle();
+    while (!held_.empty() && held_.front().ready_) {
+        held_length_ -= held_.front().length_;
+        held_.front().data_.moveout(&output);
+        held_.pop_front();
+    }
+    ASSERT(log_, !held_.empty() || held_length_ == 0);
+
+    if (held_.empty())
+        learned_foreign_.clear();
+
+    return (true);
+}
+
+/*
+ * Segments of other namespaces are asked for apart from those of the peer.
+ */
+std::set<uint64_t> &XCodecDecoder::unknown_for(const Buffer &op, std::set<uint64_t> &unknown_hashes) {
+    uint8_t code = 0;
+    uint8_t ns = 0;
+
+    op.extract(&code, sizeof(XCODEC_MAGIC));
+    switch (code) {
+        case XCODEC_OP_REF_PEER:
+            return (unknown_foreign_[XCODEC_NAMESPACE_OWN]);
+        case XCODEC_OP_REF_SHARED:
+            op.extract(&ns, sizeof(XCODEC_MAGIC) + sizeof code);
+            return (unknown_foreign_[ns]);
+        default:
+            return (unknown_hashes);
+    }
+}
+
+/*
+ * Appends to `output' what a complete <REF>, <REF_RANGE>, <DELTA>,
+ * <REF_PEER> or <REF_SHARED> in `op' stands for, if the segment it needs is
+ * known.  Otherwise clears `*readyp' and sets `*hashp' to the hash of that
+ * segment, and if the segment is known but has yet to be read from disk
+ * also sets reading_ to its cache.  Returns false if the op is not valid.
+ */
+bool XCodecDecoder::reconstruct(Buffer &output, const Buffer &op, bool *readyp, uint64_t *hashp) {
+    uint8_t data[XCODEC_SEGMENT_LENGTH];
+    uint8_t base[XCODEC_SEGMENT_LENGTH];
+    uint64_t behash;
+    uint64_t hash;
+    uint16_t offset;
+    uint16_t length;
+    uint16_t size;
+    uint8_t code;
+    Buffer seg, patch, target;
+
+    reading_ = NULL;
+    op.extract(&code, sizeof(XCODEC_MAGIC));
+    if (code == XCODEC_OP_REF_PEER || code == XCODEC_OP_REF_SHARED)
+        return (reconstruct_foreign(output, op, readyp, hashp));
+
+    op.extract(&behash, sizeof(XCODEC_MAGIC) + sizeof code);
+    hash = BigEndian::decode(behash);
+
+    if (!window_.recall(hash, seg)) {
+        if (!cache_->ready(hash))
+            reading_ = cache_;
+        if (reading_ || !cache_->lookup(hash, seg)) {
+            *readyp = false;
+            *hashp = hash;
+            return (true);
+        }
+    }
+    *readyp = true;
+
+    switch (code) {
+        case XCODEC_OP_REF:
+            window_.fill(hash, seg);
+            seg.moveout(&output);
+            break;
+
+        case XCODEC_OP_REF_RANGE:
+            op.extract(&offset, sizeof(XCODEC_MAGIC) + sizeof code + sizeof behash);
+            offset = BigEndian::decode(offset);
+            op.extract(&length, sizeof(XCODEC_MAGIC) + sizeof code + sizeof behash + sizeof offset);
+            length = BigEndian::decode(length);
+            if (length == 0 || (unsigned) offset + length > seg.length()) {
+                ERROR(log_) << "Invalid <REF_RANGE> " << offset << "+" << length << " of " << seg.length() << " bytes.";
+                return (false);
+            }
+
+            output.append(seg, offset, length);
+            break;
+
+        case XCODEC_OP_DELTA:
+            op.extract(&length, sizeof(XCODEC_MAGIC) + sizeof code + sizeof behash);
+            length = BigEndian::decode(length);
+            op.extract(&size, sizeof(XCODEC_MAGIC) + sizeof code + sizeof behash + sizeof length);
+            size = BigEndian::decode(size);
+
+            seg.copyout(base, seg.length());
+            patch.append(op, sizeof(XCODEC_MAGIC) + sizeof code + sizeof behash + sizeof length + sizeof size, size);
+            if (!XCodecDelta::decode(target, base, seg.length(), patch, length)) {
+                ERROR(log_) << "Invalid patch in <DELTA>.";
+                return (false);
+            }
+
+            /*
+             * The new segment takes its hash, as the encoder entered it
+             * by that hash, and other data by it is data the encoder no
+             * longer has, as for an <EXTRACT>.  A patch against the
+             * segment it collides with is not entered by the encoder.
+             */
+            target.copyout(data, length);
+            hash = XCodecHash::hash(cache_->family(), data, length);
+            if (hash != BigEndian::decode(behash)) {
+                if (!cache_->contains(hash))
+                    cache_->enter(hash, target, 0, length);
+                else if (!cache_->verify(hash, XCodecFingerprint::compute(data, length)))
+                    cache_->replace(hash, target, 0, length);
+            }
+
+            target.moveout(&output);
+            break;
+
+        default:
+            NOTREACHED(log_);
+    }
+
+    return (true);
+}
+
+/*
+ * A <REF_PEER> or <REF_SHARED> is done from our cache of its namespace if it
+ * still has the segment with the fingerprint the peer has for it, and from
+ * what the peer sent back for it otherwise, which must match.
+ */
+bool XCodecDecoder::reconstruct_foreign(Buffer &output, const Buffer &op, bool *readyp, uint64_t *hashp) {
+    uint8_t data[XCODEC_SEGMENT_LENGTH];
+    uint64_t befingerprint;
+    uint64_t fingerprint;
+    uint64_t behash;
+    uint64_t hash;
+    unsigned off;
+    unsigned ns;
+    uint8_t code;
+    uint8_t index;
+    Buffer seg;
+
+    op.extract(&code, sizeof(XCODEC_MAGIC));
+    off = sizeof(XCODEC_MAGIC) + sizeof code;
+    if (code == XCODEC_OP_REF_SHARED) {
+        op.extract(&index, off);
+        off += sizeof index;
+        ns = index;
+    } else
+        ns = XCODEC_NAMESPACE_OWN;
+    op.extract(&behash, off);
+    hash = BigEndian::decode(behash);
+    op.extract(&befingerprint, off + sizeof behash);
+    fingerprint = BigEndian::decode(befingerprint);
+
+    std::map<uint64_t, Buffer> &learned = learned_foreign_[ns];
+    std::map<uint64_t, Buffer>::const_iterator it = learned.find(hash);
+    if (it != learned.end()) {
+        if (it->second.empty() || it->second.length() > XCODEC_SEGMENT_LENGTH) {
+            ERROR(log_) << "Invalid length of segment of another namespace: " << it->second.length();
+            return (false);
+        }
+        it->second.copyout(data, it->second.length());
+        if (XCodecFingerprint::compute(data, it->second.length()) != fingerprint) {
+            ERROR(log_) << "Segment of another namespace does not match its fingerprint.";
+            return (false);
+        }
+        output.append(it->second);
+        *readyp = true;
+        return (true);
+    }
+
+    XCodecCache *cache = namespaces_[ns];
+    if (cache != NULL && cache->verify(hash, fingerprint)) {
+        if (!cache->ready(hash)) {
+            reading_ = cache;
+        } else if (cache->lookup(hash, seg)) {
+            seg.moveout(&output);
+            *readyp = true;
+            return (true);
+        }
+    }
+
+    *readyp = false;
+    *hashp = hash;
+    return (true);
+}
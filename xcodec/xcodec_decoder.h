@@ -26,7 +26,14 @@
 #ifndef    XCODEC_XCODEC_DECODER_H
 #define    XCODEC_XCODEC_DECODER_H
 
+#include <list>
+#include <map>
 #include <set>
+#include <vector>
+
+#include "./xcodec_history.h"
+#include "./xcodec_super.h"
+#include "./xcodec_window.h"
 
 ////////////////////////////////////////////////////////////////////////////////
 //                                                                            //
@@ -40,16 +47,161 @@
 
 class XCodecCache;
 
+/*
+ * Decoding goes on past an unknown hash until this much output is held
+ * behind it.
+ */
+#define    XCODEC_HOLD_LIMIT    (1024 * 1024)
+
+/*
+ * The index under which the decoder keeps our own namespace, for <REF_PEER>,
+ * after those of <REF_SHARED>, which fit in a byte.
+ */
+#define    XCODEC_NAMESPACE_OWN    (256)
+
+/*
+ * A stretch of output that is ready, or an op waiting for its segment, and
+ * how much of the bytes held it has been counted for: what it is for the
+ * one, and what it will be once done for the other.
+ */
+struct XCodecHeld {
+    bool ready_;
+    Buffer data_;
+    size_t length_;
+
+    XCodecHeld(bool ready, size_t length = 0)
+            : ready_(ready),
+              data_(),
+              length_(length) {}
+};
+
 class XCodecDecoder {
+    typedef std::list<XCodecHeld>::iterator held_iterator;
+
     LogHandle log_;
     XCodecCache *cache_;
+    XCodecHistory history_;
+    XCodecWindow window_;
+    XCodecSuperBuilder supers_;
+    std::list<XCodecHeld> held_;
+    size_t held_length_;
+    std::multimap<uint64_t, held_iterator> waiters_;
+    std::vector<held_iterator> reads_;
+    std::set<uint64_t> learned_;
+    std::map<unsigned, XCodecCache *> namespaces_;
+    std::map<unsigned, std::set<uint64_t> > unknown_foreign_;
+    std::map<unsigned, std::map<uint64_t, Buffer> > learned_foreign_;
+    XCodecCache *reading_;
+    XCodecCache *fetching_;
 
 public:
     XCodecDecoder(XCodecCache *);
 
     ~XCodecDecoder();
 
-    bool decode(Buffer &, Buffer &, std::set<uint64_t> &);
+    /*
+     * The cache of our own encoder, in whose namespace <REF_PEER>s are.
+     */
+    void set_own(XCodecCache *cache) {
+        namespaces_[XCODEC_NAMESPACE_OWN] = cache;
+    }
+
+    /*
+     * Our copies of the caches the peer listed in <HELLO>, in its order,
+     * for <REF_SHARED>.  Those we do not hold are NULL, and what is
+     * referenced in them is asked for.
+     */
+    void set_shared(const std::vector<XCodecCache *> &);
+
+    /*
+     * Hashes, by namespace, of the segments that <REF_PEER>s and
+     * <REF_SHARED>s need and that are not in our cache of that namespace,
+     * or not with the data the peer has, for the caller to ask the peer
+     * for.  What it sends back is given to learn_foreign, and kept only
+     * for as long as ops are held.
+     */
+    std::map<unsigned, std::set<uint64_t> > &unknown_foreign(void) {
+        return (unknown_foreign_);
+    }
+
+    bool foreign_unknown(void) const;
+
+    /*
+     * The longest a segment learned in namespace `ns' may be: as long as
+     * those of our cache of it, or of our cache of the peer if we hold
+     * none of it.
+     */
+    unsigned segment_length(unsigned ns) const;
+
+    void learn_foreign(unsigned ns, const uint64_t &hash, const Buffer &data) {
+        unknown_foreign_[ns].erase(hash);
+        learned_foreign_[ns][hash] = data;
+        learned(hash);
+    }
+
+    /*
+     * The segment `hash' has come, so that the ops waiting for it are
+     * tried again in the next call to decode, and only those.
+     */
+    void learned(const uint64_t &hash) {
+        if (waiters_.find(hash) != waiters_.end())
+            learned_.insert(hash);
+    }
+
+    /*
+     * Hashes of segments and names of superchunks that are needed and
+     * not known are added to the two sets.
+     */
+    bool decode(Buffer &, Buffer &, std::set<uint64_t> &, std::set<uint64_t> &);
+
+    /*
+     * Tells if there is output held behind an unknown hash, which a call
+     * to decode, even with no more input, may let out.
+     */
+    bool holding(void) const {
+        return (!held_.empty());
+    }
+
+    /*
+     * Bytes held, counting what the ops waiting stand for.  Output added
+     * to the last stretch held is counted once something is held after
+     * it.
+     */
+    size_t held_length(void) const {
+        if (held_.empty() || !held_.back().ready_)
+            return (held_length_);
+        return (held_length_ + held_.back().data_.length() - held_.back().length_);
+    }
+
+    /*
+     * A cache that ops held in the last call to decode wait to have read
+     * from disk, for the caller to wait for before calling it again.
+     * Nothing is asked for these.
+     */
+    XCodecCache *fetching(void) const {
+        return (fetching_);
+    }
+
+private:
+    void declare(const uint64_t &, const Buffer &, const uint8_t *, unsigned);
+
+    Buffer &sink(Buffer &);
+
+    void settle(void);
+
+    void wait(held_iterator, const uint64_t &);
+
+    size_t expanded(const Buffer &) const;
+
+    bool place(Buffer &, Buffer &, std::set<uint64_t> &);
+
+    bool resolve(Buffer &, std::set<uint64_t> &);
+
+    bool reconstruct(Buffer &, const Buffer &, bool *, uint64_t *);
+
+    bool reconstruct_foreign(Buffer &, const Buffer &, bool *, uint64_t *);
+
+    std::set<uint64_t> &unknown_for(const Buffer &, std::set<uint64_t> &);
 };
 
 #endif /* !XCODEC_XCODEC_DECODER_H */
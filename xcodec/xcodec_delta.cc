@@ -0,0 +1,210 @@
+////////////////////////////////////////////////////////////////////////////////
+//                                                                            //
+// File:           xcodec_delta.cc                                            //
+// Description:    patches between similar segments for the xcodec protocol   //
+// Project:        WANProxy XTech                                             //
+// Last modified:  2026-10-18                                                 //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+
+#include "../common/buffer.h"
+#include "../common/endian.h"
+
+#include "./xcodec.h"
+#include "./xcodec_delta.h"
+#include "./xcodec_fingerprint.h"
+
+/*
+ * Each super-feature combines this many features, each of which is the
+ * largest value of its own transform over the sampled positions of the
+ * segment.  One position in 64 is sampled, so a change to a few bytes
+ * seldom touches the samples that decide a feature.
+ */
+#define    XCODEC_DELTA_FEATURE_WIDTH    (3)
+#define    XCODEC_DELTA_SAMPLE_SHIFT    (58)
+
+/*
+ * Matches against the base are found by their first eight bytes, through a
+ * table of the last offset in the base at which each of them was seen.
+ */
+#define    XCODEC_DELTA_MATCH        (8)
+#define    XCODEC_DELTA_TABLE_BITS    (10)
+#define    XCODEC_DELTA_EMPTY        (0xffff)
+
+#define    XCODEC_DELTA_PRIME        (0x9e3779b97f4a7c15ull)
+
+/*
+ * Odd multiplier and addend of each transform, constants of well-known hash
+ * functions.  Features are only ever used by the encoder to index its own
+ * cache, so these could change at any time.
+ */
+static const uint64_t xcodec_delta_transform[XCODEC_DELTA_FEATURES * XCODEC_DELTA_FEATURE_WIDTH][2] = {
+    { 0xe220a8397b1dcdafull, 0x6e789e6aa1b965f4ull },
+    { 0x06c45d188009454full, 0xf88bb8a8724c81ecull },
+    { 0xd1b54a32d192ed03ull, 0xaef17502108ef2d9ull },
+    { 0x9e6c63d0676a9a99ull, 0x2b3b3a7bfb40a0f4ull },
+    { 0xb7e151628aed2a6bull, 0x4f1bbcdcbfa54237ull },
+    { 0xa0761d6478bd642full, 0xe7037ed1a0b428dbull },
+    { 0x8ebc6af09c88c6e3ull, 0x589965cc75374cc3ull },
+    { 0x1d8e4e27c47d124full, 0xc2b2ae3d27d4eb4full },
+    { 0x165667b19e3779f9ull, 0x27d4eb2f165667c5ull },
+    { 0x94d049bb133111ebull, 0xbf58476d1ce4e5b9ull },
+    { 0xff51afd7ed558ccdull, 0xc4ceb9fe1a85ec53ull },
+    { 0x87c37b91114253d5ull, 0x4cf5ad432745937full },
+};
+
+static inline uint64_t
+xcodec_delta_load(const uint8_t *p)
+{
+    uint64_t v;
+
+    memcpy(&v, p, sizeof v);
+    return (v * XCODEC_DELTA_PRIME);
+}
+
+static inline unsigned
+xcodec_delta_slot(const uint8_t *p)
+{
+    return (xcodec_delta_load(p) >> (64 - XCODEC_DELTA_TABLE_BITS));
+}
+
+static void
+xcodec_delta_copy(Buffer &patch, unsigned offset, unsigned length)
+{
+    uint16_t beoffset = BigEndian::encode((uint16_t) offset);
+    uint16_t belength = BigEndian::encode((uint16_t) length);
+
+    patch.append(XCODEC_DELTA_COPY);
+    patch.append(&beoffset);
+    patch.append(&belength);
+}
+
+static void
+xcodec_delta_insert(Buffer &patch, const uint8_t *data, unsigned length)
+{
+    if (length == 0)
+        return;
+
+    uint16_t belength = BigEndian::encode((uint16_t) length);
+
+    patch.append(XCODEC_DELTA_INSERT);
+    patch.append(&belength);
+    patch.append(data, length);
+}
+
+bool XCodecDelta::features(const uint8_t *data, unsigned length, uint64_t *features) {
+    uint64_t max[XCODEC_DELTA_FEATURES * XCODEC_DELTA_FEATURE_WIDTH];
+    unsigned i, j, samples;
+
+    memset(max, 0, sizeof max);
+    samples = 0;
+
+    for (i = 0; i + XCODEC_DELTA_MATCH <= length; i++) {
+        uint64_t x = xcodec_delta_load(data + i);
+        if ((x >> XCODEC_DELTA_SAMPLE_SHIFT) != 0)
+            continue;
+        x ^= x >> 32;
+        samples++;
+
+        for (j = 0; j < XCODEC_DELTA_FEATURES * XCODEC_DELTA_FEATURE_WIDTH; j++) {
+            uint64_t t = x * xcodec_delta_transform[j][0] + xcodec_delta_transform[j][1];
+            if (t > max[j])
+                max[j] = t;
+        }
+    }
+
+    if (samples < XCODEC_DELTA_FEATURE_WIDTH)
+        return (false);
+
+    for (i = 0; i < XCODEC_DELTA_FEATURES; i++)
+        features[i] = XCodecFingerprint::compute((const uint8_t *) &max[i * XCODEC_DELTA_FEATURE_WIDTH], XCODEC_DELTA_FEATURE_WIDTH * sizeof max[0]);
+    return (true);
+}
+
+/*
+ * Greedy: at each offset of the new segment, the longest match in the base
+ * that starts with the same eight bytes as the table gives is taken, grown
+ * backwards over what would otherwise be inserted, and the bytes that have
+ * no match are inserted.
+ */
+bool XCodecDelta::encode(Buffer &patch, const uint8_t *base, unsigned base_length, const uint8_t *data, unsigned length, unsigned limit) {
+    uint16_t table[1 << XCODEC_DELTA_TABLE_BITS];
+    unsigned b, t, n, lit;
+
+    memset(table, 0xff, sizeof table);
+    for (b = 0; b + XCODEC_DELTA_MATCH <= base_length; b++)
+        table[xcodec_delta_slot(base + b)] = b;
+
+    lit = 0;
+    t = 0;
+    while (t + XCODEC_DELTA_MATCH <= length) {
+        b = table[xcodec_delta_slot(data + t)];
+        if (b == XCODEC_DELTA_EMPTY || memcmp(base + b, data + t, XCODEC_DELTA_MATCH) != 0) {
+            t++;
+            continue;
+        }
+
+        while (t > lit && b > 0 && base[b - 1] == data[t - 1]) {
+            t--;
+            b--;
+        }
+        for (n = XCODEC_DELTA_MATCH; t + n < length && b + n < base_length && base[b + n] == data[t + n]; n++)
+            continue;
+
+        xcodec_delta_insert(patch, data + lit, t - lit);
+        xcodec_delta_copy(patch, b, n);
+        if (patch.length() > limit)
+            return (false);
+
+        t += n;
+        lit = t;
+    }
+    xcodec_delta_insert(patch, data + lit, length - lit);
+
+    return (patch.length() <= limit);
+}
+
+bool XCodecDelta::decode(Buffer &output, const uint8_t *base, unsigned base_length, Buffer &patch, unsigned length) {
+    uint16_t offset, n;
+    unsigned done;
+    uint8_t op;
+
+    done = 0;
+    while (!patch.empty()) {
+        op = patch.peek();
+        switch (op) {
+            case XCODEC_DELTA_COPY:
+                if (patch.length() < sizeof op + sizeof offset + sizeof n)
+                    return (false);
+                patch.extract(&offset, sizeof op);
+                offset = BigEndian::decode(offset);
+                patch.extract(&n, sizeof op + sizeof offset);
+                n = BigEndian::decode(n);
+                if (n == 0 || (unsigned) offset + n > base_length || done + n > length)
+                    return (false);
+
+                output.append(base + offset, n);
+                patch.skip(sizeof op + sizeof offset + sizeof n);
+                break;
+
+            case XCODEC_DELTA_INSERT:
+                if (patch.length() < sizeof op + sizeof n)
+                    return (false);
+                patch.extract(&n, sizeof op);
+                n = BigEndian::decode(n);
+                if (n == 0 || patch.length() < sizeof op + sizeof n + n || done + n > length)
+                    return (false);
+
+                patch.skip(sizeof op + sizeof n);
+                output.append(patch, n);
+                patch.skip(n);
+                break;
+
+            default:
+                return (false);
+        }
+        done += n;
+    }
+
+    return (done == length);
+}
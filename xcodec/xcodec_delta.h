@@ -0,0 +1,57 @@
+#ifndef    XCODEC_XCODEC_DELTA_H
+#define    XCODEC_XCODEC_DELTA_H
+
+////////////////////////////////////////////////////////////////////////////////
+//                                                                            //
+// File:           xcodec_delta.h                                             //
+// Description:    patches between similar segments for the xcodec protocol   //
+// Project:        WANProxy XTech                                             //
+// Last modified:  2026-10-18                                                 //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+
+/*
+ * Number of super-features of a segment.  Two segments are taken to be
+ * similar if any of them is the same, which for a segment with a few bytes
+ * changed is very likely and for unrelated data is very unlikely.
+ */
+#define    XCODEC_DELTA_FEATURES    (4)
+
+/*
+ * Largest patch worth sending instead of a segment of length `l'.
+ */
+#define    XCODEC_DELTA_LIMIT(l)    ((l) / 4)
+
+/*
+ * A patch is a series of instructions, each of which adds to the segment
+ * being built either bytes of the base segment or bytes of its own:
+ *
+ * 	<DELTA_COPY> offset[uint16_t] length[uint16_t]
+ * 	<DELTA_INSERT> length[uint16_t] data[length]
+ */
+#define    XCODEC_DELTA_COPY    ((uint8_t)0x00)
+#define    XCODEC_DELTA_INSERT    ((uint8_t)0x01)
+
+class XCodecDelta {
+public:
+    /*
+     * Works out the super-features of a segment, and returns false if it
+     * has too little variety for them to tell anything.
+     */
+    static bool features(const uint8_t *, unsigned, uint64_t *);
+
+    /*
+     * Appends to `patch' the instructions that build the segment `data' out
+     * of the segment `base', as long as they take no more than `limit'
+     * bytes, and returns false otherwise.
+     */
+    static bool encode(Buffer &, const uint8_t *, unsigned, const uint8_t *, unsigned, unsigned);
+
+    /*
+     * Appends to `output' the segment of `length' bytes that `patch' builds
+     * out of `base', and returns false if the patch is not a valid one.
+     */
+    static bool decode(Buffer &, const uint8_t *, unsigned, Buffer &, unsigned);
+};
+
+#endif /* !XCODEC_XCODEC_DELTA_H */
@@ -28,6 +28,8 @@
 
 #include "./xcodec.h"
 #include "./xcodec_cache.h"
+#include "./xcodec_decoder.h"
+#include "./xcodec_delta.h"
 #include "./xcodec_encoder.h"
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -40,15 +42,47 @@
 //                                                                            //
 ////////////////////////////////////////////////////////////////////////////////
 
-XCodecEncoder::XCodecEncoder(XCodecCache *cache)
+XCodecEncoder::XCodecEncoder(XCodecCache *cache, unsigned options)
         : log_("/xcodec/encoder"),
-          cache_(cache) {
+          cache_(cache),
+          segment_length_(cache->segment_length()),
+          options_(options),
+          xcodec_hash_(cache->family(), cache->segment_length()),
+          chunker_(cache->segment_length()),
+          sample_mask_(0),
+          budget_(0),
+          credit_(0),
+          window_limit_(0),
+          supers_(cache, true),
+          run_first_(0),
+          run_last_(0),
+          run_count_(0),
+          run_index_(-1),
+          run_super_(false),
+          run_name_(0),
+          run_start_(0),
+          sent_supers_(),
+          sent_foreign_(),
+          presence_(NULL),
+          peer_cache_(NULL) {
     candidate_start_ = -1;
     candidate_symbol_ = 0;
+    candidate_tag_ = 0;
 }
 
 XCodecEncoder::~XCodecEncoder() {}
 
+void XCodecEncoder::set_options(unsigned options) {
+    ASSERT(log_, source_.empty() && run_count_ == 0 && candidate_start_ == -1);
+    options_ = options;
+}
+
+void XCodecEncoder::set_sampling(unsigned bits, unsigned budget) {
+    sample_mask_ = (bits > 0 ? (1ull << bits) - 1 : 0);
+    budget_ = budget;
+    credit_ = budget * XCODEC_LOOKUP_COST;
+}
+
 /*
  * This takes a view of a data stream and turns it into a series of references
  * to other data, declarations of data to be referenced, and data that needs
@@ -56,58 +90,149 @@ XCodecEncoder::~XCodecEncoder() {}
  */
 
 void XCodecEncoder::encode(Buffer &output, Buffer &input) {
+    uint64_t hashes[XCODEC_HASH_BATCH];
+    int length = segment_length_;
     int off = source_.length();
-    Buffer old;
+    unsigned i, n, tag;
+
+    stats_.input_bytes_ += input.length();
+
+    if (options_ & XCODEC_OPTION_CHUNKING) {
+        encode_chunks(output, input);
+        return;
+    }
 
     source_.append(input);
 
     for (Buffer::SegmentIterator it = input.segments(); !it.end(); it.next()) {
         const BufferSegment *seg = *it;
-        const uint8_t *p, *q = seg->end();
+        const uint8_t *p = seg->data(), *q = seg->end(), *r;
+
+        while (p < q) {
+            if (off < length) {
+                /*
+                 * Add bytes to the hash until we have a complete hash.
+                 */
+                n = std::min<unsigned>(q - p, length - off);
+                xcodec_hash_.add(p, n);
+                p += n;
+                if ((off += n) < length)
+                    continue;
+
+                off--;    /* Counted again below.  */
+                r = p - 1;
+                hashes[0] = xcodec_hash_.mix();
+                n = 1;
+            } else {
+                /*
+                 * And then roll it over a batch of bytes at a time,
+                 * mixing the hash's internal state at each offset into
+                 * a uint64_t that we can use to refer to that data and
+                 * to look up possible past occurances of that data in
+                 * the XCodecCache.
+                 */
+                r = p;
+                n = std::min<unsigned>(q - p, XCODEC_HASH_BATCH);
+                xcodec_hash_.roll(p, n, hashes);
+                p += n;
+            }
 
-        for (p = seg->data(); p < q; ++p) {
             /*
-             * Add bytes to the hash until we have a complete hash.
+             * Each byte earns its share of the lookup budget, which
+             * is not let to pile up beyond one KB's worth so that a
+             * quiet stretch cannot pay for a burst later.
              */
-            if (++off < XCODEC_SEGMENT_LENGTH)
-                xcodec_hash_.add(*p);
-            else {
-                if (off == XCODEC_SEGMENT_LENGTH)
-                    xcodec_hash_.add(*p);
-                else
-                    xcodec_hash_.roll(*p);
+            if (budget_ > 0) {
+                credit_ += n * budget_;
+                if (credit_ > budget_ * XCODEC_LOOKUP_COST)
+                    credit_ = budget_ * XCODEC_LOOKUP_COST;
+            }
+
+            for (i = 0; i < n; i++) {
+                uint64_t hash = hashes[i];
+
+                off++;
 
                 /*
-                 * And then mix the hash's internal state into a
-                 * uint64_t that we can use to refer to that data
-                 * and to look up possible past occurances of that
-                 * data in the XCodecCache.
+                 * Right after a reference, the first full window may
+                 * be the segment that followed it the last time, and
+                 * then the run just goes on.  Otherwise the run ends
+                 * and as much of that segment as matches is referenced
+                 * by range, with the window started again after it.
                  */
-                uint64_t hash = xcodec_hash_.mix();
+                if (run_count_ > 0 && off == length) {
+                    unsigned m;
+
+                    if (extend_run(output, hash, length)) {
+                        source_.skip(length);
+                        off = 0;
+                        xcodec_hash_.reset();
+                        p = r + i + 1;
+                        break;
+                    }
+
+                    end_run(output);
+
+                    if ((m = extend_forward(output)) > 0) {
+                        uint8_t data[XCODEC_SEGMENT_LENGTH];
+
+                        /*
+                         * After a run along a superchunk the segment
+                         * that followed in the history may match whole.
+                         */
+                        off = length - m;
+                        xcodec_hash_.reset();
+                        if (off > 0) {
+                            source_.copyout(data, off);
+                            xcodec_hash_.add(data, off);
+                        }
+                        p = r + i + 1;
+                        break;
+                    }
+                }
 
                 /*
                  * If there is a pending candidate hash that wouldn't
                  * overlap with the data that the rolling hash presently
                  * covers, declare it now.
                  */
-                if (candidate_start_ >= 0 && candidate_start_ + (XCODEC_SEGMENT_LENGTH * 2) <= off) {
-                    encode_declaration(output, source_, candidate_start_, candidate_symbol_);
-                    off -= (candidate_start_ + XCODEC_SEGMENT_LENGTH);
+                if (candidate_start_ >= 0 && candidate_start_ + (length * 2) <= off) {
+                    encode_declaration(output, source_, candidate_start_, candidate_symbol_, candidate_tag_);
+                    off -= (candidate_start_ + length);
                     candidate_start_ = -1;
                 }
 
+                /*
+                 * Only sampled positions are looked up or declared, so
+                 * that the same data is anchored at the same offsets on
+                 * either occurrence, and only as long as there is budget.
+                 */
+                if (hash & sample_mask_) {
+                    stats_.sampled_out_++;
+                    continue;
+                }
+
+                if (budget_ > 0) {
+                    if (credit_ < XCODEC_LOOKUP_COST) {
+                        stats_.budget_skips_++;
+                        continue;
+                    }
+                    credit_ -= XCODEC_LOOKUP_COST;
+                }
+
                 /*
                  * Now attempt to encode this hash as a reference if it
                  * has been defined before.
                  */
 
-                if (cache_->lookup(hash, old)) {
+                stats_.lookups_++;
+                if (cache_->contains(hash)) {
                     /*
                      * This segment already exists.  If it's
                      * identical to this chunk of data, then that's
                      * positively fantastic.
                      */
-                    if (encode_reference(output, source_, off - XCODEC_SEGMENT_LENGTH, hash, old)) {
+                    if (encode_reference(output, source_, off - length, hash, &tag)) {
                         /*
                          * We have output any data before this hash
                          * in escaped form, so any candidate hash
@@ -116,6 +241,24 @@ void XCodecEncoder::encode(Buffer &output, Buffer &input) {
                         off = 0;
                         xcodec_hash_.reset();
                         candidate_start_ = -1;
+                    } else if ((options_ & XCODEC_OPTION_DELTA) &&
+                               encode_collision(output, source_, off - length, hash)) {
+                        /*
+                         * It collides with a segment similar enough
+                         * to send it as a patch against, which has
+                         * used it up just as a reference would.
+                         */
+                        off = 0;
+                        xcodec_hash_.reset();
+                        candidate_start_ = -1;
+                    } else if (candidate_start_ < 0 && tag <= XCODEC_TAG_MAX) {
+                        /*
+                         * It can still be declared by its hash with a
+                         * collision counter, if nothing better comes.
+                         */
+                        candidate_start_ = off - length;
+                        candidate_symbol_ = hash;
+                        candidate_tag_ = tag;
                     } else {
                         /*
                          * This hash isn't usable because it collides
@@ -124,8 +267,14 @@ void XCodecEncoder::encode(Buffer &output, Buffer &input) {
                          */
                         DEBUG(log_) << "Collision in first pass.";
                     }
-
-                    old.clear();
+                } else if (encode_foreign(output, source_, off - length, hash, length)) {
+                    /*
+                     * The peer has this data under another name, in its
+                     * own namespace or in one we share.
+                     */
+                    off = 0;
+                    xcodec_hash_.reset();
+                    candidate_start_ = -1;
                 } else {
                     /*
                      * Not defined before, it's a candidate for declaration
@@ -138,7 +287,7 @@ void XCodecEncoder::encode(Buffer &output, Buffer &input) {
                          * covered by this hash, so don't remember it
                          * and keep going.
                          */
-                        ASSERT(log_, candidate_start_ + (XCODEC_SEGMENT_LENGTH * 2) > off);
+                        ASSERT(log_, candidate_start_ + (length * 2) > off);
                     } else {
                         /*
                          * The hash at this offset doesn't collide with any
@@ -147,10 +296,20 @@ void XCodecEncoder::encode(Buffer &output, Buffer &input) {
                          * find something to reference we can declare this one
                          * for future use.
                          */
-                        candidate_start_ = off - XCODEC_SEGMENT_LENGTH;
+                        candidate_start_ = off - length;
                         candidate_symbol_ = hash;
+                        candidate_tag_ = 0;
                     }
                 }
+
+                /*
+                 * If the hash has been reset, what is left of the batch
+                 * has to be added to it again from scratch.
+                 */
+                if (off == 0) {
+                    p = r + i + 1;
+                    break;
+                }
             }
         }
     }
@@ -159,11 +318,33 @@ void XCodecEncoder::encode(Buffer &output, Buffer &input) {
 bool XCodecEncoder::flush(Buffer &output) {
     bool vld = false;
 
+    /*
+     * Whatever is left is the start of a chunk, end it here if it is not
+     * too short to be worth it.
+     */
+    if (options_ & XCODEC_OPTION_CHUNKING) {
+        if (source_.length() >= XCODEC_CHUNK_MIN_LENGTH(segment_length_)) {
+            encode_chunk(output, source_, source_.length());
+            vld = true;
+        }
+        chunker_.reset();
+    }
+
+    /*
+     * A pending run goes out now, followed by whatever part of the next
+     * segment there is.
+     */
+    if (end_run(output)) {
+        if (!(options_ & XCODEC_OPTION_CHUNKING))
+            extend_forward(output);
+        vld = true;
+    }
+
     /*
      * There's a hash we can declare, do it.
      */
     if (candidate_start_ >= 0) {
-        encode_declaration(output, source_, candidate_start_, candidate_symbol_);
+        encode_declaration(output, source_, candidate_start_, candidate_symbol_, candidate_tag_);
         candidate_start_ = -1;
         vld = true;
     }
@@ -181,22 +362,224 @@ bool XCodecEncoder::flush(Buffer &output) {
     return vld;
 }
 
-void XCodecEncoder::encode_declaration(Buffer &output, Buffer &input, unsigned start, uint64_t hash) {
+/*
+ * Content-defined chunking splits the stream at positions chosen by its
+ * content, so data that reappears shifted by an insertion or a deletion is
+ * still cut the same way and can be referenced, without a cache lookup at
+ * every byte offset.  Each chunk is either referenced or declared in full.
+ */
+
+void XCodecEncoder::encode_chunks(Buffer &output, Buffer &input) {
+    bool boundary;
+    unsigned n;
+
+    source_.append(input);
+
+    for (Buffer::SegmentIterator it = input.segments(); !it.end(); it.next()) {
+        const BufferSegment *seg = *it;
+        const uint8_t *p = seg->data(), *q = seg->end();
+
+        while (p < q) {
+            n = chunker_.scan(p, q - p, &boundary);
+            p += n;
+            if (boundary) {
+                encode_chunk(output, source_, chunker_.length());
+                chunker_.reset();
+            }
+        }
+    }
+}
+
+void XCodecEncoder::encode_chunk(Buffer &output, Buffer &input, unsigned length) {
+    uint8_t data[XCODEC_SEGMENT_LENGTH];
+    uint64_t hash, name, fingerprint;
+    unsigned tag;
+
+    ASSERT(log_, length <= segment_length_);
+    input.copyout(data, length);
+    hash = XCodecHash::hash(cache_->family(), data, length);
+
+    if (run_count_ > 0) {
+        if (extend_run(output, hash, length)) {
+            input.skip(length);
+            return;
+        }
+        end_run(output);
+    }
+
+    stats_.lookups_++;
+    if (cache_->contains(hash)) {
+        fingerprint = XCodecFingerprint::compute(data, length);
+        name = hash;
+        if (cache_->verify(hash, fingerprint) || find_name(hash, fingerprint, &name, &tag)) {
+            reference(output, name, length);
+            input.skip(length);
+            return;
+        }
+
+        stats_.collisions_++;
+        if (tag <= XCODEC_TAG_MAX) {
+            declare(output, input, length, hash, tag);
+        } else {
+            DEBUG(log_) << "Collision in chunk.";
+            encode_escape(output, input, length);
+        }
+        return;
+    }
+
+    if (encode_foreign(output, input, 0, hash, length))
+        return;
+
+    declare(output, input, length, hash, 0);
+}
+
+void XCodecEncoder::encode_declaration(Buffer &output, Buffer &input, unsigned start, uint64_t hash, unsigned tag) {
     if (start > 0)
         encode_escape(output, input, start);
 
-    cache_->enter(hash, input, 0);
+    declare(output, input, segment_length_, hash, tag);
+}
+
+/*
+ * Declares the `length' bytes at the start of the input under `hash' with
+ * the collision counter `tag', as a patch against a cached segment like them
+ * if there is one and the hash is not tagged, since the peer enters what a
+ * patch builds by its own hash.
+ */
+void XCodecEncoder::declare(Buffer &output, Buffer &input, unsigned length, uint64_t hash, unsigned tag) {
+    uint64_t features[XCODEC_DELTA_FEATURES];
+    uint8_t data[XCODEC_SEGMENT_LENGTH];
+    bool indexed = false;
+    uint64_t base;
+
+    if (options_ & XCODEC_OPTION_DELTA) {
+        input.copyout(data, length);
+        indexed = XCodecDelta::features(data, length, features);
+        if (tag == 0 && indexed && cache_->similar(features, &base) && encode_delta(output, base, data, length)) {
+            cache_->enter(hash, input, 0, length);
+            cache_->resemble(hash, features);
+            if (presence_ != NULL)
+                presence_->declare(hash);
+            input.skip(length);
+            return;
+        }
+    }
+
+    hash = XCodecHash::tag(hash, tag);
+    cache_->enter(hash, input, 0, length);
+    if (indexed)
+        cache_->resemble(hash, features);
+    if (presence_ != NULL)
+        presence_->declare(hash);
+    note(hash);
+
+    encode_extract(output, input, length, tag);
+
+    input.skip(length);
+    stats_.declarations_++;
+    stats_.declared_bytes_ += length;
+    if (tag > 0)
+        stats_.tagged_++;
+}
+
+/*
+ * Appends the op that declares the `length' bytes at the start of the input,
+ * which are left there.
+ */
+void XCodecEncoder::encode_extract(Buffer &output, Buffer &input, unsigned length, unsigned tag) {
+    uint16_t belength = BigEndian::encode((uint16_t) length);
 
     output.append(XCODEC_MAGIC);
-    output.append(XCODEC_OP_EXTRACT);
-    output.append(input, XCODEC_SEGMENT_LENGTH);
+    if (tag > 0) {
+        output.append(XCODEC_OP_EXTRACT_TAGGED);
+        output.append((uint8_t) tag);
+        output.append(&belength);
+    } else if (length == segment_length_) {
+        output.append(XCODEC_OP_EXTRACT);
+    } else {
+        output.append(XCODEC_OP_CHUNK);
+        output.append(&belength);
+    }
+    output.append(input, length);
+}
+
+/*
+ * Data whose hash is taken by other data may be in the cache by the hash
+ * tagged with a collision counter.  Gives the name it goes by if it is, and
+ * otherwise the first counter it can be declared with, or one past
+ * XCODEC_TAG_MAX if there is none left.
+ */
+bool XCodecEncoder::find_name(uint64_t hash, uint64_t fingerprint, uint64_t *namep, unsigned *tagp) {
+    uint64_t name;
+    unsigned tag;
 
-    input.skip(XCODEC_SEGMENT_LENGTH);
+    *tagp = XCODEC_TAG_MAX + 1;
+    for (tag = 1; tag <= XCODEC_TAG_MAX; tag++) {
+        name = XCodecHash::tag(hash, tag);
+        if (!cache_->contains(name)) {
+            if (*tagp > XCODEC_TAG_MAX)
+                *tagp = tag;
+        } else if (cache_->verify(name, fingerprint)) {
+            *namep = name;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool XCodecEncoder::encode_delta(Buffer &output, uint64_t base, const uint8_t *data, unsigned length) {
+    uint8_t base_data[XCODEC_SEGMENT_LENGTH];
+    Buffer seg, patch;
+
+    if (!peek(base, seg))
+        return false;
+    seg.copyout(base_data, seg.length());
+
+    if (!XCodecDelta::encode(patch, base_data, seg.length(), data, length, XCODEC_DELTA_LIMIT(segment_length_)))
+        return false;
+
+    uint64_t bebase = BigEndian::encode(base);
+    uint16_t belength = BigEndian::encode((uint16_t) length);
+    uint16_t besize = BigEndian::encode((uint16_t) patch.length());
+
+    output.append(XCODEC_MAGIC);
+    output.append(XCODEC_OP_DELTA);
+    output.append(&bebase);
+    output.append(&belength);
+    output.append(&besize);
+    output.append(patch);
+
+    stats_.deltas_++;
+    stats_.delta_bytes_ += length;
+    stats_.patch_bytes_ += patch.length();
+    return true;
+}
+
+/*
+ * The segment `start' bytes into the input has the hash of a different one
+ * in the cache, which may still be near enough to it to serve as its base.
+ * The segment cannot be entered under that hash so it is only sent.
+ */
+bool XCodecEncoder::encode_collision(Buffer &output, Buffer &input, unsigned start, uint64_t hash) {
+    uint8_t data[XCODEC_SEGMENT_LENGTH];
+    Buffer op;
+
+    input.copyout(data, start, segment_length_);
+    if (!encode_delta(op, hash, data, segment_length_))
+        return false;
+
+    if (start > 0)
+        encode_escape(output, input, start);
+    output.append(op);
+    input.skip(segment_length_);
+    return true;
 }
 
 void XCodecEncoder::encode_escape(Buffer &output, Buffer &input, unsigned length) {
     unsigned pos;
 
+    stats_.escaped_bytes_ += length;
+
     while (length > 0) {
         if (input.find(XCODEC_MAGIC, 0, length, &pos)) {
             if (pos > 0)
@@ -213,21 +596,398 @@ void XCodecEncoder::encode_escape(Buffer &output, Buffer &input, unsigned length
     }
 }
 
-bool XCodecEncoder::encode_reference(Buffer &output, Buffer &input, unsigned start, uint64_t hash, Buffer &old) {
+/*
+ * The segment is compared by its fingerprint so that the cache need not read
+ * its data back, which for COSS may mean loading a whole stripe from disk.
+ */
+
+bool XCodecEncoder::encode_reference(Buffer &output, Buffer &input, unsigned start, uint64_t hash, unsigned *tagp) {
     uint8_t data[XCODEC_SEGMENT_LENGTH];
-    input.copyout(data, start, XCODEC_SEGMENT_LENGTH);
+    input.copyout(data, start, segment_length_);
+    uint64_t fingerprint = XCodecFingerprint::compute(data, segment_length_);
+
+    if (cache_->verify(hash, fingerprint) || find_name(hash, fingerprint, &hash, tagp)) {
+        if (start > 0 && (options_ & XCODEC_OPTION_RUNS))
+            start -= extend_backward(output, start, hash);
 
-    if (old.equal(data, sizeof data)) {
         if (start > 0)
             encode_escape(output, input, start);
 
+        reference(output, hash, segment_length_);
+        input.skip(segment_length_);
+        return true;
+    }
+
+    stats_.collisions_++;
+    return false;
+}
+
+/*
+ * A segment of the namespace of the peer or of a third side is not noted in
+ * the history or in the window, which are of ours, and the decoder does not
+ * note it either.
+ */
+bool XCodecEncoder::encode_foreign(Buffer &output, Buffer &input, unsigned start, uint64_t hash, unsigned length) {
+    uint8_t data[XCODEC_SEGMENT_LENGTH];
+    XCodecCache *cache = NULL;
+    unsigned ns = 0;
+
+    if ((options_ & XCODEC_OPTION_PEER) && peer_cache_ != NULL && peer_cache_->contains(hash))
+        cache = peer_cache_;
+    else if (options_ & XCODEC_OPTION_SHARED) {
+        for (ns = 0; ns < shared_.size(); ns++)
+            if (shared_[ns] != NULL && shared_[ns]->contains(hash))
+                break;
+        if (ns < shared_.size())
+            cache = shared_[ns];
+    }
+    if (cache == NULL)
+        return false;
+
+    input.copyout(data, start, length);
+    uint64_t fingerprint = XCodecFingerprint::compute(data, length);
+
+    if (!cache->verify(hash, fingerprint))
+        return false;
+
+    if (start > 0)
+        encode_escape(output, input, start);
+
+    if (cache == peer_cache_)
+        ns = XCODEC_NAMESPACE_OWN;
+    if (sent_foreign_.size() == XCODEC_FOREIGN_SENT)
+        sent_foreign_.pop_front();
+    sent_foreign_.push_back(std::make_pair(std::make_pair(ns, hash), Buffer(data, length)));
+
+    uint64_t behash = BigEndian::encode(hash);
+    uint64_t befingerprint = BigEndian::encode(fingerprint);
+    output.append(XCODEC_MAGIC);
+    if (ns == XCODEC_NAMESPACE_OWN) {
+        output.append(XCODEC_OP_REF_PEER);
+        stats_.peer_references_++;
+        stats_.peer_referenced_bytes_ += length;
+    } else {
+        uint8_t index = ns;
+        output.append(XCODEC_OP_REF_SHARED);
+        output.append(index);
+        stats_.shared_references_++;
+        stats_.shared_referenced_bytes_ += length;
+    }
+    output.append(&behash);
+    output.append(&befingerprint);
+    input.skip(length);
+    return true;
+}
+
+/*
+ * With runs, references are held back in the current run until a segment
+ * comes that did not follow the last one before, so that a long repeat goes
+ * out as a single <REF_RUN>.  The history is noted right away all the same,
+ * in the order the decoder will note it, and without runs too so that they
+ * can be turned on once the stream has started.
+ */
+
+void XCodecEncoder::reference(Buffer &output, uint64_t hash, unsigned length) {
+    if (!present(hash)) {
+        redeclare(output, hash, length);
+        return;
+    }
+
+    stats_.references_++;
+    stats_.referenced_bytes_ += length;
+    int index = recent(hash);
+
+    if (options_ & XCODEC_OPTION_RUNS) {
+        /*
+         * A run that starts at a segment of a superchunk is taken along
+         * the superchunk rather than along the history, which lets it
+         * follow data sent before in another stream.
+         */
+        if (run_count_++ == 0) {
+            run_first_ = hash;
+            run_index_ = index;
+            run_super_ = ((options_ & XCODEC_OPTION_SUPER) && cache_->member(hash, &run_name_, &run_start_) != NULL);
+            if (run_super_)
+                keep_super(run_name_);
+        }
+        run_last_ = hash;
+        note(hash);
+        return;
+    }
+
+    note(hash);
+
+    encode_ref(output, hash, index);
+}
+
+/*
+ * The peer has evicted the segment at the start of the source, so it is sent
+ * in full again rather than referenced, and the peer enters it anew.  It goes
+ * by its hash with whichever collision counter it was declared with.
+ */
+void XCodecEncoder::redeclare(Buffer &output, uint64_t hash, unsigned length) {
+    uint8_t data[XCODEC_SEGMENT_LENGTH];
+    uint64_t plain;
+    unsigned tag;
+
+    end_run(output);
+    note(hash);
+
+    source_.copyout(data, length);
+    plain = XCodecHash::hash(cache_->family(), data, length);
+    for (tag = 0; tag < XCODEC_TAG_MAX && XCodecHash::tag(plain, tag) != hash; tag++)
+        continue;
+    ASSERT(log_, XCodecHash::tag(plain, tag) == hash);
+    encode_extract(output, source_, length, tag);
+
+    presence_->declare(hash);
+    stats_.redeclarations_++;
+    stats_.declared_bytes_ += length;
+}
+
+/*
+ * Takes the segment of `length' bytes at the start of the source into the
+ * current run if it is the one that followed the last segment of the run.
+ * The caller skips it.
+ */
+bool XCodecEncoder::extend_run(Buffer &output, uint64_t hash, unsigned length) {
+    uint8_t data[XCODEC_SEGMENT_LENGTH];
+    uint64_t next;
+
+    if (run_super_) {
+        const std::vector<uint64_t> &hashes = sent_supers_.back().second;
+        unsigned position = run_start_ + run_count_;
+        if (position >= hashes.size() || hashes[position] != hash)
+            return false;
+    } else if (!history_.successor(run_last_, &next) || next != hash)
+        return false;
+
+    source_.copyout(data, length);
+    if (!cache_->verify(hash, XCodecFingerprint::compute(data, length)))
+        return false;
+
+    if (run_count_ == XCODEC_RUN_MAX)
+        end_run(output);
+    reference(output, hash, length);
+    return true;
+}
+
+bool XCodecEncoder::end_run(Buffer &output) {
+    if (run_count_ == 0)
+        return false;
+
+    if (run_count_ == 1) {
+        encode_ref(output, run_first_, run_index_);
+    } else if (run_super_) {
+        uint64_t bename = BigEndian::encode(run_name_);
+        uint16_t bestart = BigEndian::encode((uint16_t) run_start_);
+        uint16_t becount = BigEndian::encode((uint16_t) run_count_);
         output.append(XCODEC_MAGIC);
-        output.append(XCODEC_OP_REF);
+        output.append(XCODEC_OP_REF_SUPER);
+        output.append(&bename);
+        output.append(&bestart);
+        output.append(&becount);
+        stats_.super_runs_++;
+    } else {
+        uint64_t behash = BigEndian::encode(run_first_);
+        uint16_t becount = BigEndian::encode((uint16_t) run_count_);
+        output.append(XCODEC_MAGIC);
+        output.append(XCODEC_OP_REF_RUN);
+        output.append(&behash);
+        output.append(&becount);
+        stats_.runs_++;
+    }
+
+    run_count_ = 0;
+    return true;
+}
+
+/*
+ * The superchunk a run is taken along is kept from then on, as what the
+ * cache holds by its name may change before the run ends.
+ */
+void XCodecEncoder::keep_super(const uint64_t &name) {
+    cache_->referenced(name);
+    if (!sent_supers_.empty() && sent_supers_.back().first == name)
+        return;
+    if (sent_supers_.size() == XCODEC_SUPER_SENT)
+        sent_supers_.pop_front();
+    sent_supers_.push_back(std::make_pair(name, *cache_->sequence(name)));
+}
+
+const std::vector<uint64_t> *XCodecEncoder::sent_super(const uint64_t &name) {
+    unsigned i;
+
+    for (i = 0; i < sent_supers_.size(); i++) {
+        if (sent_supers_[i].first != name)
+            continue;
+        sent_supers_.erase(sent_supers_.begin(), sent_supers_.begin() + i);
+        return (&sent_supers_.front().second);
+    }
+    return (NULL);
+}
+
+const Buffer *XCodecEncoder::sent_foreign(unsigned ns, const uint64_t &hash) {
+    unsigned i;
+
+    for (i = 0; i < sent_foreign_.size(); i++) {
+        if (sent_foreign_[i].first != std::make_pair(ns, hash))
+            continue;
+        sent_foreign_.erase(sent_foreign_.begin(), sent_foreign_.begin() + i);
+        return (&sent_foreign_.front().second);
+    }
+    return (NULL);
+}
+
+/*
+ * Segments are noted in the history and the window at the points where the
+ * decoder notes them, which is when the op that declares or references them
+ * comes, or for a run when it is taken apart.
+ */
+void XCodecEncoder::note(const uint64_t &hash) {
+    history_.note(hash);
+    window_.note(hash);
+    if (options_ & XCODEC_OPTION_SUPER)
+        supers_.note(hash);
+}
+
+/*
+ * Where a reference to `hash' made now would find it in the window, or -1
+ * if it would not.  This is taken before the reference itself is noted.
+ */
+int XCodecEncoder::recent(const uint64_t &hash) const {
+    unsigned index;
+
+    if (window_limit_ == 0 || !window_.find(hash, &index) || index >= window_limit_)
+        return -1;
+    return (int) index;
+}
+
+void XCodecEncoder::encode_ref(Buffer &output, uint64_t hash, int index) {
+    output.append(XCODEC_MAGIC);
+    if (index >= 0) {
+        output.append(XCODEC_OP_BACKREF);
+        output.append((uint8_t) index);
+        stats_.backrefs_++;
+    } else {
         uint64_t behash = BigEndian::encode(hash);
+        output.append(XCODEC_OP_REF);
         output.append(&behash);
-        input.skip(XCODEC_SEGMENT_LENGTH);
-        return true;
     }
+}
 
-    return false;
+/*
+ * After a run has ended, references the leading bytes of the source that are
+ * the same as those of the segment that followed the last one of the run.
+ */
+unsigned XCodecEncoder::extend_forward(Buffer &output) {
+    uint8_t data[XCODEC_SEGMENT_LENGTH], next_data[XCODEC_SEGMENT_LENGTH];
+    uint64_t next;
+    unsigned n, m;
+    Buffer seg;
+
+    if (!history_.successor(run_last_, &next) || !peek(next, seg))
+        return 0;
+
+    n = std::min<unsigned>(seg.length(), source_.length());
+    if (n < XCODEC_EXTENSION_MIN)
+        return 0;
+
+    source_.copyout(data, n);
+    seg.copyout(next_data, n);
+    for (m = 0; m < n && data[m] == next_data[m]; m++)
+        continue;
+    if (m < XCODEC_EXTENSION_MIN)
+        return 0;
+
+    encode_range(output, next, 0, m);
+    source_.skip(m);
+    return m;
+}
+
+/*
+ * Before referencing a segment found `start' bytes into the source, escapes
+ * the bytes ahead of it but references by range those at the end of them
+ * that are the same as those of the segment that preceded it before.
+ */
+unsigned XCodecEncoder::extend_backward(Buffer &output, unsigned start, uint64_t hash) {
+    uint8_t data[XCODEC_SEGMENT_LENGTH], prev_data[XCODEC_SEGMENT_LENGTH];
+    uint64_t prev;
+    unsigned n, m, length;
+    Buffer seg;
+
+    if (start < XCODEC_EXTENSION_MIN || !history_.predecessor(hash, &prev) || !peek(prev, seg))
+        return 0;
+
+    length = seg.length();
+    n = std::min(length, start);
+    source_.copyout(data, start - n, n);
+    seg.copyout(prev_data, length - n, n);
+    for (m = 0; m < n && data[n - 1 - m] == prev_data[n - 1 - m]; m++)
+        continue;
+    if (m < XCODEC_EXTENSION_MIN)
+        return 0;
+
+    encode_escape(output, source_, start - m);
+    encode_range(output, prev, length - m, m);
+    source_.skip(m);
+    return start;
+}
+
+void XCodecEncoder::encode_range(Buffer &output, uint64_t hash, unsigned offset, unsigned length) {
+    uint64_t behash = BigEndian::encode(hash);
+    uint16_t beoffset = BigEndian::encode((uint16_t) offset);
+    uint16_t belength = BigEndian::encode((uint16_t) length);
+
+    output.append(XCODEC_MAGIC);
+    output.append(XCODEC_OP_REF_RANGE);
+    output.append(&behash);
+    output.append(&beoffset);
+    output.append(&belength);
+
+    stats_.extended_bytes_ += length;
+}
+
+void XCodecEncoderStats::add(const XCodecEncoderStats &stats) {
+    input_bytes_ += stats.input_bytes_;
+    lookups_ += stats.lookups_;
+    sampled_out_ += stats.sampled_out_;
+    budget_skips_ += stats.budget_skips_;
+    references_ += stats.references_;
+    referenced_bytes_ += stats.referenced_bytes_;
+    runs_ += stats.runs_;
+    super_runs_ += stats.super_runs_;
+    backrefs_ += stats.backrefs_;
+    extended_bytes_ += stats.extended_bytes_;
+    declarations_ += stats.declarations_;
+    declared_bytes_ += stats.declared_bytes_;
+    redeclarations_ += stats.redeclarations_;
+    collisions_ += stats.collisions_;
+    tagged_ += stats.tagged_;
+    deltas_ += stats.deltas_;
+    delta_bytes_ += stats.delta_bytes_;
+    patch_bytes_ += stats.patch_bytes_;
+    peer_references_ += stats.peer_references_;
+    peer_referenced_bytes_ += stats.peer_referenced_bytes_;
+    shared_references_ += stats.shared_references_;
+    shared_referenced_bytes_ += stats.shared_referenced_bytes_;
+    escaped_bytes_ += stats.escaped_bytes_;
+}
+
+std::ostream &operator<<(std::ostream &os, const XCodecEncoderStats &stats) {
+    return (os << stats.input_bytes_ << " bytes in, "
+               << stats.lookups_ << " lookups, "
+               << stats.sampled_out_ << " sampled out, "
+               << stats.budget_skips_ << " over budget, "
+               << stats.references_ << " references (" << stats.referenced_bytes_ << " bytes), "
+               << stats.runs_ << " runs, "
+               << stats.super_runs_ << " superchunk runs, "
+               << stats.backrefs_ << " back-references, "
+               << stats.extended_bytes_ << " bytes by range, "
+               << stats.declarations_ << " declarations, " << stats.redeclarations_ << " redeclarations (" << stats.declared_bytes_ << " bytes), "
+               << stats.collisions_ << " collisions (" << stats.tagged_ << " declared tagged), "
+               << stats.deltas_ << " deltas (" << stats.delta_bytes_ << " bytes in " << stats.patch_bytes_ << " bytes of patches), "
+               << stats.peer_references_ << " peer references (" << stats.peer_referenced_bytes_ << " bytes), "
+               << stats.shared_references_ << " shared references (" << stats.shared_referenced_bytes_ << " bytes), "
+               << stats.escaped_bytes_ << " bytes escaped");
 }
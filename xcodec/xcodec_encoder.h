@@ -26,7 +26,15 @@
 #ifndef    XCODEC_XCODEC_ENCODER_H
 #define    XCODEC_XCODEC_ENCODER_H
 
+#include <deque>
+#include <utility>
+#include <vector>
+
+#include "./xcodec_chunker.h"
 #include "./xcodec_hash.h"
+#include "./xcodec_history.h"
+#include "./xcodec_super.h"
+#include "./xcodec_window.h"
 
 ////////////////////////////////////////////////////////////////////////////////
 //                                                                            //
@@ -40,16 +48,117 @@
 
 class XCodecCache;
 
+/*
+ * The copy of a segment in a namespace other than ours may be evicted or
+ * replaced before the peer asks for it, so the encoder of each stream keeps
+ * the data of the last segments it referenced there.
+ */
+#define    XCODEC_FOREIGN_SENT    (1024)
+
+/*
+ * What the encoder did with its input, for an idea of how much deduplication
+ * is given up by sampling the lookups or running out of lookup budget.
+ */
+struct XCodecEncoderStats {
+    uintmax_t input_bytes_;
+    uintmax_t lookups_;
+    uintmax_t sampled_out_;
+    uintmax_t budget_skips_;
+    uintmax_t references_;
+    uintmax_t referenced_bytes_;
+    uintmax_t runs_;
+    uintmax_t super_runs_;
+    uintmax_t backrefs_;
+    uintmax_t extended_bytes_;
+    uintmax_t declarations_;
+    uintmax_t declared_bytes_;
+    uintmax_t redeclarations_;
+    uintmax_t collisions_;
+    uintmax_t tagged_;
+    uintmax_t deltas_;
+    uintmax_t delta_bytes_;
+    uintmax_t patch_bytes_;
+    uintmax_t peer_references_;
+    uintmax_t peer_referenced_bytes_;
+    uintmax_t shared_references_;
+    uintmax_t shared_referenced_bytes_;
+    uintmax_t escaped_bytes_;
+
+    XCodecEncoderStats(void)
+            : input_bytes_(0),
+              lookups_(0),
+              sampled_out_(0),
+              budget_skips_(0),
+              references_(0),
+              referenced_bytes_(0),
+              runs_(0),
+              super_runs_(0),
+              backrefs_(0),
+              extended_bytes_(0),
+              declarations_(0),
+              declared_bytes_(0),
+              redeclarations_(0),
+              collisions_(0),
+              tagged_(0),
+              deltas_(0),
+              delta_bytes_(0),
+              patch_bytes_(0),
+              peer_references_(0),
+              peer_referenced_bytes_(0),
+              shared_references_(0),
+              shared_referenced_bytes_(0),
+              escaped_bytes_(0) {}
+
+    void add(const XCodecEncoderStats &);
+};
+
+std::ostream &operator<<(std::ostream &, const XCodecEncoderStats &);
+
+/*
+ * Lookup credit is kept in 1024ths of a lookup so that each byte of input
+ * earns exactly the configured number of lookups per KB.
+ */
+#define    XCODEC_LOOKUP_COST    1024
+
+/*
+ * Shortest match worth an <OP_REF_RANGE> rather than escaping the bytes.
+ */
+#define    XCODEC_EXTENSION_MIN    32
+
 class XCodecEncoder {
     LogHandle log_;
     XCodecCache *cache_;
+    unsigned segment_length_;
+    unsigned options_;
     Buffer source_;
     XCodecHash xcodec_hash_;
     int candidate_start_;
     uint64_t candidate_symbol_;
+    unsigned candidate_tag_;
+    XCodecChunker chunker_;
+    uint64_t sample_mask_;
+    unsigned budget_;
+    unsigned credit_;
+    XCodecHistory history_;
+    XCodecWindow window_;
+    unsigned window_limit_;
+    XCodecSuperBuilder supers_;
+    uint64_t run_first_;
+    uint64_t run_last_;
+    unsigned run_count_;
+    int run_index_;
+    bool run_super_;
+    uint64_t run_name_;
+    unsigned run_start_;
+    std::deque<std::pair<uint64_t, std::vector<uint64_t> > > sent_supers_;
+    std::deque<std::pair<std::pair<unsigned, uint64_t>, Buffer> > sent_foreign_;
+    XCodecPresence *presence_;
+    XCodecCache *peer_cache_;
+    std::vector<XCodecCache *> shared_;
+    XCodecEncoderStats stats_;
 
 public:
-    XCodecEncoder(XCodecCache *);
+    XCodecEncoder(XCodecCache *, unsigned = 0);
 
     ~XCodecEncoder();
 
@@ -57,12 +166,128 @@ public:
 
     bool flush(Buffer &);
 
+    /*
+     * Changes the options of the encoder, which must have been flushed.
+     */
+    void set_options(unsigned);
+
+    /*
+     * Only positions whose hash has its lowest `bits' clear are looked up
+     * or declared, and no more than `budget' lookups are done for each KB
+     * of input; zero means no limit either way.  Applies to fixed-length
+     * segments only, chunking does a single lookup per chunk.
+     */
+    void set_sampling(unsigned bits, unsigned budget);
+
+    /*
+     * Segments less than `limit' places back in the window are referenced
+     * with <BACKREF>; zero, until the peer has agreed to a window, means
+     * never.
+     */
+    void set_window(unsigned limit) {
+        window_limit_ = limit;
+    }
+
+    /*
+     * What the peer has said it evicted, once it is known who the peer is.
+     */
+    void set_presence(XCodecPresence *presence) {
+        presence_ = presence;
+    }
+
+    /*
+     * Our copy of the cache of the peer, whose segments are referenced in
+     * its namespace when they are not in ours, with XCODEC_OPTION_PEER.
+     * It must name segments by the same hash family as ours.
+     */
+    void set_peer_cache(XCodecCache *cache) {
+        peer_cache_ = cache;
+    }
+
+    /*
+     * Our copies of the caches of third sides that the peer holds too, by
+     * their place in the list we sent it in <HELLO>, whose segments are
+     * referenced there with XCODEC_OPTION_SHARED.  Those it does not hold
+     * or that name segments by another hash family than ours are NULL.
+     */
+    void set_shared(const std::vector<XCodecCache *> &caches) {
+        shared_ = caches;
+    }
+
+    /*
+     * The segments of a superchunk this stream referenced, for <ASK_SUPER>.
+     * The decoder asks in the order they were referenced in, so those
+     * referenced before it are not kept any longer.
+     */
+    const std::vector<uint64_t> *sent_super(const uint64_t &);
+
+    /*
+     * The data of a segment this stream referenced in the namespace at `ns',
+     * XCODEC_NAMESPACE_OWN being that of the peer, for <ASK_SHARED> and
+     * <ASK_PEER>, trimmed the same way.
+     */
+    const Buffer *sent_foreign(unsigned ns, const uint64_t &);
+
+    const XCodecEncoderStats &stats(void) const {
+        return (stats_);
+    }
+
 private:
-    void encode_declaration(Buffer &, Buffer &, unsigned, uint64_t);
+    bool present(const uint64_t &hash) const {
+        return (presence_ == NULL || !presence_->absent(hash));
+    }
+
+    /*
+     * The data of a segment is only wanted to encode better, so it is done
+     * without if it is still on disk, and is read meanwhile for next time.
+     */
+    bool peek(const uint64_t &hash, Buffer &seg) {
+        return (present(hash) && cache_->ready(hash) && cache_->lookup(hash, seg));
+    }
+
+    void encode_chunks(Buffer &, Buffer &);
+
+    void encode_chunk(Buffer &, Buffer &, unsigned);
+
+    void encode_declaration(Buffer &, Buffer &, unsigned, uint64_t, unsigned);
+
+    void declare(Buffer &, Buffer &, unsigned, uint64_t, unsigned);
+
+    void encode_extract(Buffer &, Buffer &, unsigned, unsigned);
+
+    bool find_name(uint64_t, uint64_t, uint64_t *, unsigned *);
+
+    bool encode_delta(Buffer &, uint64_t, const uint8_t *, unsigned);
+
+    bool encode_collision(Buffer &, Buffer &, unsigned, uint64_t);
 
     void encode_escape(Buffer &, Buffer &, unsigned);
 
-    bool encode_reference(Buffer &, Buffer &, unsigned, uint64_t, Buffer &);
+    bool encode_reference(Buffer &, Buffer &, unsigned, uint64_t, unsigned *);
+
+    void keep_super(const uint64_t &);
+
+    bool encode_foreign(Buffer &, Buffer &, unsigned, uint64_t, unsigned);
+
+    void reference(Buffer &, uint64_t, unsigned);
+
+    void redeclare(Buffer &, uint64_t, unsigned);
+
+    bool extend_run(Buffer &, uint64_t, unsigned);
+
+    bool end_run(Buffer &);
+
+    void note(const uint64_t &);
+
+    int recent(const uint64_t &) const;
+
+    void encode_ref(Buffer &, uint64_t, int);
+
+    unsigned extend_forward(Buffer &);
+
+    unsigned extend_backward(Buffer &, unsigned, uint64_t);
+
+    void encode_range(Buffer &, uint64_t, unsigned, unsigned);
 };
 
 #endif /* !XCODEC_XCODEC_ENCODER_H */
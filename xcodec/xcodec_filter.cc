@@ -23,6 +23,8 @@
  * SUCH DAMAGE.
  */
 
+#include <algorithm>
+
 #include "../common/buffer.h"
 #include "../common/endian.h"
 #include "../common/count_filter.h"
@@ -41,10 +43,16 @@
 
 /*
  * Usage:
- * 	<OP_HELLO> length[uint8_t] data[uint8_t x length]
+ * 	<OP_HELLO> length[uint8_t] uuid[UUID_STRING_SIZE] size[uint64_t]
+ * 	           [version[uint8_t] parameters[...]]
  *
  * Effects:
- * 	Must appear at the start of and only at the start of an encoded	stream.
+ * 	Must appear at the start of and only at the start of an encoded	stream,
+ * 	except that a version 2 or later <OP_HELLO> may follow an earlier one
+ * 	with the same UUID to update its parameters.  The version and the
+ * 	parameters, described in xcodec_hello.h, are only sent if the codec
+ * 	is configured to negotiate or the peer has sent them, since a 3.0.x
+ * 	peer does not accept them.
  *
  * Sife-effects:
  * 	Possibly many.
@@ -53,10 +61,11 @@
 
 /*
  * Usage:
- * 	<OP_LEARN> data[uint8_t x XCODEC_PIPE_SEGMENT_LENGTH]
+ * 	<OP_LEARN> data[uint8_t x segment length]
  *
  * Effects:
- * 	The `data' is hashed, the hash is associated with the data if possible.
+ * 	The `data', as long as the segments of the cache of the sender, is
+ * 	hashed, the hash is associated with the data if possible.
  *
  * Side-effects:
  * 	None.
@@ -103,6 +112,18 @@
  */
 #define    XCODEC_PIPE_OP_EOS_ACK    ((uint8_t)0xfb)
 
+/*
+ * Usage:
+ * 	<OP_LEARN_CHUNK> length[uint16_t] data[uint8_t x length]
+ *
+ * Effects:
+ * 	Same as OP_LEARN for a content-defined chunk shorter than a segment.
+ *
+ * Side-effects:
+ * 	None.
+ */
+#define    XCODEC_PIPE_OP_LEARN_CHUNK    ((uint8_t)0xfa)
+
 /*
  * Usage:
  * 	<FRAME> length[uint16_t] data[uint8_t x length]
@@ -115,7 +136,405 @@
  */
 #define    XCODEC_PIPE_OP_FRAME    ((uint8_t)0x00)
 
+/*
+ * Usage:
+ * 	<FRAME_PASS> length[uint16_t] data[uint8_t x length]
+ *
+ * Effects:
+ * 	Frames a chunk of the encoded stream that has been encoded again, in
+ * 	the namespace of the second pass.  Once a stream has used it, it is
+ * 	used for the rest of the stream.
+ *
+ * Side-effects:
+ * 	None.
+ */
+#define    XCODEC_PIPE_OP_FRAME_PASS    ((uint8_t)0x01)
+
+/*
+ * Usage:
+ * 	<FRAME_RAW> length[uint16_t] data[uint8_t x length]
+ *
+ * Effects:
+ * 	Frames a chunk of the stream as it was before encoding, sent so by an
+ * 	encoder that found it could not reduce it.  It follows in the output
+ * 	whatever the frames before it decode to.
+ *
+ * Side-effects:
+ * 	None.
+ */
+#define    XCODEC_PIPE_OP_FRAME_RAW    ((uint8_t)0x02)
+
+/*
+ * Usage:
+ * 	<FRAME_LARGE | op> length[varint] data[uint8_t x length]
+ *
+ * Effects:
+ * 	Same as <FRAME>, <FRAME_PASS> or <FRAME_RAW> for `op', for frames of
+ * 	up to XCODEC_PIPE_MAX_LARGE_FRAME bytes.  The length is sent seven
+ * 	bits to a byte, low bits first, with the top bit set in all but the
+ * 	last byte.  Only sent if the peer has agreed to it.
+ *
+ * Side-effects:
+ * 	None.
+ */
+#define    XCODEC_PIPE_FRAME_LARGE    ((uint8_t)0x10)
+
 #define    XCODEC_PIPE_MAX_FRAME    (32768)
+#define    XCODEC_PIPE_MAX_LARGE_FRAME    (1 << 20)
+
+/*
+ * Usage:
+ * 	<OP_FORGET> uuid[UUID_STRING_SIZE] count[uint16_t] hash[uint64_t x count]
+ *
+ * Effects:
+ * 	The peer with the given UUID has evicted the segments with the given
+ * 	hashes from its copy of our cache, and they will be declared again
+ * 	rather than referenced.
+ *
+ * Side-effects:
+ * 	None.
+ */
+#define    XCODEC_PIPE_OP_FORGET    ((uint8_t)0xf9)
+
+#define    XCODEC_PIPE_MAX_FORGET    (1024)
+
+/*
+ * Usage:
+ * 	<OP_ASK_SUPER> name[uint64_t]
+ *
+ * Effects:
+ * 	An OP_LEARN_SUPER will be sent in response with the segments of the
+ * 	superchunk `name'.
+ *
+ * 	If the superchunk is neither one the encoder of the stream still keeps
+ * 	nor in the cache, error will be indicated.
+ *
+ * Side-effects:
+ * 	None.
+ */
+#define    XCODEC_PIPE_OP_ASK_SUPER    ((uint8_t)0xf8)
+
+/*
+ * Usage:
+ * 	<OP_LEARN_SUPER> name[uint64_t] count[uint16_t] hash[uint64_t x count]
+ *
+ * Effects:
+ * 	The superchunk `name' is made of the segments with the given hashes,
+ * 	which must be what `name' is computed from, as in xcodec_super.h.
+ *
+ * Side-effects:
+ * 	None.
+ */
+#define    XCODEC_PIPE_OP_LEARN_SUPER    ((uint8_t)0xf7)
+
+/*
+ * Usage:
+ * 	<OP_ASK_PASS> hash[uint64_t]
+ *
+ * Effects:
+ * 	Same as OP_ASK for a segment of the second pass, answered with an
+ * 	OP_LEARN_PASS.
+ *
+ * Side-effects:
+ * 	None.
+ */
+#define    XCODEC_PIPE_OP_ASK_PASS    ((uint8_t)0xf6)
+
+/*
+ * Usage:
+ * 	<OP_LEARN_PASS> length[uint16_t] data[uint8_t x length]
+ *
+ * Effects:
+ * 	Same as OP_LEARN_CHUNK for a segment of the second pass, of any length
+ * 	up to the segment length.
+ *
+ * Side-effects:
+ * 	None.
+ */
+#define    XCODEC_PIPE_OP_LEARN_PASS    ((uint8_t)0xf5)
+
+/*
+ * Usage:
+ * 	<OP_PAUSE>
+ *
+ * Effects:
+ * 	The peer has more than its window of our stream waiting to be
+ * 	decoded, most likely behind <ASK>s, and we stop reading what we would
+ * 	encode for it until an OP_RESUME.  What has been read already is
+ * 	still sent, and so are the other ops.
+ *
+ * Side-effects:
+ * 	None.
+ */
+#define    XCODEC_PIPE_OP_PAUSE    ((uint8_t)0xf4)
+
+/*
+ * Usage:
+ * 	<OP_RESUME>
+ *
+ * Effects:
+ * 	The peer is down to half of its window, and we read on.
+ *
+ * Side-effects:
+ * 	None.
+ */
+#define    XCODEC_PIPE_OP_RESUME    ((uint8_t)0xf3)
+
+/*
+ * Usage:
+ * 	<OP_ASK_PEER> hash[uint64_t]
+ *
+ * Effects:
+ * 	An OP_LEARN_PEER will be sent in response with the data the peer has
+ * 	sent us under that hash, which an OP_REF_PEER of ours referenced and
+ * 	which the peer no longer has, or no longer has the same.  The encoder
+ * 	keeps what it referenced for a while, as our copy of the cache of the
+ * 	peer may have let go of it since.
+ *
+ * Side-effects:
+ * 	None.
+ */
+#define    XCODEC_PIPE_OP_ASK_PEER    ((uint8_t)0xf2)
+
+/*
+ * Usage:
+ * 	<OP_LEARN_PEER> hash[uint64_t] length[uint16_t] data[uint8_t x length]
+ *
+ * Effects:
+ * 	The data of the segment `hash' of our own namespace, for the
+ * 	OP_REF_PEERs held waiting for it.  It is not entered in our cache.
+ *
+ * Side-effects:
+ * 	None.
+ */
+#define    XCODEC_PIPE_OP_LEARN_PEER    ((uint8_t)0xf1)
+
+/*
+ * Usage:
+ * 	<OP_ASK_SHARED> namespace[uint8_t] hash[uint64_t]
+ *
+ * Effects:
+ * 	Same as OP_ASK_PEER for a segment that an OP_REF_SHARED of ours
+ * 	referenced in the namespace at `namespace' in our <HELLO>, answered
+ * 	with an OP_LEARN_SHARED, from what the encoder kept in the same way.
+ *
+ * Side-effects:
+ * 	None.
+ */
+#define    XCODEC_PIPE_OP_ASK_SHARED    ((uint8_t)0xf0)
+
+/*
+ * Usage:
+ * 	<OP_LEARN_SHARED> namespace[uint8_t] hash[uint64_t] length[uint16_t] data[uint8_t x length]
+ *
+ * Effects:
+ * 	Same as OP_LEARN_PEER for a segment of the namespace at `namespace'
+ * 	in the <HELLO> of the peer.  It is not entered in our copy.
+ *
+ * Side-effects:
+ * 	None.
+ */
+#define    XCODEC_PIPE_OP_LEARN_SHARED    ((uint8_t)0xef)
+
+/*
+ * Options of the second pass.  Superchunks are left out, as they would have
+ * to be asked for in its namespace too.
+ */
+#define    XCODEC_PIPE_PASS_OPTIONS    (XCODEC_OPTION_CHUNKING | XCODEC_OPTION_RUNS | XCODEC_OPTION_DELTA)
+
+/*
+ * What this side supports, as sent in <HELLO>.
+ */
+static XCodecHello
+xcodec_pipe_hello(void)
+{
+    XCodecHello hello;
+
+    hello.version_ = XCODEC_HELLO_VERSION;
+    hello.hash_families_ = XCODEC_HASH_FAMILIES_ALL;
+    hello.frame_limit_ = XCODEC_PIPE_MAX_LARGE_FRAME;
+    hello.window_ = XCODEC_BACKREF_WINDOW;
+    hello.ops_ = XCODEC_HELLO_OPS_ALL;
+    return (hello);
+}
+
+/*
+ * The name a segment sent in a <LEARN> was asked for by, which is its hash
+ * tagged with a collision counter if it was declared with one.  A <LEARN>
+ * does not say, but no two names of the same hash are asked for at once.
+ */
+static uint64_t
+xcodec_pipe_learned(const std::set<uint64_t> &asked, uint64_t hash)
+{
+    unsigned tag;
+
+    if (asked.find(hash) != asked.end())
+        return (hash);
+    for (tag = 1; tag <= XCODEC_TAG_MAX; tag++)
+        if (asked.find(XCodecHash::tag(hash, tag)) != asked.end())
+            return (XCodecHash::tag(hash, tag));
+    return (hash);
+}
+
+/*
+ * Tells if another name of the hash `name' is or is tagged from has been
+ * asked for and not learned yet, in which case `name' is asked for only
+ * once that one is, so that a <LEARN> can be told from the other.
+ */
+static bool
+xcodec_pipe_sibling_asked(const std::set<uint64_t> &asked, uint64_t name)
+{
+    unsigned from, to;
+
+    for (from = 0; from <= XCODEC_TAG_MAX; from++) {
+        for (to = 0; to <= XCODEC_TAG_MAX; to++) {
+            if (to == from)
+                continue;
+            if (asked.find(XCodecHash::tag(XCodecHash::tag(name, from), to)) != asked.end())
+                return (true);
+        }
+    }
+    return (false);
+}
+
+/*
+ * Appends the data with each magic byte in it escaped, as the encoder would
+ * have sent it had it found nothing in it to reference.
+ */
+static void
+xcodec_pipe_escape(Buffer &output, const Buffer &input)
+{
+    Buffer data(input);
+    unsigned pos;
+
+    while (data.find(XCODEC_MAGIC, &pos)) {
+        if (pos > 0)
+            output.append(data, pos);
+        output.append(XCODEC_MAGIC);
+        output.append(XCODEC_OP_ESCAPE);
+        data.skip(pos + 1);
+    }
+    output.append(data);
+}
+
+static void
+xcodec_pipe_put_length(Buffer &trg, uint32_t length)
+{
+    while (length >= 0x80) {
+        trg.append((uint8_t) (length | 0x80));
+        length >>= 7;
+    }
+    trg.append((uint8_t) length);
+}
+
+/*
+ * Returns the number of bytes the length at `offset' takes, 0 if they have
+ * yet to arrive, or -1 if it is longer than 32 bits.
+ */
+static int
+xcodec_pipe_get_length(const Buffer &src, unsigned offset, uint32_t *lengthp)
+{
+    uint64_t length = 0;
+    uint8_t byte;
+    unsigned i;
+
+    for (i = 0; i < 5; i++) {
+        if (src.length() < offset + i + 1)
+            return (0);
+        src.extract(&byte, offset + i);
+        length |= (uint64_t) (byte & 0x7f) << (7 * i);
+        if ((byte & 0x80) == 0) {
+            if (length > 0xffffffffu)
+                return (-1);
+            *lengthp = length;
+            return (i + 1);
+        }
+    }
+    return (-1);
+}
+
+/*
+ * Bytes the op whose <MAGIC> is at `offset' of the encoded data takes, or 0
+ * if it is not one the encoder sends, with segments of `segment_length'.
+ */
+static unsigned
+xcodec_pipe_op_length(const Buffer &src, unsigned offset, unsigned segment_length)
+{
+    uint16_t length;
+    uint8_t op;
+
+    if (src.length() < offset + 2)
+        return (0);
+    src.extract(&op, offset + 1);
+
+    switch (op) {
+        case XCODEC_OP_ESCAPE:
+            return (2);
+        case XCODEC_OP_EXTRACT:
+            return (2 + segment_length);
+        case XCODEC_OP_REF:
+            return (2 + 8);
+        case XCODEC_OP_BACKREF:
+            return (2 + 1);
+        case XCODEC_OP_REF_RUN:
+            return (2 + 8 + 2);
+        case XCODEC_OP_REF_RANGE:
+        case XCODEC_OP_REF_SUPER:
+            return (2 + 8 + 2 + 2);
+        case XCODEC_OP_REF_PEER:
+            return (2 + 8 + 8);
+        case XCODEC_OP_REF_SHARED:
+            return (2 + 1 + 8 + 8);
+        case XCODEC_OP_CHUNK:
+            if (src.length() < offset + 2 + 2)
+                return (0);
+            src.extract(&length, offset + 2);
+            return (2 + 2 + BigEndian::decode(length));
+        case XCODEC_OP_EXTRACT_TAGGED:
+            if (src.length() < offset + 2 + 1 + 2)
+                return (0);
+            src.extract(&length, offset + 2 + 1);
+            return (2 + 1 + 2 + BigEndian::decode(length));
+        case XCODEC_OP_DELTA:
+            if (src.length() < offset + 2 + 8 + 2 + 2)
+                return (0);
+            src.extract(&length, offset + 2 + 8 + 2);
+            return (2 + 8 + 2 + 2 + BigEndian::decode(length));
+        default:
+            return (0);
+    }
+}
+
+/*
+ * Moves into `frame' the most of the encoded data, up to `limit' bytes, that
+ * ends between two ops.  Only should a single op not fit is it cut.  What
+ * is taken is taken from the front as it is gone through, so that each op
+ * is only looked for at the start of what is left.
+ */
+static void
+xcodec_pipe_cut(Buffer &src, Buffer &frame, unsigned limit, unsigned segment_length)
+{
+    unsigned room, magic, length;
+
+    while (!src.empty() && frame.length() < limit) {
+        room = limit - frame.length();
+        if (!src.find(XCODEC_MAGIC, &magic, room)) {
+            src.moveout(&frame, std::min<size_t>(room, src.length()));
+            return;
+        }
+        if (magic > 0) {
+            src.moveout(&frame, magic);
+            continue;
+        }
+        length = xcodec_pipe_op_length(src, 0, segment_length);
+        if (length == 0 || length > room) {
+            if (frame.empty())
+                src.moveout(&frame, std::min<size_t>(room, src.length()));
+            return;
+        }
+        src.moveout(&frame, length);
+    }
+}
 
 // Encoding
 
@@ -130,29 +549,65 @@ bool EncodeFilter::consume(Buffer &buf, int flg) {
             return false;
         }
 
-        output.append(XCODEC_PIPE_OP_HELLO);
-        uint64_t mb = cache_->nominal_size();
-        output.append((uint8_t) (UUID_STRING_SIZE + sizeof mb));
-        cache_->identifier().encode(output);
-        output.append(&mb);
+        if (hello_version_ == 0)
+            hello(output, codec_->negotiate_);
+
+        if (!(encoder_ = new XCodecEncoder(cache_, options_)))
+            return false;
+        encoder_->set_sampling(codec_->lookup_sample_bits_, codec_->lookup_budget_);
+        encoder_->set_window(agreed_.window_);
+        if (presence_)
+            encoder_->set_presence(presence_);
+        if (peer_cache_)
+            encoder_->set_peer_cache(peer_cache_);
+        encoder_->set_shared(shared_namespaces());
+
+        if (pass_) {
+            if (!(pass_encoder_ = new XCodecEncoder(codec_->pass_cache_, options_ & XCODEC_PIPE_PASS_OPTIONS)))
+                return false;
+            pass_encoder_->set_window(agreed_.window_);
+        }
+    }
+
+    /*
+     * Data found not worth encoding is framed as it is, after what was
+     * encoded before it, and deflating it is not attempted either.
+     */
+    if (bypass_ && bypass_state_.bypass(buf)) {
+        Buffer raw;
 
-        if (!(encoder_ = new XCodecEncoder(cache_)))
+        encoder_->flush(enc);
+        encode_frames(enc, output, true);
+        while (!buf.empty())
+            encode_frame(buf, raw, XCODEC_PIPE_OP_FRAME_RAW);
+        if (!output.empty() && !produce(output, flg))
             return false;
+        return produce(raw, flg | INCOMPRESSIBLE);
     }
 
+    unsigned length = buf.length();
+    const XCodecEncoderStats &stats = encoder_->stats();
+    uint64_t matched = stats.referenced_bytes_ + stats.extended_bytes_ + stats.delta_bytes_ + stats.peer_referenced_bytes_;
+
     encoder_->encode(enc, buf);
 
+    if (bypass_)
+        bypass_state_.encoded(length, stats.referenced_bytes_ + stats.extended_bytes_ + stats.delta_bytes_ +
+                                      stats.peer_referenced_bytes_ - matched);
+
+    bool flushed = false;
     if (!(flg & TO_BE_CONTINUED)) {
         if (waiting_) {
             if (wait_action_)
                 wait_action_->cancel();
             wait_action_ = event_system.track(150, StreamModeWait, callback(this, &EncodeFilter::on_read_timeout));
-        } else
+        } else {
             encoder_->flush(enc);
+            flushed = true;
+        }
     }
 
-    while (!enc.empty())
-        encode_frame(enc, output);
+    encode_frames(enc, output, flushed);
 
     return (!output.empty() ? produce(output, flg) : true);
 }
@@ -167,8 +622,10 @@ void EncodeFilter::flush(int flg) {
             wait_action_->cancel(), wait_action_ = 0;
         if (!sent_eos_) {
             Buffer enc, output;
-            if (encoder_ && encoder_->flush(enc))
-                encode_frame(enc, output);
+            if (encoder_) {
+                encoder_->flush(enc);
+                encode_frames(enc, output, true);
+            }
             output.append(XCODEC_PIPE_OP_EOS);
             sent_eos_ = produce(output);
         }
@@ -177,80 +634,339 @@ void EncodeFilter::flush(int flg) {
         Filter::flush(flush_flags_);
 }
 
-void EncodeFilter::encode_frame(Buffer &src, Buffer &trg) {
-    int n = src.length();
-    if (n > XCODEC_PIPE_MAX_FRAME)
-        n = XCODEC_PIPE_MAX_FRAME;
+/*
+ * With parameters from the peer the options of the encoder are those
+ * configured that it can decode, after flushing what was encoded before.
+ * Without them, as from a 3.0.x peer, the options configured are trusted
+ * only if we negotiate, and otherwise only what 3.0.x decodes is sent.
+ * Content chunking, which does not imply negotiate, always waits for the
+ * peer to say it decodes <OP_CHUNK>.
+ */
+bool EncodeFilter::set_peer(const UUID &uuid, const XCodecHello &peer) {
+    Buffer output;
 
-    uint16_t len = n;
-    len = BigEndian::encode(len);
+    if (!cache_)
+        return true;
 
-    trg.append(XCODEC_PIPE_OP_FRAME);
-    trg.append(&len);
-    trg.append(src, n);
+    presence_ = cache_->presence(uuid);
+    if (encoder_)
+        encoder_->set_presence(presence_);
 
-    src.skip(n);
-}
+    /*
+     * What the peer has sent us is in our copy of its cache, named by the
+     * family it uses, which only helps if it is the one we use too.
+     */
+    peer_cache_ = wanproxy.find_cache(uuid);
+    if (peer_cache_ && (peer_cache_ == cache_ || peer_cache_->family() != cache_->family() ||
+                        peer_cache_->segment_length() != cache_->segment_length()))
+        peer_cache_ = 0;
+    if (encoder_)
+        encoder_->set_peer_cache(peer_cache_);
 
-void EncodeFilter::on_read_timeout(Event e) {
-    if (wait_action_)
-        wait_action_->cancel(), wait_action_ = 0;
+    peer_namespaces_ = peer.namespaces_;
 
-    Buffer enc, output;
-    if (!flushing_ && encoder_ && encoder_->flush(enc)) {
-        encode_frame(enc, output);
-        produce(output);
-    }
-}
+    if (peer.version_ < 2)
+        return true;
 
-// Decoding
+    if (!(peer.hash_families_ & cache_->family())) {
+        ERROR(log_) << "Peer cannot decode hash family 0x" << std::hex << cache_->family() << std::dec << ": " << peer;
+        return false;
+    }
 
-bool DecodeFilter::consume(Buffer &buf, int flg) {
-    if (!upstream_) {
-        ERROR(log_) << "Decoder not configured";
+    XCodecHello agreed = xcodec_pipe_hello();
+    agreed.segment_length_ = cache_->segment_length();
+    if (!agreed.narrow(peer)) {
+        ERROR(log_) << "Nothing in common with peer parameters: " << peer;
         return false;
     }
+    agreed_ = agreed;
+    DEBUG(log_) << "Negotiated " << agreed_;
+    if (encoder_)
+        encoder_->set_window(agreed_.window_);
 
-    pending_.append(buf);
+    if (sent_eos_)
+        return true;
 
-    while (!pending_.empty()) {
-        uint8_t op = pending_.peek();
-        switch (op) {
-            case XCODEC_PIPE_OP_HELLO:
-                if (decoder_cache_) {
-                    ERROR(log_) << "Got <HELLO> twice.";
-                    return false;
-                } else if (codec_) {
-                    uint8_t len;
-                    if (pending_.length() < sizeof op + sizeof len)
-                        return true;
-                    pending_.extract(&len, sizeof op);
-                    if (pending_.length() < sizeof op + sizeof len + len)
-                        return true;
+    if (hello_version_ < 2) {
+        if (!cache_->identifier().is_valid()) {
+            ERROR(log_) << "Could not encode UUID for <HELLO>.";
+            return false;
+        }
+        hello(output, true);
+    }
 
-                    uint64_t mb;
-                    if (len != UUID_STRING_SIZE + sizeof mb) {
-                        ERROR(log_) << "Unsupported <HELLO> length: " << (unsigned) len;
-                        return false;
-                    }
+    /*
+     * Only now is the list of namespaces we sent in <HELLO> the one the
+     * peer will read <REF_SHARED> against.
+     */
+    if (encoder_)
+        encoder_->set_shared(shared_namespaces());
 
-                    UUID uuid;
-                    pending_.skip(sizeof op + sizeof len);
-                    if (!uuid.decode(pending_)) {
-                        ERROR(log_) << "Invalid UUID in <HELLO>.";
-                        return false;
-                    }
-                    pending_.extract(&mb);
-                    pending_.skip(sizeof mb);
+    bypass_ = (codec_->bypass_ && (agreed_.ops_ & XCODEC_HELLO_OP_RAW));
 
-                    if (!(decoder_cache_ = wanproxy.find_cache(uuid)))
-                        decoder_cache_ = wanproxy.add_cache(codec_->cache_type_, codec_->cache_path_, mb, uuid);
+    bool pass = (codec_->pass_cache_ && (agreed_.ops_ & XCODEC_HELLO_OP_PASS));
+    unsigned options = codec_->xcodec_options_ & agreed_.ops_;
+    if (options != options_ || pass != pass_) {
+        options_ = options;
+        if (encoder_) {
+            Buffer enc;
+            encoder_->flush(enc);
+            encode_frames(enc, output, true);
+            encoder_->set_options(options_);
+            if (pass_encoder_ && !pass) {
+                delete pass_encoder_;
+                pass_encoder_ = 0;
+            } else if (pass_encoder_) {
+                pass_encoder_->set_options(options_ & XCODEC_PIPE_PASS_OPTIONS);
+            } else if (pass) {
+                if (!(pass_encoder_ = new XCodecEncoder(codec_->pass_cache_, options_ & XCODEC_PIPE_PASS_OPTIONS)))
+                    return false;
+            }
+        }
+        pass_ = pass;
+    }
+    if (pass_encoder_)
+        pass_encoder_->set_window(agreed_.window_);
 
-                    ASSERT(log_, decoder_ == NULL);
-                    if (decoder_cache_)
-                        decoder_ = new XCodecDecoder(decoder_cache_);
+    return (!output.empty() ? produce(output) : true);
+}
 
-                    DEBUG(log_) << "Peer connected with UUID: " << uuid;
+void EncodeFilter::hello(Buffer &trg, bool negotiate) {
+    uint64_t mb = cache_->nominal_size();
+    Buffer params;
+
+    if (negotiate) {
+        XCodecHello own = xcodec_pipe_hello();
+        own.hash_family_ = cache_->family();
+        own.segment_length_ = cache_->segment_length();
+        if (!codec_->eviction_notices_)
+            own.ops_ &= ~XCODEC_HELLO_OP_FORGET;
+
+        /*
+         * The caches of third sides held here, for segments of theirs to
+         * be referenced by both sides.
+         */
+        std::map<UUID, XCodecCache *>::const_iterator it;
+        namespaces_.clear();
+        for (it = wanproxy.caches().begin(); it != wanproxy.caches().end(); ++it) {
+            if (namespaces_.size() == XCODEC_HELLO_NAMESPACES_MAX)
+                break;
+            if (it->second == cache_ || it->second == codec_->pass_cache_)
+                continue;
+            namespaces_.push_back(it->second);
+            own.namespaces_.push_back(it->first);
+        }
+        own.encode(params);
+    }
+
+    trg.append(XCODEC_PIPE_OP_HELLO);
+    trg.append((uint8_t) (UUID_STRING_SIZE + sizeof mb + params.length()));
+    cache_->identifier().encode(trg);
+    trg.append(&mb);
+    trg.append(params);
+
+    hello_version_ = (negotiate ? XCODEC_HELLO_VERSION : 1);
+}
+
+/*
+ * What we listed in <HELLO> that the peer has listed too, and that names
+ * segments by the hash family we do and cuts them to our length.
+ */
+std::vector<XCodecCache *> EncodeFilter::shared_namespaces(void) const {
+    std::vector<XCodecCache *> shared(namespaces_.size(), (XCodecCache *) 0);
+    unsigned ns;
+
+    for (ns = 0; ns < namespaces_.size(); ns++) {
+        if (namespaces_[ns]->family() != cache_->family() ||
+            namespaces_[ns]->segment_length() != cache_->segment_length())
+            continue;
+        if (std::find(peer_namespaces_.begin(), peer_namespaces_.end(), namespaces_[ns]->identifier()) != peer_namespaces_.end())
+            shared[ns] = namespaces_[ns];
+    }
+    return (shared);
+}
+
+/*
+ * Frames what the encoder has output, encoding it again first if there is a
+ * second pass.  The second pass is flushed whenever the first one is.
+ */
+void EncodeFilter::encode_frames(Buffer &enc, Buffer &trg, bool flush) {
+    if (!pass_encoder_) {
+        while (!enc.empty())
+            encode_frame(enc, trg, XCODEC_PIPE_OP_FRAME);
+        return;
+    }
+
+    Buffer pass;
+    pass_encoder_->encode(pass, enc);
+    enc.clear();
+    if (flush)
+        pass_encoder_->flush(pass);
+    while (!pass.empty())
+        encode_frame(pass, trg, XCODEC_PIPE_OP_FRAME_PASS);
+}
+
+/*
+ * Encoded data is framed whole ops at a time, so that the decoder need not
+ * wait on the next frame for the rest of one.
+ */
+void EncodeFilter::encode_frame(Buffer &src, Buffer &trg, uint8_t op) {
+    bool large = (agreed_.ops_ & XCODEC_HELLO_OP_LARGE);
+    unsigned limit = (large ? agreed_.frame_limit_ : std::min<unsigned>(agreed_.frame_limit_, XCODEC_PIPE_MAX_FRAME));
+    Buffer frame;
+
+    if (src.length() <= limit)
+        src.moveout(&frame);
+    else if (op == XCODEC_PIPE_OP_FRAME_RAW)
+        src.moveout(&frame, limit);
+    else
+        xcodec_pipe_cut(src, frame, limit, cache_->segment_length());
+    unsigned n = frame.length();
+
+    if (large) {
+        trg.append((uint8_t) (op | XCODEC_PIPE_FRAME_LARGE));
+        xcodec_pipe_put_length(trg, n);
+    } else {
+        uint16_t len = n;
+        len = BigEndian::encode(len);
+
+        trg.append(op);
+        trg.append(&len);
+    }
+    frame.moveout(&trg);
+}
+
+void EncodeFilter::on_read_timeout(Event e) {
+    if (wait_action_)
+        wait_action_->cancel(), wait_action_ = 0;
+
+    Buffer enc, output;
+    if (!flushing_ && encoder_) {
+        encoder_->flush(enc);
+        encode_frames(enc, output, true);
+        if (!output.empty())
+            produce(output);
+    }
+}
+
+void EncodeFilter::set_paused(bool paused) {
+    paused_ = paused;
+    if (!paused_ && resume_callback_) {
+        if (resume_action_)
+            resume_action_->cancel();
+        resume_action_ = event_system.track(0, StreamModeWait, resume_callback_);
+        resume_callback_ = 0;
+    }
+}
+
+// Decoding
+
+bool DecodeFilter::consume(Buffer &buf, int flg) {
+    if (!receive(buf, flg))
+        return false;
+    return (flow_control());
+}
+
+bool DecodeFilter::receive(Buffer &buf, int flg) {
+    if (!upstream_) {
+        ERROR(log_) << "Decoder not configured";
+        return false;
+    }
+
+    pending_.append(buf);
+
+    while (!pending_.empty()) {
+        uint8_t op = pending_.peek();
+        switch (op) {
+            case XCODEC_PIPE_OP_HELLO:
+                if (codec_) {
+                    uint8_t len;
+                    if (pending_.length() < sizeof op + sizeof len)
+                        return true;
+                    pending_.extract(&len, sizeof op);
+                    if (pending_.length() < sizeof op + sizeof len + len)
+                        return true;
+
+                    uint64_t mb;
+                    if (len < UUID_STRING_SIZE + sizeof mb) {
+                        ERROR(log_) << "Unsupported <HELLO> length: " << (unsigned) len;
+                        return false;
+                    }
+
+                    UUID uuid;
+                    pending_.skip(sizeof op + sizeof len);
+                    if (!uuid.decode(pending_)) {
+                        ERROR(log_) << "Invalid UUID in <HELLO>.";
+                        return false;
+                    }
+                    pending_.extract(&mb);
+                    pending_.skip(sizeof mb);
+
+                    XCodecHello hello;
+                    len -= UUID_STRING_SIZE + sizeof mb;
+                    if (len > 0 && !hello.decode(pending_, len)) {
+                        ERROR(log_) << "Invalid parameters in <HELLO>.";
+                        return false;
+                    }
+                    if (hello.hash_family_ != XCODEC_HASH_FAMILY_LEGACY &&
+                        hello.hash_family_ != XCODEC_HASH_FAMILY_POLYNOMIAL) {
+                        ERROR(log_) << "Unsupported hash family in <HELLO>: 0x" << std::hex << hello.hash_family_ << std::dec;
+                        return false;
+                    }
+                    if (!XCODEC_SEGMENT_LENGTH_VALID(hello.segment_length_)) {
+                        ERROR(log_) << "Unsupported segment length in <HELLO>: " << hello.segment_length_;
+                        return false;
+                    }
+
+                    if (decoder_cache_) {
+                        if (hello.version_ < 2 || wanproxy.find_cache(uuid) != decoder_cache_) {
+                            ERROR(log_) << "Got <HELLO> twice.";
+                            return false;
+                        }
+                        DEBUG(log_) << "Peer updated its parameters.";
+                    } else {
+                        if (!(decoder_cache_ = wanproxy.find_cache(uuid)))
+                            decoder_cache_ = wanproxy.add_cache(codec_->cache_type_, codec_->cache_path_, mb, uuid,
+                                                                hello.hash_family_, hello.segment_length_);
+                    }
+
+                    /*
+                     * The family the peer names segments by cannot change
+                     * under a cache already named by another, nor can the
+                     * length it cuts them to.
+                     */
+                    if (decoder_cache_ && decoder_cache_->family() != hello.hash_family_) {
+                        ERROR(log_) << "Peer changed hash family of cache " << uuid << ".";
+                        return false;
+                    }
+                    if (decoder_cache_ && decoder_cache_->segment_length() != hello.segment_length_) {
+                        ERROR(log_) << "Peer changed segment length of cache " << uuid << ".";
+                        return false;
+                    }
+
+                    if (!decoder_) {
+                        if (decoder_cache_) {
+                            decoder_ = new XCodecDecoder(decoder_cache_);
+                            decoder_->set_own(encoder_cache_);
+                        }
+
+                        DEBUG(log_) << "Peer connected with UUID: " << uuid;
+                    }
+
+                    if (hello.version_ >= 2) {
+                        DEBUG(log_) << "Peer parameters: " << hello;
+                        peer_ops_ = hello.ops_;
+
+                        std::vector<XCodecCache *> shared;
+                        std::vector<UUID>::const_iterator it;
+                        for (it = hello.namespaces_.begin(); it != hello.namespaces_.end(); ++it)
+                            shared.push_back(wanproxy.find_cache(*it));
+                        if (decoder_)
+                            decoder_->set_shared(shared);
+                    }
+
+                    if (encode_filter_ && !encode_filter_->set_peer(uuid, hello))
+                        return false;
                 }
                 break;
 
@@ -267,10 +983,17 @@ bool DecodeFilter::consume(Buffer &buf, int flg) {
                     pending_.moveout(&hash);
                     hash = BigEndian::decode(hash);
 
-                    Buffer learn;
-                    learn.append(XCODEC_PIPE_OP_LEARN);
-                    if (encoder_cache_->lookup(hash, learn)) {
+                    Buffer data, learn;
+                    if (encoder_cache_->lookup(hash, data)) {
                         DEBUG(log_) << "Responding to <ASK> with <LEARN>.";
+                        if (data.length() == encoder_cache_->segment_length()) {
+                            learn.append(XCODEC_PIPE_OP_LEARN);
+                        } else {
+                            uint16_t len = BigEndian::encode((uint16_t) data.length());
+                            learn.append(XCODEC_PIPE_OP_LEARN_CHUNK);
+                            learn.append(&len);
+                        }
+                        learn.append(data);
                         if (!upstream_->produce(learn))
                             return false;
                     } else {
@@ -280,40 +1003,390 @@ bool DecodeFilter::consume(Buffer &buf, int flg) {
                 }
                 break;
 
+            case XCODEC_PIPE_OP_ASK_SUPER:
+                if (!encoder_cache_) {
+                    ERROR(log_) << "Decoder not configured";
+                    return false;
+                } else {
+                    uint64_t name;
+                    if (pending_.length() < sizeof op + sizeof name)
+                        return true;
+
+                    pending_.skip(sizeof op);
+                    pending_.moveout(&name);
+                    name = BigEndian::decode(name);
+
+                    /*
+                     * What the encoder kept of what it referenced is
+                     * asked first, as the cache may have let go of it or
+                     * recorded other segments by that name since.  Past
+                     * XCODEC_SUPER_SENT superchunks in flight nothing is
+                     * left to answer with.
+                     */
+                    const std::vector<uint64_t> *hashes = 0;
+                    if (encode_filter_)
+                        hashes = encode_filter_->sent_super(name);
+                    if (hashes == NULL)
+                        hashes = encoder_cache_->sequence(name);
+                    if (hashes == NULL) {
+                        ERROR(log_) << "Unknown superchunk in <ASK_SUPER>: " << name;
+                        return false;
+                    }
+
+                    DEBUG(log_) << "Responding to <ASK_SUPER> with <LEARN_SUPER>.";
+                    Buffer learn;
+                    uint64_t bename = BigEndian::encode(name);
+                    uint16_t count = BigEndian::encode((uint16_t) hashes->size());
+                    learn.append(XCODEC_PIPE_OP_LEARN_SUPER);
+                    learn.append(&bename);
+                    learn.append(&count);
+                    for (std::vector<uint64_t>::const_iterator it = hashes->begin(); it != hashes->end(); ++it) {
+                        uint64_t behash = BigEndian::encode(*it);
+                        learn.append(&behash);
+                    }
+                    if (!upstream_->produce(learn))
+                        return false;
+                }
+                break;
+
+            case XCODEC_PIPE_OP_LEARN_SUPER:
+                if (!decoder_cache_) {
+                    ERROR(log_) << "Got <LEARN_SUPER> before <HELLO>.";
+                    return false;
+                } else {
+                    uint64_t name;
+                    uint16_t count;
+                    if (pending_.length() < sizeof op + sizeof name + sizeof count)
+                        return true;
+                    pending_.extract(&count, sizeof op + sizeof name);
+                    count = BigEndian::decode(count);
+                    if (count < XCODEC_SUPER_MIN || count > XCODEC_SUPER_MAX) {
+                        ERROR(log_) << "Invalid <LEARN_SUPER> count: " << count;
+                        return false;
+                    }
+                    if (pending_.length() < sizeof op + sizeof name + sizeof count + count * sizeof(uint64_t))
+                        return true;
+
+                    pending_.skip(sizeof op);
+                    pending_.moveout(&name);
+                    name = BigEndian::decode(name);
+                    pending_.skip(sizeof count);
+
+                    std::vector<uint64_t> hashes(count);
+                    for (unsigned i = 0; i < count; i++) {
+                        pending_.moveout(&hashes[i]);
+                        hashes[i] = BigEndian::decode(hashes[i]);
+                    }
+                    if (XCodecSuperBuilder::name(hashes) != name) {
+                        ERROR(log_) << "Mismatched name in <LEARN_SUPER>.";
+                        return false;
+                    }
+
+                    if (unknown_supers_.find(name) == unknown_supers_.end())
+                        INFO(log_) << "Gratuitous <LEARN_SUPER> without <ASK_SUPER>.";
+                    else
+                        unknown_supers_.erase(name);
+                    asked_supers_.erase(name);
+
+                    DEBUG(log_) << "Successful <LEARN_SUPER>.";
+                    decoder_cache_->record(name, hashes, false);
+                }
+                break;
+
+            case XCODEC_PIPE_OP_ASK_PASS:
+                if (!codec_ || !codec_->pass_cache_) {
+                    ERROR(log_) << "Got <ASK_PASS> without a second pass.";
+                    return false;
+                } else {
+                    uint64_t hash;
+                    if (pending_.length() < sizeof op + sizeof hash)
+                        return true;
+
+                    pending_.skip(sizeof op);
+                    pending_.moveout(&hash);
+                    hash = BigEndian::decode(hash);
+
+                    Buffer data, learn;
+                    if (!codec_->pass_cache_->lookup(hash, data)) {
+                        ERROR(log_) << "Unknown hash in <ASK_PASS>: " << hash;
+                        return false;
+                    }
+                    DEBUG(log_) << "Responding to <ASK_PASS> with <LEARN_PASS>.";
+                    uint16_t len = BigEndian::encode((uint16_t) data.length());
+                    learn.append(XCODEC_PIPE_OP_LEARN_PASS);
+                    learn.append(&len);
+                    learn.append(data);
+                    if (!upstream_->produce(learn))
+                        return false;
+                }
+                break;
+
+            case XCODEC_PIPE_OP_LEARN_PASS:
+                if (!pass_cache_) {
+                    ERROR(log_) << "Got <LEARN_PASS> before any second pass frame.";
+                    return false;
+                } else {
+                    uint16_t len;
+                    if (pending_.length() < sizeof op + sizeof len)
+                        return true;
+                    pending_.extract(&len, sizeof op);
+                    len = BigEndian::decode(len);
+                    if (len == 0 || len > pass_cache_->segment_length()) {
+                        ERROR(log_) << "Invalid <LEARN_PASS> length: " << len;
+                        return false;
+                    }
+                    if (pending_.length() < sizeof op + sizeof len + len)
+                        return true;
+
+                    pending_.skip(sizeof op + sizeof len);
+                    uint8_t data[XCODEC_SEGMENT_LENGTH];
+                    pending_.copyout(data, len);
+                    uint64_t hash = xcodec_pipe_learned(pass_asked_hashes_, XCodecHash::hash(pass_cache_->family(), data, len));
+                    if (pass_unknown_hashes_.find(hash) == pass_unknown_hashes_.end())
+                        INFO(log_) << "Gratuitous <LEARN_PASS> without <ASK_PASS>.";
+                    else
+                        pass_unknown_hashes_.erase(hash);
+                    pass_asked_hashes_.erase(hash);
+
+                    if (pass_cache_->contains(hash)) {
+                        if (!pass_cache_->verify(hash, XCodecFingerprint::compute(data, len)))
+                            pass_cache_->replace(hash, pending_, 0, len);
+                    } else
+                        pass_cache_->enter(hash, pending_, 0, len);
+                    if (pass_decoder_)
+                        pass_decoder_->learned(hash);
+                    pending_.skip(len);
+                }
+                break;
+
+            case XCODEC_PIPE_OP_ASK_PEER:
+                if (!decoder_cache_) {
+                    ERROR(log_) << "Got <ASK_PEER> before <HELLO>.";
+                    return false;
+                } else {
+                    uint64_t hash;
+                    if (pending_.length() < sizeof op + sizeof hash)
+                        return true;
+
+                    pending_.skip(sizeof op);
+                    pending_.moveout(&hash);
+                    hash = BigEndian::decode(hash);
+
+                    const Buffer *sent = (encode_filter_ ? encode_filter_->sent_foreign(XCODEC_NAMESPACE_OWN, hash) : 0);
+                    Buffer data, learn;
+                    if (sent)
+                        data.append(sent);
+                    else if (!decoder_cache_->lookup(hash, data)) {
+                        ERROR(log_) << "Unknown hash in <ASK_PEER>: " << hash;
+                        return false;
+                    }
+                    DEBUG(log_) << "Responding to <ASK_PEER> with <LEARN_PEER>.";
+                    uint64_t behash = BigEndian::encode(hash);
+                    uint16_t len = BigEndian::encode((uint16_t) data.length());
+                    learn.append(XCODEC_PIPE_OP_LEARN_PEER);
+                    learn.append(&behash);
+                    learn.append(&len);
+                    learn.append(data);
+                    if (!upstream_->produce(learn))
+                        return false;
+                }
+                break;
+
+            case XCODEC_PIPE_OP_LEARN_PEER:
+                if (!decoder_) {
+                    ERROR(log_) << "Got <LEARN_PEER> before <HELLO>.";
+                    return false;
+                } else {
+                    uint64_t hash;
+                    uint16_t len;
+                    if (pending_.length() < sizeof op + sizeof hash + sizeof len)
+                        return true;
+                    pending_.extract(&hash, sizeof op);
+                    hash = BigEndian::decode(hash);
+                    pending_.extract(&len, sizeof op + sizeof hash);
+                    len = BigEndian::decode(len);
+                    if (len == 0 || len > decoder_->segment_length(XCODEC_NAMESPACE_OWN)) {
+                        ERROR(log_) << "Invalid <LEARN_PEER> length: " << len;
+                        return false;
+                    }
+                    if (pending_.length() < sizeof op + sizeof hash + sizeof len + len)
+                        return true;
+
+                    pending_.skip(sizeof op + sizeof hash + sizeof len);
+                    std::set<uint64_t> &unknown = decoder_->unknown_foreign()[XCODEC_NAMESPACE_OWN];
+                    if (unknown.find(hash) == unknown.end())
+                        INFO(log_) << "Gratuitous <LEARN_PEER> without <ASK_PEER>.";
+                    asked_foreign_.erase(std::make_pair(XCODEC_NAMESPACE_OWN, hash));
+
+                    Buffer data;
+                    pending_.moveout(&data, len);
+                    decoder_->learn_foreign(XCODEC_NAMESPACE_OWN, hash, data);
+                }
+                break;
+
+            case XCODEC_PIPE_OP_ASK_SHARED:
+                if (!encode_filter_) {
+                    ERROR(log_) << "Got <ASK_SHARED> without an encoder.";
+                    return false;
+                } else {
+                    uint64_t hash;
+                    uint8_t ns;
+                    if (pending_.length() < sizeof op + sizeof ns + sizeof hash)
+                        return true;
+
+                    pending_.skip(sizeof op);
+                    pending_.moveout(&ns, sizeof ns);
+                    pending_.moveout(&hash);
+                    hash = BigEndian::decode(hash);
+
+                    XCodecCache *cache = encode_filter_->shared(ns);
+                    const Buffer *sent = encode_filter_->sent_foreign(ns, hash);
+                    Buffer data, learn;
+                    if (sent)
+                        data.append(sent);
+                    else if (!cache || !cache->lookup(hash, data)) {
+                        ERROR(log_) << "Unknown hash in <ASK_SHARED>: " << (unsigned) ns << "/" << hash;
+                        return false;
+                    }
+                    DEBUG(log_) << "Responding to <ASK_SHARED> with <LEARN_SHARED>.";
+                    uint64_t behash = BigEndian::encode(hash);
+                    uint16_t len = BigEndian::encode((uint16_t) data.length());
+                    learn.append(XCODEC_PIPE_OP_LEARN_SHARED);
+                    learn.append(ns);
+                    learn.append(&behash);
+                    learn.append(&len);
+                    learn.append(data);
+                    if (!upstream_->produce(learn))
+                        return false;
+                }
+                break;
+
+            case XCODEC_PIPE_OP_LEARN_SHARED:
+                if (!decoder_) {
+                    ERROR(log_) << "Got <LEARN_SHARED> before <HELLO>.";
+                    return false;
+                } else {
+                    uint64_t hash;
+                    uint16_t len;
+                    uint8_t ns;
+                    if (pending_.length() < sizeof op + sizeof ns + sizeof hash + sizeof len)
+                        return true;
+                    pending_.extract(&ns, sizeof op);
+                    pending_.extract(&hash, sizeof op + sizeof ns);
+                    hash = BigEndian::decode(hash);
+                    pending_.extract(&len, sizeof op + sizeof ns + sizeof hash);
+                    len = BigEndian::decode(len);
+                    if (len == 0 || len > decoder_->segment_length(ns)) {
+                        ERROR(log_) << "Invalid <LEARN_SHARED> length: " << len;
+                        return false;
+                    }
+                    if (pending_.length() < sizeof op + sizeof ns + sizeof hash + sizeof len + len)
+                        return true;
+
+                    pending_.skip(sizeof op + sizeof ns + sizeof hash + sizeof len);
+                    std::set<uint64_t> &unknown = decoder_->unknown_foreign()[ns];
+                    if (unknown.find(hash) == unknown.end())
+                        INFO(log_) << "Gratuitous <LEARN_SHARED> without <ASK_SHARED>.";
+                    asked_foreign_.erase(std::make_pair((unsigned) ns, hash));
+
+                    Buffer data;
+                    pending_.moveout(&data, len);
+                    decoder_->learn_foreign(ns, hash, data);
+                }
+                break;
+
+            case XCODEC_PIPE_OP_FORGET:
+                if (!encoder_cache_) {
+                    ERROR(log_) << "Decoder not configured";
+                    return false;
+                } else {
+                    uint16_t count;
+                    if (pending_.length() < sizeof op + UUID_STRING_SIZE + sizeof count)
+                        return true;
+                    pending_.extract(&count, sizeof op + UUID_STRING_SIZE);
+                    count = BigEndian::decode(count);
+                    if (count == 0 || count > XCODEC_PIPE_MAX_FORGET) {
+                        ERROR(log_) << "Invalid <FORGET> count: " << count;
+                        return false;
+                    }
+                    if (pending_.length() < sizeof op + UUID_STRING_SIZE + sizeof count + count * sizeof(uint64_t))
+                        return true;
+
+                    UUID uuid;
+                    pending_.skip(sizeof op);
+                    if (!uuid.decode(pending_)) {
+                        ERROR(log_) << "Invalid UUID in <FORGET>.";
+                        return false;
+                    }
+                    pending_.skip(sizeof count);
+
+                    XCodecPresence *presence = encoder_cache_->presence(uuid);
+                    while (count-- > 0) {
+                        uint64_t hash;
+                        pending_.moveout(&hash);
+                        presence->forget(BigEndian::decode(hash));
+                    }
+                    DEBUG(log_) << "Peer " << uuid << " evicted segments of ours.";
+                }
+                break;
+
             case XCODEC_PIPE_OP_LEARN:
+            case XCODEC_PIPE_OP_LEARN_CHUNK:
                 if (!decoder_cache_) {
                     ERROR(log_) << "Got <LEARN> before <HELLO>.";
                     return false;
                 } else {
-                    if (pending_.length() < sizeof op + XCODEC_SEGMENT_LENGTH)
+                    uint16_t len = decoder_cache_->segment_length();
+                    unsigned hdr = sizeof op;
+                    if (op == XCODEC_PIPE_OP_LEARN_CHUNK) {
+                        if (pending_.length() < sizeof op + sizeof len)
+                            return true;
+                        pending_.extract(&len, sizeof op);
+                        len = BigEndian::decode(len);
+                        if (len == 0 || len > decoder_cache_->segment_length()) {
+                            ERROR(log_) << "Invalid <LEARN_CHUNK> length: " << len;
+                            return false;
+                        }
+                        hdr += sizeof len;
+                    }
+                    if (pending_.length() < hdr + len)
                         return true;
 
-                    pending_.skip(sizeof op);
+                    pending_.skip(hdr);
                     uint8_t data[XCODEC_SEGMENT_LENGTH];
-                    pending_.copyout(data, XCODEC_SEGMENT_LENGTH);
-                    uint64_t hash = XCodecHash::hash(data);
+                    pending_.copyout(data, len);
+                    uint64_t hash = xcodec_pipe_learned(asked_hashes_, XCodecHash::hash(decoder_cache_->family(), data, len));
                     if (unknown_hashes_.find(hash) == unknown_hashes_.end())
                         INFO(log_) << "Gratuitous <LEARN> without <ASK>.";
                     else
                         unknown_hashes_.erase(hash);
+                    asked_hashes_.erase(hash);
 
-                    Buffer old;
-                    if (decoder_cache_->lookup(hash, old)) {
-                        if (old.equal(data, sizeof data)) {
+                    if (decoder_cache_->contains(hash)) {
+                        if (decoder_cache_->verify(hash, XCodecFingerprint::compute(data, len))) {
                             DEBUG(log_) << "Redundant <LEARN>.";
                         } else {
-                            ERROR(log_) << "Collision in <LEARN>.";
-                            return false;
+                            DEBUG(log_) << "<LEARN> in place of another segment by the same hash.";
+                            decoder_cache_->replace(hash, pending_, 0, len);
                         }
-                        old.clear();
                     } else {
                         DEBUG(log_) << "Successful <LEARN>.";
-                        decoder_cache_->enter(hash, pending_, 0);
+                        decoder_cache_->enter(hash, pending_, 0, len);
                     }
-                    pending_.skip(XCODEC_SEGMENT_LENGTH);
+                    if (decoder_)
+                        decoder_->learned(hash);
+                    pending_.skip(len);
                 }
                 break;
 
+            case XCODEC_PIPE_OP_PAUSE:
+            case XCODEC_PIPE_OP_RESUME:
+                pending_.skip(sizeof op);
+                DEBUG(log_) << "Peer " << (op == XCODEC_PIPE_OP_PAUSE ? "paused" : "resumed") << " the stream.";
+                if (encode_filter_)
+                    encode_filter_->set_paused(op == XCODEC_PIPE_OP_PAUSE);
+                break;
+
             case XCODEC_PIPE_OP_EOS:
                 if (received_eos_) {
                     ERROR(log_) << "Duplicate <EOS>.";
@@ -333,24 +1406,89 @@ bool DecodeFilter::consume(Buffer &buf, int flg) {
                 break;
 
             case XCODEC_PIPE_OP_FRAME:
+            case XCODEC_PIPE_OP_FRAME_PASS:
+            case XCODEC_PIPE_OP_FRAME_RAW:
+            case XCODEC_PIPE_FRAME_LARGE | XCODEC_PIPE_OP_FRAME:
+            case XCODEC_PIPE_FRAME_LARGE | XCODEC_PIPE_OP_FRAME_PASS:
+            case XCODEC_PIPE_FRAME_LARGE | XCODEC_PIPE_OP_FRAME_RAW:
                 if (!decoder_) {
                     ERROR(log_) << "Got frame data before decoder initialized.";
                     return false;
                 } else {
-                    uint16_t len;
-                    if (pending_.length() < sizeof op + sizeof len)
-                        return true;
-
-                    pending_.extract(&len, sizeof op);
-                    len = BigEndian::decode(len);
-                    if (len == 0 || len > XCODEC_PIPE_MAX_FRAME) {
+                    uint32_t len, limit;
+                    unsigned header;
+                    if (op & XCODEC_PIPE_FRAME_LARGE) {
+                        int n = xcodec_pipe_get_length(pending_, sizeof op, &len);
+                        if (n == 0)
+                            return true;
+                        if (n < 0) {
+                            ERROR(log_) << "Invalid framed data length.";
+                            return false;
+                        }
+                        header = sizeof op + n;
+                        limit = XCODEC_PIPE_MAX_LARGE_FRAME;
+                        op &= ~XCODEC_PIPE_FRAME_LARGE;
+                    } else {
+                        uint16_t len16;
+                        if (pending_.length() < sizeof op + sizeof len16)
+                            return true;
+                        pending_.extract(&len16, sizeof op);
+                        len = BigEndian::decode(len16);
+                        header = sizeof op + sizeof len16;
+                        limit = XCODEC_PIPE_MAX_FRAME;
+                    }
+                    if (len == 0 || len > limit) {
                         ERROR(log_) << "Invalid framed data length.";
                         return false;
                     }
-                    if (pending_.length() < sizeof op + sizeof len + len)
+                    if (pending_.length() < header + len)
                         return true;
 
-                    pending_.moveout(&frame_buffer_, sizeof op + sizeof len, len);
+                    /*
+                     * Raw data joins the frames as the encoder would
+                     * have sent it, escaped once more for each pass, so
+                     * that it comes out in order behind whatever the
+                     * decoders are holding.
+                     */
+                    if (op == XCODEC_PIPE_OP_FRAME_RAW) {
+                        Buffer raw;
+                        pending_.moveout(&raw, header, len);
+                        if (pass_decoder_) {
+                            Buffer once;
+                            xcodec_pipe_escape(once, raw);
+                            xcodec_pipe_escape(pass_buffer_, once);
+                        } else {
+                            xcodec_pipe_escape(frame_buffer_, raw);
+                        }
+                        break;
+                    }
+
+                    if (op == XCODEC_PIPE_OP_FRAME) {
+                        if (pass_decoder_) {
+                            ERROR(log_) << "Got first pass frame after second pass ones.";
+                            return false;
+                        }
+                        pending_.moveout(&frame_buffer_, header, len);
+                        break;
+                    }
+
+                    /*
+                     * The segments of the second pass of the peer are
+                     * kept in a cache of their own, as for the first.
+                     */
+                    if (!pass_decoder_) {
+                        UUID uuid = XCodecCache::pass_identifier(decoder_cache_->identifier());
+                        if (!(pass_cache_ = wanproxy.find_cache(uuid)))
+                            pass_cache_ = wanproxy.add_cache(codec_->cache_type_, codec_->cache_path_, decoder_cache_->nominal_size(), uuid,
+                                                             decoder_cache_->family(), decoder_cache_->segment_length());
+                        if (!pass_cache_) {
+                            ERROR(log_) << "Could not set up a cache for the second pass.";
+                            return false;
+                        }
+                        pass_decoder_ = new XCodecDecoder(pass_cache_);
+                        DEBUG(log_) << "Peer started a second pass.";
+                    }
+                    pending_.moveout(&pass_buffer_, header, len);
                 }
                 break;
 
@@ -359,54 +1497,16 @@ bool DecodeFilter::consume(Buffer &buf, int flg) {
                 return false;
         }
 
-        if (frame_buffer_.empty())
-            continue;
-
-        if (!unknown_hashes_.empty()) {
-            DEBUG(log_) << "Waiting for unknown hashes to continue processing data.";
-            continue;
-        }
-
-        Buffer output;
-        if (!decoder_->decode(output, frame_buffer_, unknown_hashes_)) {
-            ERROR(log_) << "Decoder exiting with error.";
+        /*
+         * The decoder goes on past unknown hashes, holding back output
+         * behind them, so it is called for new frames and also after
+         * each <LEARN> to let out what is no longer held.
+         */
+        if (decoding() && !decode_frames(flg))
             return false;
-        }
-
-        if (!output.empty()) {
-            ASSERT(log_, !flushing_);
-            if (!produce(output, flg))
-                return false;
-        } else {
-            /*
-             * We should only get no output from the decoder if
-             * we're waiting on the next frame or we need an
-             * unknown hash.  It would be nice to make the
-             * encoder framing aware so that it would not end
-             * up with encoded data that straddles a frame
-             * boundary.  (Fixing that would also allow us to
-             * simplify length checking within the decoder
-             * considerably.)
-             */
-            ASSERT(log_, !frame_buffer_.empty() || !unknown_hashes_.empty());
-        }
-
-        Buffer ask;
-        std::set<uint64_t>::const_iterator it;
-        for (it = unknown_hashes_.begin(); it != unknown_hashes_.end(); ++it) {
-            uint64_t hash = *it;
-            hash = BigEndian::encode(hash);
-            ask.append(XCODEC_PIPE_OP_ASK);
-            ask.append(&hash);
-        }
-        if (!ask.empty()) {
-            DEBUG(log_) << "Sending <ASK>s.";
-            if (!upstream_->produce(ask))
-                return false;
-        }
     }
 
-    if (received_eos_ && !sent_eos_ack_ && frame_buffer_.empty()) {
+    if (received_eos_ && !sent_eos_ack_ && !decoding()) {
         DEBUG(log_) << "Decoder received <EOS>, sending <EOS_ACK>.";
 
         Buffer eos_ack;
@@ -422,14 +1522,17 @@ bool DecodeFilter::consume(Buffer &buf, int flg) {
      * not yet emptied decoder_unknown_hashes_, then we can't send EOS yet.
      */
     if (received_eos_ && !flushing_) {
-        if (unknown_hashes_.empty()) {
-            if (!frame_buffer_.empty())
+        if (fetch_action_) {
+            DEBUG(log_) << "Decoder waiting to send <EOS> until segments are read.";
+        } else if (unknown_hashes_.empty() && unknown_supers_.empty() && pass_unknown_hashes_.empty() &&
+                   (!decoder_ || !decoder_->foreign_unknown())) {
+            if (decoding())
                 return false;
             DEBUG(log_) << "Decoder received <EOS>, shutting down decoder output channel.";
             flushing_ = true;
             Filter::flush(0);
         } else {
-            if (frame_buffer_.empty())
+            if (!decoding())
                 return false;
             DEBUG(log_) << "Decoder waiting to send <EOS> until <ASK>s are answered.";
         }
@@ -446,7 +1549,7 @@ bool DecodeFilter::consume(Buffer &buf, int flg) {
      */
     if (sent_eos_ack_ && received_eos_ack_ && !upflushed_) {
         ASSERT(log_, pending_.empty());
-        ASSERT(log_, frame_buffer_.empty());
+        ASSERT(log_, frame_buffer_.empty() && pass_buffer_.empty());
         DEBUG(log_) << "Decoder finished, got <EOS_ACK>, shutting down encoder output channel.";
 
         upflushed_ = true;
@@ -456,6 +1559,198 @@ bool DecodeFilter::consume(Buffer &buf, int flg) {
     return true;
 }
 
+/*
+ * Decodes what frames there are, lets out what is no longer held and asks
+ * for what is missing.
+ */
+bool DecodeFilter::decode_frames(int flg) {
+    /*
+     * The second pass is undone first, into the frames of the first.
+     */
+    if (pass_decoder_) {
+        std::set<uint64_t> unknown_supers;
+        if (!pass_decoder_->decode(frame_buffer_, pass_buffer_, pass_unknown_hashes_, unknown_supers)) {
+            ERROR(log_) << "Second pass decoder exiting with error.";
+            return false;
+        }
+        if (!unknown_supers.empty()) {
+            ERROR(log_) << "Unsupported superchunk in second pass.";
+            return false;
+        }
+    }
+
+    Buffer output;
+    if (!decoder_->decode(output, frame_buffer_, unknown_hashes_, unknown_supers_)) {
+        ERROR(log_) << "Decoder exiting with error.";
+        return false;
+    }
+
+    if (!output.empty()) {
+        ASSERT(log_, !flushing_);
+        if (!produce(output, flg))
+            return false;
+    } else {
+        /*
+         * We should only get no output from the decoder if
+         * we're waiting on the next frame or we need an
+         * unknown hash.  Frames are cut between ops, but a
+         * 3.0.x peer and the second pass, whose output is
+         * not framed by op, still leave the decoder with
+         * partial ops to wait on.
+         */
+        ASSERT(log_, decoding() || !unknown_hashes_.empty() || !unknown_supers_.empty() || !pass_unknown_hashes_.empty() ||
+                     decoder_->foreign_unknown());
+    }
+
+    /*
+     * All the hashes found missing go out together, so that a burst
+     * of them costs a single round trip, but for a name of a hash that
+     * another name of is waiting on, which goes out after it.
+     */
+    Buffer ask;
+    std::set<uint64_t>::const_iterator it;
+    for (it = unknown_hashes_.begin(); it != unknown_hashes_.end(); ++it) {
+        if (asked_hashes_.find(*it) != asked_hashes_.end() || xcodec_pipe_sibling_asked(asked_hashes_, *it))
+            continue;
+        asked_hashes_.insert(*it);
+        uint64_t hash = *it;
+        hash = BigEndian::encode(hash);
+        ask.append(XCODEC_PIPE_OP_ASK);
+        ask.append(&hash);
+    }
+    for (it = unknown_supers_.begin(); it != unknown_supers_.end(); ++it) {
+        if (!asked_supers_.insert(*it).second)
+            continue;
+        uint64_t name = *it;
+        name = BigEndian::encode(name);
+        ask.append(XCODEC_PIPE_OP_ASK_SUPER);
+        ask.append(&name);
+    }
+    for (it = pass_unknown_hashes_.begin(); it != pass_unknown_hashes_.end(); ++it) {
+        if (pass_asked_hashes_.find(*it) != pass_asked_hashes_.end() || xcodec_pipe_sibling_asked(pass_asked_hashes_, *it))
+            continue;
+        pass_asked_hashes_.insert(*it);
+        uint64_t hash = *it;
+        hash = BigEndian::encode(hash);
+        ask.append(XCODEC_PIPE_OP_ASK_PASS);
+        ask.append(&hash);
+    }
+    std::map<unsigned, std::set<uint64_t> >::const_iterator fit;
+    for (fit = decoder_->unknown_foreign().begin(); fit != decoder_->unknown_foreign().end(); ++fit) {
+        for (it = fit->second.begin(); it != fit->second.end(); ++it) {
+            if (!asked_foreign_.insert(std::make_pair(fit->first, *it)).second)
+                continue;
+            uint64_t hash = *it;
+            hash = BigEndian::encode(hash);
+            if (fit->first == XCODEC_NAMESPACE_OWN) {
+                ask.append(XCODEC_PIPE_OP_ASK_PEER);
+            } else {
+                uint8_t ns = fit->first;
+                ask.append(XCODEC_PIPE_OP_ASK_SHARED);
+                ask.append(ns);
+            }
+            ask.append(&hash);
+        }
+    }
+    if (!ask.empty()) {
+        DEBUG(log_) << "Sending <ASK>s.";
+        if (!upstream_->produce(ask))
+            return false;
+    }
+
+    /*
+     * Only a peer that has listed <FORGET> in its <HELLO> can decode it.
+     */
+    if ((peer_ops_ & XCODEC_HELLO_OP_FORGET) && !send_evictions())
+        return false;
+
+    /*
+     * Ops held for segments still on disk are tried again once they are
+     * read.
+     */
+    XCodecCache *cache = (pass_decoder_ ? pass_decoder_->fetching() : 0);
+    if (!cache)
+        cache = decoder_->fetching();
+    if (cache && !fetch_action_)
+        fetch_action_ = cache->wait(callback(this, &DecodeFilter::on_fetched));
+
+    return true;
+}
+
+void DecodeFilter::on_fetched(void) {
+    Buffer empty;
+
+    if (fetch_action_)
+        fetch_action_->cancel(), fetch_action_ = 0;
+
+    if (!decoding())
+        return;
+    if (!decode_frames(0) || !receive(empty, 0) || !flow_control()) {
+        ERROR(log_) << "Decoder exiting with error after reading segments.";
+        flush(0);
+    }
+}
+
+/*
+ * Asks the peer to pause once more than the window of its stream is waiting
+ * here, whether in frames yet to be decoded or in output held behind unknown
+ * hashes, and to resume once it is down to half of it.
+ */
+bool DecodeFilter::flow_control(void) {
+    Buffer flow;
+
+    if (!codec_ || codec_->flow_window_ == 0 || !(peer_ops_ & XCODEC_HELLO_OP_PAUSE) || flushing_ || upflushed_)
+        return true;
+
+    size_t waiting = pending_.length() + frame_buffer_.length() + pass_buffer_.length();
+    if (decoder_)
+        waiting += decoder_->held_length();
+    if (pass_decoder_)
+        waiting += pass_decoder_->held_length();
+
+    if (!paused_ && waiting > codec_->flow_window_) {
+        DEBUG(log_) << "Pausing peer with " << waiting << " bytes waiting.";
+        flow.append(XCODEC_PIPE_OP_PAUSE);
+        paused_ = true;
+    } else if (paused_ && waiting <= codec_->flow_window_ / 2) {
+        DEBUG(log_) << "Resuming peer with " << waiting << " bytes waiting.";
+        flow.append(XCODEC_PIPE_OP_RESUME);
+        paused_ = false;
+    } else {
+        return true;
+    }
+    return (upstream_->produce(flow));
+}
+
+/*
+ * Tells the peer what has been evicted from our copy of its cache, so that
+ * it declares those segments again instead of referencing them.
+ */
+bool DecodeFilter::send_evictions(void) {
+    std::vector<uint64_t> hashes;
+    std::vector<uint64_t>::const_iterator it;
+    Buffer forget;
+    uint16_t count;
+
+    if (!encoder_cache_ || !decoder_cache_ || !decoder_cache_->evictions(hashes))
+        return true;
+
+    for (it = hashes.begin(); it != hashes.end(); it += count) {
+        count = std::min<size_t>(hashes.end() - it, XCODEC_PIPE_MAX_FORGET);
+        uint16_t becount = BigEndian::encode(count);
+        forget.append(XCODEC_PIPE_OP_FORGET);
+        encoder_cache_->identifier().encode(forget);
+        forget.append(&becount);
+        for (unsigned i = 0; i < count; i++) {
+            uint64_t hash = BigEndian::encode(it[i]);
+            forget.append(&hash);
+        }
+    }
+
+    DEBUG(log_) << "Sending <FORGET> for " << hashes.size() << " evicted segments.";
+    return (upstream_->produce(forget));
+}
+
 void DecodeFilter::flush(int flg) {
     flushing_ = true;
     flush_flags_ |= flg;
@@ -19,16 +19,32 @@
 #include "./xcodec.h"
 #include "./xcodec_cache.h"
 #include "./xcodec_hash.h"
+#include "./xcodec_bypass.h"
 #include "./xcodec_encoder.h"
 #include "./xcodec_decoder.h"
+#include "./xcodec_hello.h"
 
 class EncodeFilter : public BufferedFilter {
 private:
     WANProxyCodec *codec_;
     XCodecCache *cache_;
     XCodecEncoder *encoder_;
+    XCodecEncoder *pass_encoder_;
+    XCodecPresence *presence_;
+    XCodecCache *peer_cache_;
+    std::vector<XCodecCache *> namespaces_;
+    std::vector<UUID> peer_namespaces_;
+    XCodecHello agreed_;
+    unsigned options_;
+    unsigned hello_version_;
+    bool pass_;
+    bool bypass_;
+    XCodecBypass bypass_state_;
     Action *wait_action_;
     bool waiting_;
+    bool paused_;
+    EventCallback *resume_callback_;
+    Action *resume_action_;
     bool sent_eos_;
     bool eos_ack_;
 
@@ -37,14 +53,39 @@ public:
         codec_ = cdc;
         cache_ = (cdc ? cdc->xcache_ : 0);
         encoder_ = 0;
+        pass_encoder_ = 0;
+        presence_ = 0;
+        peer_cache_ = 0;
+        options_ = (cdc && cdc->negotiate_ ? cdc->xcodec_options_ & ~XCODEC_OPTION_CHUNKING : 0);
+        hello_version_ = 0;
+        pass_ = (cdc && cdc->negotiate_ && cdc->pass_cache_);
+        bypass_ = (cdc && cdc->negotiate_ && cdc->bypass_);
         wait_action_ = 0;
         waiting_ = (flg & 1);
+        paused_ = false;
+        resume_callback_ = 0;
+        resume_action_ = 0;
         sent_eos_ = eos_ack_ = false;
     }
 
     virtual ~EncodeFilter() {
         if (wait_action_)
             wait_action_->cancel();
+        if (resume_action_)
+            resume_action_->cancel();
+        delete resume_callback_;
+        if (encoder_ && codec_->counting_) {
+            INFO(log_) << "Encoder: " << encoder_->stats();
+            codec_->encoder_stats_.add(encoder_->stats());
+            if (pass_encoder_)
+                INFO(log_) << "Second pass: " << pass_encoder_->stats();
+            if (bypass_state_.regions() != 0) {
+                INFO(log_) << "Bypass: " << bypass_state_.bypassed_bytes() << " bytes sent raw in " << bypass_state_.regions() << " regions";
+                codec_->bypassed_bytes_ += bypass_state_.bypassed_bytes();
+                codec_->bypass_regions_ += bypass_state_.regions();
+            }
+        }
+        delete pass_encoder_;
         delete encoder_;
     }
 
@@ -52,8 +93,58 @@ public:
 
     virtual void flush(int flg);
 
+    /*
+     * Once the peer is known, what it has said it evicted is not referenced,
+     * and if it has sent its parameters only what both sides support is
+     * used from then on.
+     */
+    bool set_peer(const UUID &uuid, const XCodecHello &peer);
+
+    /*
+     * While the peer has paused the stream, the reader of what is encoded
+     * for it stops, and leaves a callback to be scheduled once it resumes.
+     */
+    bool paused(void) const {
+        return (paused_);
+    }
+
+    void on_resume(EventCallback *cb) {
+        delete resume_callback_;
+        resume_callback_ = cb;
+    }
+
+    void set_paused(bool);
+
+    /*
+     * The cache listed at `ns' in our <HELLO>, for <ASK_SHARED>.
+     */
+    XCodecCache *shared(unsigned ns) const {
+        return (ns < namespaces_.size() ? namespaces_[ns] : 0);
+    }
+
+    /*
+     * A superchunk the encoder referenced, for <ASK_SUPER>.
+     */
+    const std::vector<uint64_t> *sent_super(const uint64_t &name) {
+        return (encoder_ ? encoder_->sent_super(name) : 0);
+    }
+
+    /*
+     * A segment the encoder referenced in the namespace at `ns', for
+     * <ASK_SHARED> and <ASK_PEER>.
+     */
+    const Buffer *sent_foreign(unsigned ns, const uint64_t &hash) {
+        return (encoder_ ? encoder_->sent_foreign(ns, hash) : 0);
+    }
+
 private:
-    void encode_frame(Buffer &src, Buffer &trg);
+    void hello(Buffer &trg, bool negotiate);
+
+    std::vector<XCodecCache *> shared_namespaces(void) const;
+
+    void encode_frames(Buffer &enc, Buffer &trg, bool flush);
+
+    void encode_frame(Buffer &src, Buffer &trg, uint8_t op);
 
     void on_read_timeout(Event e);
 };
@@ -64,12 +155,25 @@ private:
     XCodecCache *encoder_cache_;
     XCodecDecoder *decoder_;
     XCodecCache *decoder_cache_;
+    XCodecDecoder *pass_decoder_;
+    XCodecCache *pass_cache_;
+    EncodeFilter *encode_filter_;
     std::set<uint64_t> unknown_hashes_;
+    std::set<uint64_t> asked_hashes_;
+    std::set<uint64_t> unknown_supers_;
+    std::set<uint64_t> asked_supers_;
+    std::set<uint64_t> pass_unknown_hashes_;
+    std::set<uint64_t> pass_asked_hashes_;
+    std::set<std::pair<unsigned, uint64_t> > asked_foreign_;
+    unsigned peer_ops_;
     Buffer frame_buffer_;
+    Buffer pass_buffer_;
     bool received_eos_;
     bool sent_eos_ack_;
     bool received_eos_ack_;
     bool upflushed_;
+    bool paused_;
+    Action *fetch_action_;
 
 public:
     DecodeFilter(const LogHandle &log, WANProxyCodec *cdc) : LogisticFilter(log) {
@@ -77,16 +181,51 @@ public:
         encoder_cache_ = (cdc ? cdc->xcache_ : 0);
         decoder_ = 0;
         decoder_cache_ = 0;
-        received_eos_ = sent_eos_ack_ = received_eos_ack_ = upflushed_ = false;
+        pass_decoder_ = 0;
+        pass_cache_ = 0;
+        encode_filter_ = 0;
+        peer_ops_ = 0;
+        received_eos_ = sent_eos_ack_ = received_eos_ack_ = upflushed_ = paused_ = false;
+        fetch_action_ = 0;
     }
 
     ~DecodeFilter() {
+        if (fetch_action_)
+            fetch_action_->cancel();
+        delete pass_decoder_;
         delete decoder_;
     }
 
     virtual bool consume(Buffer &buf, int flg = 0);
 
     virtual void flush(int flg);
+
+    /*
+     * The encoder on the way back is told who the peer is from its <HELLO>.
+     */
+    void set_upstream(EncodeFilter *f) {
+        LogisticFilter::set_upstream(f);
+        encode_filter_ = f;
+    }
+
+private:
+    bool receive(Buffer &buf, int flg);
+
+    bool decode_frames(int flg);
+
+    void on_fetched(void);
+
+    bool flow_control(void);
+
+    /*
+     * Tells if there is framed data that the decoders have yet to let out.
+     */
+    bool decoding(void) const {
+        return (!frame_buffer_.empty() || (decoder_ && decoder_->holding()) ||
+                !pass_buffer_.empty() || (pass_decoder_ && pass_decoder_->holding()));
+    }
+
+    bool send_evictions(void);
 };
 
 #endif /* !XCODEC_FILTER_H */
@@ -0,0 +1,103 @@
+#ifndef    XCODEC_XCODEC_FINGERPRINT_H
+#define    XCODEC_XCODEC_FINGERPRINT_H
+
+#include <string.h>
+
+#include "../common/endian.h"
+
+////////////////////////////////////////////////////////////////////////////////
+//                                                                            //
+// File:           xcodec_fingerprint.h                                       //
+// Description:    strong fingerprint kept by the caches for each segment     //
+// Project:        WANProxy XTech                                             //
+// Last modified:  2026-10-18                                                 //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+
+/*
+ * The rolling hash names segments but is far too weak to tell them apart, so
+ * the caches also keep a 64-bit XXH64 of the data of each segment.  Matching
+ * both is taken as proof that two segments are identical, which spares the
+ * caller from fetching the data that it already has just to compare it.
+ */
+class XCodecFingerprint {
+    static const uint64_t prime1_ = 0x9e3779b185ebca87ull;
+    static const uint64_t prime2_ = 0xc2b2ae3d27d4eb4full;
+    static const uint64_t prime3_ = 0x165667b19e3779f9ull;
+    static const uint64_t prime4_ = 0x85ebca77c2b2ae63ull;
+    static const uint64_t prime5_ = 0x27d4eb2f165667c5ull;
+
+    static uint64_t rotate(uint64_t x, unsigned r) {
+        return ((x << r) | (x >> (64 - r)));
+    }
+
+    static uint64_t read64(const uint8_t *p) {
+        uint64_t v;
+        memcpy(&v, p, sizeof v);
+        return (LittleEndian::decode(v));
+    }
+
+    static uint32_t read32(const uint8_t *p) {
+        uint32_t v;
+        memcpy(&v, p, sizeof v);
+        return (LittleEndian::decode(v));
+    }
+
+    static uint64_t round(uint64_t acc, uint64_t input) {
+        acc += input * prime2_;
+        acc = rotate(acc, 31);
+        return (acc * prime1_);
+    }
+
+    static uint64_t merge(uint64_t acc, uint64_t val) {
+        acc ^= round(0, val);
+        return (acc * prime1_ + prime4_);
+    }
+
+public:
+    static uint64_t compute(const uint8_t *data, unsigned length) {
+        const uint8_t *p = data, *q = data + length;
+        uint64_t h;
+
+        if (length >= 32) {
+            uint64_t v1 = prime1_ + prime2_, v2 = prime2_, v3 = 0, v4 = -prime1_;
+
+            do {
+                v1 = round(v1, read64(p));
+                v2 = round(v2, read64(p + 8));
+                v3 = round(v3, read64(p + 16));
+                v4 = round(v4, read64(p + 24));
+                p += 32;
+            } while (p + 32 <= q);
+
+            h = rotate(v1, 1) + rotate(v2, 7) + rotate(v3, 12) + rotate(v4, 18);
+            h = merge(h, v1);
+            h = merge(h, v2);
+            h = merge(h, v3);
+            h = merge(h, v4);
+        } else {
+            h = prime5_;
+        }
+
+        h += length;
+
+        for (; p + 8 <= q; p += 8)
+            h = rotate(h ^ round(0, read64(p)), 27) * prime1_ + prime4_;
+        if (p + 4 <= q) {
+            h = rotate(h ^ (read32(p) * prime1_), 23) * prime2_ + prime3_;
+            p += 4;
+        }
+        for (; p < q; p++)
+            h = rotate(h ^ (*p * prime5_), 11) * prime1_;
+
+        h ^= h >> 33;
+        h *= prime2_;
+        h ^= h >> 29;
+        h *= prime3_;
+        h ^= h >> 32;
+
+        return (h);
+    }
+};
+
+#endif /* !XCODEC_XCODEC_FINGERPRINT_H */
@@ -0,0 +1,305 @@
+////////////////////////////////////////////////////////////////////////////////
+//                                                                            //
+// File:           xcodec_hash.cc                                             //
+// Description:    bulk kernels for the xcodec rolling hash                   //
+// Project:        WANProxy XTech                                             //
+// Last modified:  2026-10-18                                                 //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+
+#include "../common/buffer.h"
+
+#include "./xcodec.h"
+#include "./xcodec_hash.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define    USING_XCODEC_HASH_SIMD
+#include <immintrin.h>
+#endif
+
+static const char *xcodec_hash_kernel_name = "scalar";
+
+/*
+ * Reference implementation, one byte at a time.
+ */
+template<unsigned L>
+static void xcodec_hash_kernel_scalar(XCodecHashState *state, const uint8_t *data, const uint8_t *dead,
+                                      unsigned count, uint64_t *hashes) {
+    XCodecHashState s = *state;
+    unsigned i;
+
+    for (i = 0; i < count; i++) {
+        unsigned word = (unsigned) data[i] + 1, dead_word = (unsigned) dead[i] + 1;
+        unsigned bit = ffs(data[i]), dead_bit = ffs(dead[i]);
+
+        s.bytes_sum1_ += word - dead_word;
+        s.bytes_sum2_ += s.bytes_sum1_ - dead_word * L;
+        s.bits_sum1_ += bit - dead_bit;
+        s.bits_sum2_ += s.bits_sum1_ - dead_bit * L;
+
+        hashes[i] = XCodecHash::mix(s);
+    }
+
+    *state = s;
+}
+
+#ifdef USING_XCODEC_HASH_SIMD
+/*
+ * The vector kernels take the differences between the incoming and the dead
+ * words of several consecutive offsets and turn them into the running sums
+ * with an in-register prefix sum, carrying the last lane over to the next
+ * group.  The second sum of each pair is the prefix sum of the first one
+ * minus the weight of the dead word.  All the arithmetic is modulo 2^32 just
+ * as in the scalar code, so results are bit for bit the same.
+ *
+ * The lowest bit set in each byte is looked up a nibble at a time, the low
+ * nibble winning whenever it is not zero.
+ */
+
+#define    XCODEC_HASH_FFS_LO    0, 1, 2, 1, 3, 1, 2, 1, 4, 1, 2, 1, 3, 1, 2, 1
+#define    XCODEC_HASH_FFS_HI    0, 5, 6, 5, 7, 5, 6, 5, 8, 5, 6, 5, 7, 5, 6, 5
+
+__attribute__((target("sse4.2")))
+static inline __m128i xcodec_hash_ffs_sse(__m128i bytes) {
+    const __m128i lo_table = _mm_setr_epi8(XCODEC_HASH_FFS_LO);
+    const __m128i hi_table = _mm_setr_epi8(XCODEC_HASH_FFS_HI);
+    const __m128i nibble = _mm_set1_epi8(0x0f);
+
+    __m128i lo = _mm_shuffle_epi8(lo_table, _mm_and_si128(bytes, nibble));
+    __m128i hi = _mm_shuffle_epi8(hi_table, _mm_and_si128(_mm_srli_epi16(bytes, 4), nibble));
+    return (_mm_or_si128(lo, _mm_and_si128(hi, _mm_cmpeq_epi8(lo, _mm_setzero_si128()))));
+}
+
+__attribute__((target("sse4.2")))
+static inline __m128i xcodec_hash_prefix_sse(__m128i x) {
+    x = _mm_add_epi32(x, _mm_slli_si128(x, 4));
+    x = _mm_add_epi32(x, _mm_slli_si128(x, 8));
+    return (x);
+}
+
+__attribute__((target("sse4.2")))
+static inline void xcodec_hash_mix_sse(__m128i bytes_sum1, __m128i bytes_sum2, __m128i bits_sum1, __m128i bits_sum2,
+                                       uint64_t *hashes) {
+    __m128i bytes_hash = _mm_add_epi32(_mm_slli_epi32(bytes_sum1, 20), bytes_sum2);
+    __m128i bits_hash = _mm_add_epi32(_mm_slli_epi32(bits_sum1, 16), bits_sum2);
+
+    __m128i lo = _mm_add_epi64(_mm_slli_epi64(_mm_cvtepu32_epi64(bits_hash), 36), _mm_cvtepu32_epi64(bytes_hash));
+    __m128i hi = _mm_add_epi64(_mm_slli_epi64(_mm_cvtepu32_epi64(_mm_srli_si128(bits_hash, 8)), 36),
+                               _mm_cvtepu32_epi64(_mm_srli_si128(bytes_hash, 8)));
+    _mm_storeu_si128((__m128i *) hashes, lo);
+    _mm_storeu_si128((__m128i *) (hashes + 2), hi);
+}
+
+template<unsigned L>
+__attribute__((target("sse4.2")))
+static void xcodec_hash_kernel_sse42(XCodecHashState *state, const uint8_t *data, const uint8_t *dead,
+                                     unsigned count, uint64_t *hashes) {
+    const __m128i one = _mm_set1_epi32(1);
+    const __m128i length = _mm_set1_epi32(L);
+    __m128i bytes_sum1 = _mm_set1_epi32(state->bytes_sum1_);
+    __m128i bytes_sum2 = _mm_set1_epi32(state->bytes_sum2_);
+    __m128i bits_sum1 = _mm_set1_epi32(state->bits_sum1_);
+    __m128i bits_sum2 = _mm_set1_epi32(state->bits_sum2_);
+    unsigned i, j;
+
+    for (i = 0; i + 16 <= count; i += 16) {
+        __m128i in = _mm_loadu_si128((const __m128i *) (data + i));
+        __m128i out = _mm_loadu_si128((const __m128i *) (dead + i));
+        __m128i in_bits = xcodec_hash_ffs_sse(in);
+        __m128i out_bits = xcodec_hash_ffs_sse(out);
+
+        for (j = 0; j < 4; j++) {
+            __m128i word = _mm_add_epi32(_mm_cvtepu8_epi32(in), one);
+            __m128i dead_word = _mm_add_epi32(_mm_cvtepu8_epi32(out), one);
+            __m128i bit = _mm_cvtepu8_epi32(in_bits);
+            __m128i dead_bit = _mm_cvtepu8_epi32(out_bits);
+
+            bytes_sum1 = _mm_add_epi32(bytes_sum1, xcodec_hash_prefix_sse(_mm_sub_epi32(word, dead_word)));
+            bytes_sum2 = _mm_add_epi32(bytes_sum2, xcodec_hash_prefix_sse(
+                    _mm_sub_epi32(bytes_sum1, _mm_mullo_epi32(dead_word, length))));
+            bits_sum1 = _mm_add_epi32(bits_sum1, xcodec_hash_prefix_sse(_mm_sub_epi32(bit, dead_bit)));
+            bits_sum2 = _mm_add_epi32(bits_sum2, xcodec_hash_prefix_sse(
+                    _mm_sub_epi32(bits_sum1, _mm_mullo_epi32(dead_bit, length))));
+
+            xcodec_hash_mix_sse(bytes_sum1, bytes_sum2, bits_sum1, bits_sum2, hashes + i + j * 4);
+
+            bytes_sum1 = _mm_shuffle_epi32(bytes_sum1, _MM_SHUFFLE(3, 3, 3, 3));
+            bytes_sum2 = _mm_shuffle_epi32(bytes_sum2, _MM_SHUFFLE(3, 3, 3, 3));
+            bits_sum1 = _mm_shuffle_epi32(bits_sum1, _MM_SHUFFLE(3, 3, 3, 3));
+            bits_sum2 = _mm_shuffle_epi32(bits_sum2, _MM_SHUFFLE(3, 3, 3, 3));
+
+            in = _mm_srli_si128(in, 4);
+            out = _mm_srli_si128(out, 4);
+            in_bits = _mm_srli_si128(in_bits, 4);
+            out_bits = _mm_srli_si128(out_bits, 4);
+        }
+    }
+
+    state->bytes_sum1_ = _mm_cvtsi128_si32(bytes_sum1);
+    state->bytes_sum2_ = _mm_cvtsi128_si32(bytes_sum2);
+    state->bits_sum1_ = _mm_cvtsi128_si32(bits_sum1);
+    state->bits_sum2_ = _mm_cvtsi128_si32(bits_sum2);
+
+    if (i < count)
+        xcodec_hash_kernel_scalar<L>(state, data + i, dead + i, count - i, hashes + i);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i xcodec_hash_prefix_avx2(__m256i x) {
+    x = _mm256_add_epi32(x, _mm256_slli_si256(x, 4));
+    x = _mm256_add_epi32(x, _mm256_slli_si256(x, 8));
+    __m256i carry = _mm256_shuffle_epi32(x, _MM_SHUFFLE(3, 3, 3, 3));
+    return (_mm256_add_epi32(x, _mm256_permute2x128_si256(carry, carry, 0x08)));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i xcodec_hash_last_avx2(__m256i x) {
+    return (_mm256_permutevar8x32_epi32(x, _mm256_set1_epi32(7)));
+}
+
+__attribute__((target("avx2")))
+static inline void xcodec_hash_mix_avx2(__m256i bytes_sum1, __m256i bytes_sum2, __m256i bits_sum1, __m256i bits_sum2,
+                                        uint64_t *hashes) {
+    __m256i bytes_hash = _mm256_add_epi32(_mm256_slli_epi32(bytes_sum1, 20), bytes_sum2);
+    __m256i bits_hash = _mm256_add_epi32(_mm256_slli_epi32(bits_sum1, 16), bits_sum2);
+
+    __m256i lo = _mm256_add_epi64(_mm256_slli_epi64(_mm256_cvtepu32_epi64(_mm256_castsi256_si128(bits_hash)), 36),
+                                  _mm256_cvtepu32_epi64(_mm256_castsi256_si128(bytes_hash)));
+    __m256i hi = _mm256_add_epi64(_mm256_slli_epi64(_mm256_cvtepu32_epi64(_mm256_extracti128_si256(bits_hash, 1)), 36),
+                                  _mm256_cvtepu32_epi64(_mm256_extracti128_si256(bytes_hash, 1)));
+    _mm256_storeu_si256((__m256i *) hashes, lo);
+    _mm256_storeu_si256((__m256i *) (hashes + 4), hi);
+}
+
+template<unsigned L>
+__attribute__((target("avx2")))
+static void xcodec_hash_kernel_avx2(XCodecHashState *state, const uint8_t *data, const uint8_t *dead,
+                                    unsigned count, uint64_t *hashes) {
+    const __m256i one = _mm256_set1_epi32(1);
+    const __m256i length = _mm256_set1_epi32(L);
+    __m256i bytes_sum1 = _mm256_set1_epi32(state->bytes_sum1_);
+    __m256i bytes_sum2 = _mm256_set1_epi32(state->bytes_sum2_);
+    __m256i bits_sum1 = _mm256_set1_epi32(state->bits_sum1_);
+    __m256i bits_sum2 = _mm256_set1_epi32(state->bits_sum2_);
+    unsigned i, j;
+
+    for (i = 0; i + 16 <= count; i += 16) {
+        __m128i in = _mm_loadu_si128((const __m128i *) (data + i));
+        __m128i out = _mm_loadu_si128((const __m128i *) (dead + i));
+        __m128i in_bits = xcodec_hash_ffs_sse(in);
+        __m128i out_bits = xcodec_hash_ffs_sse(out);
+
+        for (j = 0; j < 2; j++) {
+            __m256i word = _mm256_add_epi32(_mm256_cvtepu8_epi32(in), one);
+            __m256i dead_word = _mm256_add_epi32(_mm256_cvtepu8_epi32(out), one);
+            __m256i bit = _mm256_cvtepu8_epi32(in_bits);
+            __m256i dead_bit = _mm256_cvtepu8_epi32(out_bits);
+
+            bytes_sum1 = _mm256_add_epi32(bytes_sum1, xcodec_hash_prefix_avx2(_mm256_sub_epi32(word, dead_word)));
+            bytes_sum2 = _mm256_add_epi32(bytes_sum2, xcodec_hash_prefix_avx2(
+                    _mm256_sub_epi32(bytes_sum1, _mm256_mullo_epi32(dead_word, length))));
+            bits_sum1 = _mm256_add_epi32(bits_sum1, xcodec_hash_prefix_avx2(_mm256_sub_epi32(bit, dead_bit)));
+            bits_sum2 = _mm256_add_epi32(bits_sum2, xcodec_hash_prefix_avx2(
+                    _mm256_sub_epi32(bits_sum1, _mm256_mullo_epi32(dead_bit, length))));
+
+            xcodec_hash_mix_avx2(bytes_sum1, bytes_sum2, bits_sum1, bits_sum2, hashes + i + j * 8);
+
+            bytes_sum1 = xcodec_hash_last_avx2(bytes_sum1);
+            bytes_sum2 = xcodec_hash_last_avx2(bytes_sum2);
+            bits_sum1 = xcodec_hash_last_avx2(bits_sum1);
+            bits_sum2 = xcodec_hash_last_avx2(bits_sum2);
+
+            in = _mm_srli_si128(in, 8);
+            out = _mm_srli_si128(out, 8);
+            in_bits = _mm_srli_si128(in_bits, 8);
+            out_bits = _mm_srli_si128(out_bits, 8);
+        }
+    }
+
+    state->bytes_sum1_ = _mm256_cvtsi256_si32(bytes_sum1);
+    state->bytes_sum2_ = _mm256_cvtsi256_si32(bytes_sum2);
+    state->bits_sum1_ = _mm256_cvtsi256_si32(bits_sum1);
+    state->bits_sum2_ = _mm256_cvtsi256_si32(bits_sum2);
+
+    if (i < count)
+        xcodec_hash_kernel_scalar<L>(state, data + i, dead + i, count - i, hashes + i);
+}
+#endif
+
+/*
+ * The kernels of an instruction set for each segment length, shortest first.
+ */
+#define    XCODEC_HASH_KERNELS(k)    { k<XCODEC_SEGMENT_LENGTH_MIN>, k<XCODEC_SEGMENT_LENGTH_MIN * 2>, \
+                                   k<XCODEC_SEGMENT_LENGTH_MIN * 4> }
+
+static_assert(XCODEC_SEGMENT_LENGTH_MIN * 4 == XCODEC_SEGMENT_LENGTH && XCODEC_SEGMENT_LENGTHS == 3,
+              "XCODEC_HASH_KERNELS must list every segment length");
+
+/*
+ * Installed until the first use, picks the best kernels for this processor.
+ */
+template<unsigned index>
+void XCodecHash::select_kernel(XCodecHashState *state, const uint8_t *data, const uint8_t *dead,
+                               unsigned count, uint64_t *hashes) {
+    static const XCodecHashKernel scalar[XCODEC_SEGMENT_LENGTHS] = XCODEC_HASH_KERNELS(xcodec_hash_kernel_scalar);
+    const XCodecHashKernel *kernels = scalar;
+    unsigned i;
+
+#ifdef USING_XCODEC_HASH_SIMD
+    static const XCodecHashKernel avx2[XCODEC_SEGMENT_LENGTHS] = XCODEC_HASH_KERNELS(xcodec_hash_kernel_avx2);
+    static const XCodecHashKernel sse42[XCODEC_SEGMENT_LENGTHS] = XCODEC_HASH_KERNELS(xcodec_hash_kernel_sse42);
+
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        kernels = avx2, xcodec_hash_kernel_name = "avx2";
+    else if (__builtin_cpu_supports("sse4.2"))
+        kernels = sse42, xcodec_hash_kernel_name = "sse4.2";
+#endif
+
+    DEBUG("/xcodec/hash") << "Using " << xcodec_hash_kernel_name << " rolling hash kernels.";
+
+    for (i = 0; i < XCODEC_SEGMENT_LENGTHS; i++)
+        kernel_[i] = kernels[i];
+    kernel_[index](state, data, dead, count, hashes);
+}
+
+XCodecHashKernel XCodecHash::kernel_[XCODEC_SEGMENT_LENGTHS] = {
+    XCodecHash::select_kernel<0>, XCodecHash::select_kernel<1>, XCodecHash::select_kernel<2>
+};
+
+uint64_t XCodecHash::polynomial_in_[256];
+uint64_t XCodecHash::polynomial_out_[XCODEC_SEGMENT_LENGTHS][256];
+uint64_t XCodecHash::polynomial_key_;
+
+bool XCodecHash::polynomial_filled_ = XCodecHash::fill_polynomial();
+
+/*
+ * Fills in the words and the key of the polynomial family with SplitMix64.
+ */
+bool XCodecHash::fill_polynomial(void) {
+    uint64_t seed = 0x786f636564636578ull, power = 1, z;
+    unsigned i, j, length = 0;
+
+    for (i = 0; i <= 256; i++) {
+        z = (seed += 0x9e3779b97f4a7c15ull);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+        z ^= z >> 31;
+        if (i == 256)
+            polynomial_key_ = z;
+        else
+            polynomial_in_[i] = z % XCODEC_HASH_POLYNOMIAL_PRIME;
+    }
+
+    for (j = 0; j < XCODEC_SEGMENT_LENGTHS; j++) {
+        for (; length < (unsigned) (XCODEC_SEGMENT_LENGTH_MIN << j); length++)
+            power = modular_multiply(power, XCODEC_HASH_POLYNOMIAL_BASE);
+        for (i = 0; i < 256; i++)
+            polynomial_out_[j][i] = modular_multiply(polynomial_in_[i], power);
+    }
+    return (true);
+}
+
+const char *XCodecHash::kernel_name(void) {
+    return (xcodec_hash_kernel_name);
+}
@@ -28,83 +28,136 @@
 
 #include <strings.h>
 
-class XCodecHash {
-    struct RollingHash {
-        uint32_t sum1_;                             /* Really <16-bit.  */
-        uint32_t sum2_;                             /* Really <32-bit.  */
-        uint32_t buffer_[XCODEC_SEGMENT_LENGTH];    /* Really >8-bit.  */
-
-        RollingHash(void)
-                : sum1_(0),
-                  sum2_(0),
-                  buffer_() {}
-
-        void add(uint32_t ch, unsigned start) {
-            buffer_[start] = ch;
-
-            sum1_ += ch;
-            sum2_ += sum1_;
-        }
-
-        void reset(void) {
-            sum1_ = 0;
-            sum2_ = 0;
-        }
-
-        void roll(uint32_t ch, unsigned start) {
-            uint32_t dead;
-
-            dead = buffer_[start];
+/*
+ * Number of consecutive offsets hashed at a time by the bulk rolling kernel.
+ * The encoder throws away whatever is left of a batch when it finds a match
+ * and has to restart the hash, so this is kept small with respect to
+ * XCODEC_SEGMENT_LENGTH_MIN.
+ */
+#define    XCODEC_HASH_BATCH    64
 
-            sum1_ -= dead;
-            sum2_ -= dead * XCODEC_SEGMENT_LENGTH;
+/*
+ * Two Adler-style rolling sums, one over the bytes of the window (as byte + 1
+ * so that zeroes count) and another one over the lowest bit set in each byte.
+ * The first sum of each pair is the plain sum of the window, the second one
+ * weights the oldest byte as many times as the window is long and the newest
+ * once.  The hash of a segment thus does not depend on the length of the
+ * window it was found in.
+ */
+struct XCodecHashState {
+    uint32_t bytes_sum1_;                           /* Really <16-bit.  */
+    uint32_t bytes_sum2_;                           /* Really <32-bit.  */
+    uint32_t bits_sum1_;
+    uint32_t bits_sum2_;
+};
 
-            buffer_[start] = ch;
+/*
+ * Rolls the state over `count' bytes of `data', given the bytes of `dead'
+ * which leave the window at the same time, and stores the mixed hash for
+ * each one of the offsets into `hashes'.  Implementations are chosen at
+ * run time depending on the instruction set of the processor, and all of
+ * them must produce the very same values as XCodecHash::roll() and mix()
+ * since those are persistent in the caches and known to the peers.  There is
+ * one of each for every segment length, with the length a constant.
+ */
+typedef void (*XCodecHashKernel)(XCodecHashState *, const uint8_t *, const uint8_t *, unsigned, uint64_t *);
 
-            sum1_ += ch;
-            sum2_ += sum1_;
-        }
-    };
+/*
+ * The polynomial family keeps the sum of a random word for each byte of the
+ * window, the oldest one multiplied by the base one time less than the window
+ * is long and the newest one not at all.  The words come from a fixed seed so
+ * that every system has the same ones.  The sum is kept modulo the Mersenne
+ * prime 2^61 - 1 rather than modulo 2^64: with a power-of-two modulus the
+ * Thue-Morse string of 2048 bytes and its complement have the same sum
+ * whatever the words and the base are, since the difference is a product of
+ * (base^(2^i) - 1) terms, each one even.  Modulo a prime two different windows
+ * collide only when the base is a root of their difference.  The sum is then
+ * xored with a key from the same seed and mixed into the hash with a
+ * bijection so that all 64 bits vary.  The key is public like the words, so
+ * none of this stands against data made to collide; the fingerprints do.
+ */
+#define    XCODEC_HASH_POLYNOMIAL_PRIME    ((1ull << 61) - 1)
+#define    XCODEC_HASH_POLYNOMIAL_BASE    (0x100000001b3ull)
 
-    RollingHash bytes_;
-    RollingHash bits_;
+class XCodecHash {
+    unsigned family_;
+    unsigned segment_length_;
+    unsigned index_;
+    XCodecHashState state_;
+    uint64_t polynomial_;
+    uint8_t window_[XCODEC_SEGMENT_LENGTH];
     unsigned start_;
 #ifndef NDEBUG
     unsigned length_;
 #endif
 
+    static XCodecHashKernel kernel_[XCODEC_SEGMENT_LENGTHS];
+
+    static uint64_t polynomial_in_[256];        /* Word of each byte.  */
+    static uint64_t polynomial_out_[XCODEC_SEGMENT_LENGTHS][256];    /* Same, times base^length.  */
+    static uint64_t polynomial_key_;
+    static bool polynomial_filled_;
+
+    static bool fill_polynomial(void);
+
+    template<unsigned index>
+    static void select_kernel(XCodecHashState *, const uint8_t *, const uint8_t *, unsigned, uint64_t *);
+
 public:
-    XCodecHash(void)
-            : bytes_(),
-              bits_(),
+    /*
+     * The window is as long as the segments of a cache, which must be one
+     * of the lengths that XCODEC_SEGMENT_LENGTH_VALID() allows.
+     */
+    XCodecHash(unsigned family = XCODEC_HASH_FAMILY_LEGACY, unsigned segment_length = XCODEC_SEGMENT_LENGTH)
+            : family_(family),
+              segment_length_(segment_length),
+              index_(length_index(segment_length)),
+              state_(),
+              polynomial_(0),
+              window_(),
               start_(0)
 #ifndef NDEBUG
             , length_(0)
 #endif
-    {}
+    {
+        ASSERT("/xcodec/hash", XCODEC_SEGMENT_LENGTH_VALID(segment_length));
+    }
 
     ~XCodecHash() {}
 
     void add(uint8_t ch) {
-        unsigned bit = ffs(ch);
-        unsigned word = (unsigned) ch + 1;
-
 #ifndef NDEBUG
-        ASSERT("/xcodec/hash", length_ < XCODEC_SEGMENT_LENGTH);
+        ASSERT("/xcodec/hash", length_ < segment_length_);
 #endif
 
-        bytes_.add(word, start_);
-        bits_.add(bit, start_);
+        window_[start_] = ch;
+
+        if (family_ == XCODEC_HASH_FAMILY_POLYNOMIAL) {
+            polynomial_ = modular_add(modular_multiply(polynomial_, XCODEC_HASH_POLYNOMIAL_BASE), polynomial_in_[ch]);
+        } else {
+            unsigned bit = ffs(ch);
+            unsigned word = (unsigned) ch + 1;
+
+            state_.bytes_sum1_ += word;
+            state_.bytes_sum2_ += state_.bytes_sum1_;
+            state_.bits_sum1_ += bit;
+            state_.bits_sum2_ += state_.bits_sum1_;
+        }
 
 #ifndef NDEBUG
         length_++;
 #endif
-        start_ = (start_ + 1) % XCODEC_SEGMENT_LENGTH;
+        start_ = (start_ + 1) & (segment_length_ - 1);
+    }
+
+    void add(const uint8_t *data, unsigned count) {
+        while (count-- > 0)
+            add(*data++);
     }
 
     void reset(void) {
-        bytes_.reset();
-        bits_.reset();
+        memset(&state_, 0, sizeof state_);
+        polynomial_ = 0;
 
 #ifndef NDEBUG
         length_ = 0;
@@ -113,17 +166,66 @@ public:
     }
 
     void roll(uint8_t ch) {
-        unsigned bit = ffs(ch);
-        unsigned word = (unsigned) ch + 1;
+#ifndef NDEBUG
+        ASSERT("/xcodec/hash", length_ == segment_length_);
+#endif
+
+        if (family_ == XCODEC_HASH_FAMILY_POLYNOMIAL) {
+            polynomial_ = modular_add(modular_multiply(polynomial_, XCODEC_HASH_POLYNOMIAL_BASE), polynomial_in_[ch]);
+            polynomial_ = modular_add(polynomial_, XCODEC_HASH_POLYNOMIAL_PRIME - polynomial_out_[index_][window_[start_]]);
+        } else {
+            unsigned bit = ffs(ch);
+            unsigned word = (unsigned) ch + 1;
+            unsigned dead_bit = ffs(window_[start_]);
+            unsigned dead_word = (unsigned) window_[start_] + 1;
+
+            state_.bytes_sum1_ += word - dead_word;
+            state_.bytes_sum2_ += state_.bytes_sum1_ - dead_word * segment_length_;
+            state_.bits_sum1_ += bit - dead_bit;
+            state_.bits_sum2_ += state_.bits_sum1_ - dead_bit * segment_length_;
+        }
+
+        window_[start_] = ch;
+
+        start_ = (start_ + 1) & (segment_length_ - 1);
+    }
+
+    /*
+     * Equivalent to calling roll() and mix() for each one of `count' bytes,
+     * which must not exceed the segment length.
+     */
+    void roll(const uint8_t *data, unsigned count, uint64_t *hashes) {
+        unsigned n;
 
 #ifndef NDEBUG
-        ASSERT("/xcodec/hash", length_ == XCODEC_SEGMENT_LENGTH);
+        ASSERT("/xcodec/hash", length_ == segment_length_);
 #endif
+        ASSERT("/xcodec/hash", count <= segment_length_);
+
+        /*
+         * Only the legacy family has bulk kernels.
+         */
+        if (family_ != XCODEC_HASH_FAMILY_LEGACY) {
+            for (n = 0; n < count; n++) {
+                roll(data[n]);
+                hashes[n] = mix();
+            }
+            return;
+        }
+
+        while (count > 0) {
+            n = segment_length_ - start_;
+            if (n > count)
+                n = count;
 
-        bytes_.roll(word, start_);
-        bits_.roll(bit, start_);
+            kernel_[index_](&state_, data, &window_[start_], n, hashes);
+            memcpy(&window_[start_], data, n);
 
-        start_ = (start_ + 1) % XCODEC_SEGMENT_LENGTH;
+            start_ = (start_ + n) & (segment_length_ - 1);
+            data += n;
+            hashes += n;
+            count -= n;
+        }
     }
 
     /*
@@ -146,22 +248,78 @@ public:
      */
     uint64_t mix(void) const {
 #ifndef NDEBUG
-        ASSERT("/xcodec/hash", length_ == XCODEC_SEGMENT_LENGTH);
+        ASSERT("/xcodec/hash", length_ == segment_length_);
 #endif
 
-        uint64_t bits_hash = (bits_.sum1_ << 16) + bits_.sum2_;
-        uint64_t bytes_hash = (bytes_.sum1_ << 20) + bytes_.sum2_;
+        if (family_ == XCODEC_HASH_FAMILY_POLYNOMIAL)
+            return (finish(polynomial_ ^ polynomial_key_));
+        return (mix(state_));
+    }
+
+    static uint64_t mix(const XCodecHashState &state) {
+        uint64_t bits_hash = (state.bits_sum1_ << 16) + state.bits_sum2_;
+        uint64_t bytes_hash = (state.bytes_sum1_ << 20) + state.bytes_sum2_;
         return ((bits_hash << 36) + bytes_hash);
     }
 
-    static uint64_t hash(const uint8_t *data) {
-        XCodecHash xchash;
-        unsigned i;
+    /*
+     * Arithmetic modulo XCODEC_HASH_POLYNOMIAL_PRIME, on values below it.
+     */
+    static uint64_t modular_add(uint64_t a, uint64_t b) {
+        uint64_t r = a + b;
+        return (r >= XCODEC_HASH_POLYNOMIAL_PRIME ? r - XCODEC_HASH_POLYNOMIAL_PRIME : r);
+    }
 
-        for (i = 0; i < XCODEC_SEGMENT_LENGTH; i++)
-            xchash.add(*data++);
-        return (xchash.mix());
+    static uint64_t modular_multiply(uint64_t a, uint64_t b) {
+        unsigned __int128 x = (unsigned __int128) a * b;
+        return (modular_add((uint64_t) x & XCODEC_HASH_POLYNOMIAL_PRIME, (uint64_t) (x >> 61)));
     }
+
+    /*
+     * The 64-bit finalizer of MurmurHash3, which is a bijection.
+     */
+    static uint64_t finish(uint64_t h) {
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdull;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ull;
+        h ^= h >> 33;
+        return (h);
+    }
+
+    /*
+     * Hash of a segment, or of a content-defined chunk, which may be
+     * shorter than a segment.
+     */
+    static uint64_t hash(unsigned family, const uint8_t *data, unsigned length) {
+        XCodecHash xchash(family);
+
+        xchash.add(data, length);
+        if (family == XCODEC_HASH_FAMILY_POLYNOMIAL)
+            return (finish(xchash.polynomial_ ^ polynomial_key_));
+        return (mix(xchash.state_));
+    }
+
+    /*
+     * Data whose hash is in use by other data goes by its hash tagged with
+     * a collision counter instead, the first one from 1 to XCODEC_TAG_MAX
+     * that is free.  The tagged names are as good as random, so they do not
+     * get in the way of the hashes of other data.
+     */
+    static uint64_t tag(uint64_t hash, unsigned count) {
+        if (count == 0)
+            return (hash);
+        return (hash ^ finish(count * 0x9e3779b97f4a7c15ull));
+    }
+
+    /*
+     * Place of a segment length among those supported, shortest first.
+     */
+    static unsigned length_index(unsigned segment_length) {
+        return (ffs(segment_length) - ffs(XCODEC_SEGMENT_LENGTH_MIN));
+    }
+
+    static const char *kernel_name(void);
 };
 
 #endif /* !XCODEC_XCODEC_HASH_H */
@@ -0,0 +1,168 @@
+////////////////////////////////////////////////////////////////////////////////
+//                                                                            //
+// File:           xcodec_hello.cc                                            //
+// Description:    parameters exchanged by the two sides in <HELLO>           //
+// Project:        WANProxy XTech                                             //
+// Last modified:  2026-10-18                                                 //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+
+#include "../common/buffer.h"
+#include "../common/endian.h"
+
+#include "./xcodec.h"
+#include "./xcodec_hello.h"
+
+static void
+xcodec_hello_put16(Buffer &buf, uint8_t type, unsigned value)
+{
+    uint8_t length = sizeof(uint16_t);
+    uint16_t bevalue = BigEndian::encode((uint16_t) value);
+
+    buf.append(type);
+    buf.append(length);
+    buf.append(&bevalue);
+}
+
+static void
+xcodec_hello_put32(Buffer &buf, uint8_t type, unsigned value)
+{
+    uint8_t length = sizeof(uint32_t);
+    uint32_t bevalue = BigEndian::encode((uint32_t) value);
+
+    buf.append(type);
+    buf.append(length);
+    buf.append(&bevalue);
+}
+
+/*
+ * Values are read as big-endian numbers of whatever length they come in, so
+ * that a later version can widen a parameter.
+ */
+static bool
+xcodec_hello_get(Buffer &buf, unsigned length, unsigned *valuep)
+{
+    uint64_t value = 0;
+    uint8_t byte = 0;
+
+    if (length == 0 || length > sizeof value)
+        return (false);
+    while (length-- > 0) {
+        buf.moveout(&byte, sizeof byte);
+        value = (value << 8) | byte;
+    }
+    *valuep = (value > 0xffffffffu ? 0xffffffffu : (unsigned) value);
+    return (true);
+}
+
+void XCodecHello::encode(Buffer &buf) const {
+    uint8_t version = version_;
+    uint8_t families = hash_families_;
+    uint8_t length = sizeof families;
+
+    buf.append(version);
+    xcodec_hello_put16(buf, XCODEC_HELLO_SEGMENT_LENGTH, segment_length_);
+    buf.append(XCODEC_HELLO_HASH_FAMILIES);
+    buf.append(length);
+    buf.append(families);
+    families = hash_family_;
+    buf.append(XCODEC_HELLO_HASH_FAMILY);
+    buf.append(length);
+    buf.append(families);
+    xcodec_hello_put32(buf, XCODEC_HELLO_FRAME_LIMIT, frame_limit_);
+    xcodec_hello_put32(buf, XCODEC_HELLO_WINDOW, window_);
+    xcodec_hello_put32(buf, XCODEC_HELLO_OPS, ops_);
+
+    if (!namespaces_.empty()) {
+        ASSERT("/xcodec/hello", namespaces_.size() <= XCODEC_HELLO_NAMESPACES_MAX);
+        length = namespaces_.size() * sizeof(uuid_t);
+        buf.append(XCODEC_HELLO_NAMESPACES);
+        buf.append(length);
+        for (std::vector<UUID>::const_iterator it = namespaces_.begin(); it != namespaces_.end(); ++it)
+            buf.append((const uint8_t *) &it->uuid_, sizeof(uuid_t));
+    }
+}
+
+bool XCodecHello::decode(Buffer &buf, unsigned length) {
+    uint8_t version = 0, type = 0, size = 0;
+
+    if (length < sizeof version || buf.length() < length)
+        return (false);
+    buf.moveout(&version, sizeof version);
+    length -= sizeof version;
+    if (version < 2)
+        return (false);
+    version_ = std::min<unsigned>(version, XCODEC_HELLO_VERSION);
+
+    while (length > 0) {
+        if (length < sizeof type + sizeof size)
+            return (false);
+        buf.moveout(&type, sizeof type);
+        buf.moveout(&size, sizeof size);
+        length -= sizeof type + sizeof size;
+        if (length < size)
+            return (false);
+        length -= size;
+
+        switch (type) {
+            case XCODEC_HELLO_SEGMENT_LENGTH:
+                if (!xcodec_hello_get(buf, size, &segment_length_))
+                    return (false);
+                break;
+            case XCODEC_HELLO_HASH_FAMILIES:
+                if (!xcodec_hello_get(buf, size, &hash_families_))
+                    return (false);
+                break;
+            case XCODEC_HELLO_FRAME_LIMIT:
+                if (!xcodec_hello_get(buf, size, &frame_limit_) || frame_limit_ == 0)
+                    return (false);
+                break;
+            case XCODEC_HELLO_WINDOW:
+                if (!xcodec_hello_get(buf, size, &window_))
+                    return (false);
+                break;
+            case XCODEC_HELLO_OPS:
+                if (!xcodec_hello_get(buf, size, &ops_))
+                    return (false);
+                break;
+            case XCODEC_HELLO_HASH_FAMILY:
+                if (!xcodec_hello_get(buf, size, &hash_family_))
+                    return (false);
+                break;
+            case XCODEC_HELLO_NAMESPACES:
+                if (size % sizeof(uuid_t) != 0 || size / sizeof(uuid_t) > XCODEC_HELLO_NAMESPACES_MAX)
+                    return (false);
+                namespaces_.resize(size / sizeof(uuid_t));
+                for (std::vector<UUID>::iterator it = namespaces_.begin(); it != namespaces_.end(); ++it)
+                    buf.moveout((uint8_t *) &it->uuid_, sizeof(uuid_t));
+                break;
+            default:
+                buf.skip(size);
+                break;
+        }
+    }
+
+    return (true);
+}
+
+bool XCodecHello::narrow(const XCodecHello &peer) {
+    if ((hash_families_ &= peer.hash_families_) == 0)
+        return (false);
+
+    version_ = std::min(version_, peer.version_);
+    frame_limit_ = std::min(frame_limit_, peer.frame_limit_);
+    window_ = std::min(window_, peer.window_);
+    ops_ &= peer.ops_;
+    return (true);
+}
+
+std::ostream &operator<<(std::ostream &os, const XCodecHello &hello) {
+    return (os << "version " << hello.version_ <<
+                  ", segment length " << hello.segment_length_ <<
+                  ", hash families 0x" << std::hex << hello.hash_families_ <<
+                  ", hash family 0x" << hello.hash_family_ <<
+                  ", ops 0x" << hello.ops_ << std::dec <<
+                  ", frame limit " << hello.frame_limit_ <<
+                  ", window " << hello.window_ <<
+                  ", " << hello.namespaces_.size() << " namespaces");
+}
@@ -0,0 +1,107 @@
+#ifndef    XCODEC_XCODEC_HELLO_H
+#define    XCODEC_XCODEC_HELLO_H
+
+#include <vector>
+
+#include "../common/uuid/uuid.h"
+
+////////////////////////////////////////////////////////////////////////////////
+//                                                                            //
+// File:           xcodec_hello.h                                             //
+// Description:    parameters exchanged by the two sides in <HELLO>           //
+// Project:        WANProxy XTech                                             //
+// Last modified:  2026-10-18                                                 //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+
+/*
+ * Version 1 is the <HELLO> of 3.0.x, which carries nothing but the UUID and
+ * the size of the cache.  From version 2 on these are followed by a version
+ * byte and a list of parameters, each of them as
+ *
+ * 	type[uint8_t] length[uint8_t] value[uint8_t x length]
+ *
+ * with numbers in big-endian order.  Parameters of unknown type are skipped,
+ * so that later versions can add to them, and those that are missing keep
+ * the value that a version 1 peer implies.
+ */
+#define    XCODEC_HELLO_VERSION    (2)
+
+#define    XCODEC_HELLO_SEGMENT_LENGTH    ((uint8_t)0x01)    /* uint16_t */
+#define    XCODEC_HELLO_HASH_FAMILIES    ((uint8_t)0x02)    /* uint8_t bitmap */
+#define    XCODEC_HELLO_FRAME_LIMIT    ((uint8_t)0x03)    /* uint32_t */
+#define    XCODEC_HELLO_WINDOW        ((uint8_t)0x04)    /* uint32_t */
+#define    XCODEC_HELLO_OPS        ((uint8_t)0x05)    /* uint32_t bitmap */
+#define    XCODEC_HELLO_HASH_FAMILY    ((uint8_t)0x06)    /* uint8_t */
+#define    XCODEC_HELLO_NAMESPACES    ((uint8_t)0x07)    /* uuid_t x count */
+
+/*
+ * Most caches of other sides listed in XCODEC_HELLO_NAMESPACES, which keeps
+ * the whole of <HELLO> within the length a byte can give.
+ */
+#define    XCODEC_HELLO_NAMESPACES_MAX    (8)
+
+/*
+ * Optional ops a side can decode.  Those produced by the encoder have the
+ * bits of the encoder options in xcodec.h.
+ */
+#define    XCODEC_HELLO_OP_FORGET    (0x0100)    /* Eviction notices.  */
+#define    XCODEC_HELLO_OP_PASS    (0x0200)    /* Frames encoded twice.  */
+#define    XCODEC_HELLO_OP_RAW    (0x0400)    /* Frames not encoded at all.  */
+#define    XCODEC_HELLO_OP_LARGE    (0x0800)    /* Frames with longer lengths.  */
+#define    XCODEC_HELLO_OP_PAUSE    (0x1000)    /* Flow control.  */
+
+#define    XCODEC_HELLO_OPS_ALL    (XCODEC_OPTION_CHUNKING | XCODEC_OPTION_RUNS | \
+                                 XCODEC_OPTION_DELTA | XCODEC_OPTION_SUPER | \
+                                 XCODEC_OPTION_PEER | XCODEC_OPTION_SHARED | \
+                                 XCODEC_HELLO_OP_FORGET | XCODEC_HELLO_OP_PASS | \
+                                 XCODEC_HELLO_OP_RAW | XCODEC_HELLO_OP_LARGE | \
+                                 XCODEC_HELLO_OP_PAUSE)
+
+struct XCodecHello {
+    unsigned version_;
+    unsigned segment_length_;
+    unsigned hash_families_;
+    unsigned hash_family_;
+    unsigned frame_limit_;
+    unsigned window_;
+    unsigned ops_;
+    std::vector<UUID> namespaces_;
+
+    /*
+     * What a 3.0.x peer supports.
+     */
+    XCodecHello(void)
+            : version_(1),
+              segment_length_(XCODEC_SEGMENT_LENGTH),
+              hash_families_(XCODEC_HASH_FAMILY_LEGACY),
+              hash_family_(XCODEC_HASH_FAMILY_LEGACY),
+              frame_limit_(32768),
+              window_(0),
+              ops_(0),
+              namespaces_() {}
+
+    /*
+     * Appends the version byte and the parameters.
+     */
+    void encode(Buffer &) const;
+
+    /*
+     * Takes the version byte and the parameters, `length' bytes in all,
+     * from the start of the buffer.  Returns false if they are malformed.
+     */
+    bool decode(Buffer &, unsigned);
+
+    /*
+     * Brings each parameter down to what the peer also supports.  Returns
+     * false if the two sides have nothing in common for some parameter.
+     * The hash family segments are named by, the length they are cut to
+     * and the caches of other sides held are up to each side and are left
+     * alone.
+     */
+    bool narrow(const XCodecHello &);
+};
+
+std::ostream &operator<<(std::ostream &, const XCodecHello &);
+
+#endif /* !XCODEC_XCODEC_HELLO_H */
@@ -0,0 +1,118 @@
+#ifndef    XCODEC_XCODEC_HISTORY_H
+#define    XCODEC_XCODEC_HISTORY_H
+
+#include <map>
+#include <vector>
+
+#include "./xcodec_cache.h"
+
+////////////////////////////////////////////////////////////////////////////////
+//                                                                            //
+// File:           xcodec_history.h                                           //
+// Description:    order of the segments seen in an xcodec stream             //
+// Project:        WANProxy XTech                                             //
+// Last modified:  2026-10-18                                                 //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+
+/*
+ * Number of segments after which the history is started again, bounding the
+ * memory taken by each stream.
+ */
+#define    XCODEC_HISTORY_LIMIT    16384
+
+/*
+ * Remembers which segment followed which in a stream, so that <REF_RUN> can
+ * name a run of segments by the first one.  The encoder and the decoder of a
+ * stream note every segment declared or referenced in the same order, which
+ * keeps both histories the same without sending anything about them.
+ */
+class XCodecHistory {
+    typedef __gnu_cxx::hash_map<Hash64, uint64_t> link_map_t;
+    link_map_t successor_;
+    link_map_t predecessor_;
+    uint64_t last_;
+    bool has_last_;
+    unsigned count_;
+
+public:
+    XCodecHistory(void)
+            : successor_(),
+              predecessor_(),
+              last_(0),
+              has_last_(false),
+              count_(0) {}
+
+    ~XCodecHistory() {}
+
+    void note(const uint64_t &hash) {
+        if (count_ >= XCODEC_HISTORY_LIMIT) {
+            successor_.clear();
+            predecessor_.clear();
+            count_ = 0;
+        }
+        if (has_last_) {
+            successor_[last_] = hash;
+            predecessor_[hash] = last_;
+        }
+        last_ = hash;
+        has_last_ = true;
+        count_++;
+    }
+
+    bool successor(const uint64_t &hash, uint64_t *nextp) const {
+        link_map_t::const_iterator it = successor_.find(hash);
+        if (it == successor_.end())
+            return (false);
+        *nextp = it->second;
+        return (true);
+    }
+
+    bool predecessor(const uint64_t &hash, uint64_t *prevp) const {
+        link_map_t::const_iterator it = predecessor_.find(hash);
+        if (it == predecessor_.end())
+            return (false);
+        *prevp = it->second;
+        return (true);
+    }
+
+    /*
+     * Works out the `count' segments of a run starting at `hash' as they
+     * would be found by noting each one and then taking its successor,
+     * without noting them, so that a run can be put off until all of its
+     * segments are at hand.
+     */
+    bool follow(uint64_t hash, unsigned count, std::vector<uint64_t> &run) const {
+        std::map<uint64_t, uint64_t> noted;
+        std::map<uint64_t, uint64_t>::const_iterator it;
+        uint64_t last = last_;
+        bool has_last = has_last_, cleared = false;
+        unsigned n = count_;
+
+        run.clear();
+        for (;;) {
+            run.push_back(hash);
+
+            if (n >= XCODEC_HISTORY_LIMIT) {
+                noted.clear();
+                cleared = true;
+                n = 0;
+            }
+            if (has_last)
+                noted[last] = hash;
+            last = hash;
+            has_last = true;
+            n++;
+
+            if (run.size() == count)
+                return (true);
+
+            if ((it = noted.find(hash)) != noted.end())
+                hash = it->second;
+            else if (cleared || !successor(hash, &hash))
+                return (false);
+        }
+    }
+};
+
+#endif /* !XCODEC_XCODEC_HISTORY_H */
@@ -0,0 +1,313 @@
+#ifndef    XCODEC_XCODEC_INDEX_H
+#define    XCODEC_XCODEC_INDEX_H
+
+#include <algorithm>
+#include <vector>
+
+#if defined(__SSE2__)
+#define    USING_XCODEC_INDEX_SSE2
+#include <emmintrin.h>
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+//                                                                            //
+// File:           xcodec_index.h                                             //
+// Description:    flat hash table from segment hashes to cache entries       //
+// Project:        WANProxy XTech                                             //
+// Last modified:  2026-10-18                                                 //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+
+#define    XCODEC_INDEX_GROUP        16    /* slots probed at once */
+#define    XCODEC_INDEX_MIN_GROUPS    4
+
+/*
+ * Open-addressing table with the entries in one array, rather than a node
+ * each as in a hash_map, so that a slot costs the hash and the value and a
+ * byte more.  The slots are in groups of sixteen, with a control byte each
+ * holding seven bits of the mixed hash of the entry in the slot, kept in an
+ * array of their own, and a probe matches the bits against the sixteen
+ * control bytes of a group at once, with SSE2 where there is, before
+ * comparing any hash.  Groups are probed in order from the one the hash
+ * picks, up to one that has an empty slot.  Any number of groups will do,
+ * so a table is no larger than it is asked to be.
+ *
+ * An entry erased from a group with no empty slot is marked deleted, as a
+ * probe may have gone past the group, and is counted as taken until the
+ * table is rebuilt.  It is rebuilt once seven eighths of the slots are
+ * taken, the same size if what was reserved still holds the entries, and
+ * otherwise half as large again as needed.  A table is built with a
+ * quarter of its slots spare, so that deleted entries take long to fill
+ * them.  Entries only move when it is rebuilt, so that iterators and
+ * pointers to values hold across erasures, but not across insertions.
+ */
+template<typename T>
+class XCodecIndex {
+public:
+    struct Slot {
+        uint64_t first;
+        T second;
+    };
+
+    class iterator {
+        XCodecIndex *index_;
+        size_t i_;
+
+        friend class XCodecIndex;
+
+        iterator(XCodecIndex *index, size_t i)
+                : index_(index),
+                  i_(i) {
+            skip();
+        }
+
+        void skip(void) {
+            while (i_ < index_->slots_.size() && !full(index_->ctrl_[i_]))
+                i_++;
+        }
+
+    public:
+        Slot *operator->() const {
+            return (&index_->slots_[i_]);
+        }
+
+        iterator &operator++() {
+            i_++;
+            skip();
+            return (*this);
+        }
+
+        bool operator==(const iterator &it) const {
+            return (i_ == it.i_);
+        }
+
+        bool operator!=(const iterator &it) const {
+            return (i_ != it.i_);
+        }
+    };
+
+private:
+    enum {
+        empty_ = 0x80,
+        deleted_ = 0xfe
+    };
+
+    std::vector<uint8_t> ctrl_;
+    std::vector<Slot> slots_;
+    size_t groups_;
+    size_t size_;
+    size_t used_;
+    size_t reserved_;
+    unsigned rebuilds_;
+
+public:
+    XCodecIndex(void)
+            : ctrl_(),
+              slots_(),
+              groups_(0),
+              size_(0),
+              used_(0),
+              reserved_(0),
+              rebuilds_(0) {}
+
+    ~XCodecIndex() {}
+
+    T *find(const uint64_t &hash) {
+        size_t i = locate(hash);
+        return (i < slots_.size() ? &slots_[i].second : 0);
+    }
+
+    /*
+     * Returns the value of the entry for `hash', which is added with a
+     * value of T() if there is none.
+     */
+    T &insert(const uint64_t &hash) {
+        uint64_t m = mix(hash);
+        size_t i, g;
+        unsigned bits;
+
+        if ((i = locate(hash)) < slots_.size())
+            return (slots_[i].second);
+
+        if ((used_ + 1) * 8 > slots_.size() * 7)
+            rehash(size_ + 1 <= reserved_ ? reserved_ : (size_ + 1) * 3 / 2);
+
+        for (g = group(m); ; g = (g + 1 == groups_ ? 0 : g + 1)) {
+            if ((bits = match(g, empty_) | match(g, deleted_)) != 0)
+                break;
+        }
+        i = g * XCODEC_INDEX_GROUP + __builtin_ctz(bits);
+        if (ctrl_[i] == empty_)
+            used_++;
+        size_++;
+        ctrl_[i] = m & 0x7f;
+        slots_[i].first = hash;
+        slots_[i].second = T();
+        return (slots_[i].second);
+    }
+
+    bool erase(const uint64_t &hash) {
+        size_t i = locate(hash);
+
+        if (i >= slots_.size())
+            return (false);
+        erase(iterator(this, i));
+        return (true);
+    }
+
+    void erase(const iterator &it) {
+        size_t i = it.i_;
+
+        if (match(i / XCODEC_INDEX_GROUP, empty_) != 0) {
+            ctrl_[i] = empty_;
+            used_--;
+        } else {
+            ctrl_[i] = deleted_;
+        }
+        size_--;
+    }
+
+    /*
+     * Erases every entry, keeping the slots.
+     */
+    void clear(void) {
+        std::fill(ctrl_.begin(), ctrl_.end(), (uint8_t) empty_);
+        size_ = used_ = 0;
+    }
+
+    /*
+     * Makes room for `count' entries in all, so that they go in without
+     * the table being rebuilt, and the table does not grow until there are
+     * more.
+     */
+    void reserve(size_t count) {
+        if (count > reserved_)
+            reserved_ = count;
+        if (count * 4 > slots_.size() * 3)
+            rehash(count);
+    }
+
+    size_t size(void) const {
+        return (size_);
+    }
+
+    /*
+     * For going through the table a part at a time: the number of slots,
+     * the hash of the entry in slot `i' if there is one, and how many times
+     * the table has been rebuilt, which moves the entries.
+     */
+    size_t slots(void) const {
+        return (slots_.size());
+    }
+
+    bool hash_at(size_t i, uint64_t *hashp) const {
+        if (!full(ctrl_[i]))
+            return (false);
+        *hashp = slots_[i].first;
+        return (true);
+    }
+
+    unsigned rebuilds(void) const {
+        return (rebuilds_);
+    }
+
+    iterator begin(void) {
+        return (iterator(this, 0));
+    }
+
+    iterator end(void) {
+        return (iterator(this, slots_.size()));
+    }
+
+private:
+    static bool full(uint8_t ctrl) {
+        return ((ctrl & 0x80) == 0);
+    }
+
+    /*
+     * As for the Bloom filter, the rolling hashes are mixed before the
+     * group and the control bits are taken from them.
+     */
+    static uint64_t mix(uint64_t hash) {
+        hash ^= hash >> 33;
+        hash *= 0xff51afd7ed558ccdull;
+        hash ^= hash >> 33;
+        hash *= 0xc4ceb9fe1a85ec53ull;
+        hash ^= hash >> 33;
+        return (hash);
+    }
+
+    /*
+     * The group the mixed hash `m' picks, by its top bits, as the control
+     * bits are its lowest.
+     */
+    size_t group(uint64_t m) const {
+        return (((m >> 32) * groups_) >> 32);
+    }
+
+    /*
+     * A bit for each control byte of group `g' equal to `ctrl'.
+     */
+    unsigned match(size_t g, uint8_t ctrl) const {
+        const uint8_t *p = &ctrl_[g * XCODEC_INDEX_GROUP];
+#ifdef USING_XCODEC_INDEX_SSE2
+        __m128i group = _mm_loadu_si128((const __m128i *) p);
+        return (_mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8((char) ctrl))));
+#else
+        unsigned bits = 0;
+        for (unsigned i = 0; i < XCODEC_INDEX_GROUP; i++)
+            if (p[i] == ctrl)
+                bits |= 1u << i;
+        return (bits);
+#endif
+    }
+
+    /*
+     * The slot of the entry for `hash', or the number of slots if there
+     * is none.  There is always a group with an empty slot to end on.
+     */
+    size_t locate(const uint64_t &hash) const {
+        uint64_t m = mix(hash);
+        size_t i, g;
+        unsigned bits;
+
+        if (groups_ == 0)
+            return (0);
+
+        for (g = group(m); ; g = (g + 1 == groups_ ? 0 : g + 1)) {
+            for (bits = match(g, m & 0x7f); bits != 0; bits &= bits - 1) {
+                i = g * XCODEC_INDEX_GROUP + __builtin_ctz(bits);
+                if (slots_[i].first == hash)
+                    return (i);
+            }
+            if (match(g, empty_) != 0)
+                return (slots_.size());
+        }
+    }
+
+    /*
+     * Builds the table again with room for `count' entries in three
+     * quarters of the slots, leaving out those deleted.
+     */
+    void rehash(size_t count) {
+        std::vector<uint8_t> ctrl;
+        std::vector<Slot> slots;
+        size_t groups = std::max<size_t>((count * 4 / 3 + XCODEC_INDEX_GROUP - 1) / XCODEC_INDEX_GROUP,
+                                         XCODEC_INDEX_MIN_GROUPS);
+        size_t i;
+
+        ctrl_.swap(ctrl);
+        slots_.swap(slots);
+        ctrl_.assign(groups * XCODEC_INDEX_GROUP, empty_);
+        slots_.resize(groups * XCODEC_INDEX_GROUP);
+        groups_ = groups;
+        size_ = used_ = 0;
+        rebuilds_++;
+
+        for (i = 0; i < slots.size(); i++)
+            if (full(ctrl[i]))
+                insert(slots[i].first) = slots[i].second;
+    }
+};
+
+#endif /* !XCODEC_XCODEC_INDEX_H */
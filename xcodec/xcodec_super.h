@@ -0,0 +1,83 @@
+#ifndef    XCODEC_XCODEC_SUPER_H
+#define    XCODEC_XCODEC_SUPER_H
+
+#include <vector>
+
+#include "./xcodec_cache.h"
+#include "./xcodec_fingerprint.h"
+
+////////////////////////////////////////////////////////////////////////////////
+//                                                                            //
+// File:           xcodec_super.h                                             //
+// Description:    sequences of segments recorded for the xcodec protocol     //
+// Project:        WANProxy XTech                                             //
+// Last modified:  2026-10-18                                                 //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+
+/*
+ * A superchunk is a sequence of segments as they were declared or referenced
+ * in a stream, ended after a segment whose hash has the low bits of the mask
+ * clear, so that about one in 64 does, or once it is as long as it may be.
+ * The same data sent again is cut the same way, in any stream, and a part of
+ * it can then be referenced by the name of the sequence.
+ */
+#define    XCODEC_SUPER_MASK    (0x3f)
+#define    XCODEC_SUPER_MIN    (4)
+#define    XCODEC_SUPER_MAX    (256)
+
+/*
+ * The cache may let go of a superchunk while a stream still references it,
+ * so the encoder of each stream keeps the last superchunks it referenced to
+ * answer <ASK_SUPER> with, however the cache has changed since.
+ */
+#define    XCODEC_SUPER_SENT    (1024)
+
+/*
+ * Cuts the segments noted in a stream into superchunks and records them in a
+ * cache.  The encoder and the decoder of a stream note the same segments in
+ * the same order, so both record the same superchunks without sending
+ * anything about them.
+ */
+class XCodecSuperBuilder {
+    XCodecCache *cache_;
+    bool indexed_;
+    std::vector<uint64_t> hashes_;
+
+public:
+    /*
+     * The encoder also indexes the segments of each superchunk, so as to
+     * find one that data it is encoding could be a part of.
+     */
+    XCodecSuperBuilder(XCodecCache *cache, bool indexed)
+            : cache_(cache),
+              indexed_(indexed),
+              hashes_() {}
+
+    ~XCodecSuperBuilder() {}
+
+    void note(const uint64_t &hash) {
+        hashes_.push_back(hash);
+        if ((hash & XCODEC_SUPER_MASK) != 0 && hashes_.size() < XCODEC_SUPER_MAX)
+            return;
+
+        if (hashes_.size() >= XCODEC_SUPER_MIN)
+            cache_->record(name(hashes_), hashes_, indexed_);
+        hashes_.clear();
+    }
+
+    /*
+     * The name of a superchunk is the fingerprint of the hashes of its
+     * segments in network byte order.
+     */
+    static uint64_t name(const std::vector<uint64_t> &hashes) {
+        std::vector<uint64_t> behashes(hashes.size());
+        unsigned i;
+
+        for (i = 0; i < hashes.size(); i++)
+            behashes[i] = BigEndian::encode(hashes[i]);
+        return (XCodecFingerprint::compute((const uint8_t *) &behashes[0], behashes.size() * sizeof behashes[0]));
+    }
+};
+
+#endif /* !XCODEC_XCODEC_SUPER_H */
@@ -0,0 +1,114 @@
+#ifndef    XCODEC_XCODEC_WINDOW_H
+#define    XCODEC_XCODEC_WINDOW_H
+
+#include "../common/buffer.h"
+#include "./xcodec_cache.h"
+
+////////////////////////////////////////////////////////////////////////////////
+//                                                                            //
+// File:           xcodec_window.h                                            //
+// Description:    segments recently seen in an xcodec stream                 //
+// Project:        WANProxy XTech                                             //
+// Last modified:  2026-10-18                                                 //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+
+/*
+ * Number of segments a <BACKREF> can reach, which is as many as its index
+ * can tell apart.
+ */
+#define    XCODEC_BACKREF_WINDOW    256
+
+/*
+ * The last segments declared or referenced in a stream, noted at the same
+ * points and in the same order as the history, so that the encoder and the
+ * decoder of a stream agree on them without sending anything about them.
+ * Unlike the window of recent lookups in XCodecCache, which is shared by
+ * every stream using the cache, this one belongs to a single stream.
+ *
+ * The decoder also keeps the data of each segment here when it has it,
+ * which spares it a cache lookup for segments referenced again soon.
+ */
+class XCodecWindow {
+    typedef __gnu_cxx::hash_map<Hash64, uint64_t> serial_map_t;
+    uint64_t hash_[XCODEC_BACKREF_WINDOW];
+    Buffer data_[XCODEC_BACKREF_WINDOW];
+    serial_map_t serial_;
+    uint64_t next_;
+
+public:
+    XCodecWindow(void)
+            : serial_(),
+              next_(0) {
+        memset(hash_, 0, sizeof hash_);
+    }
+
+    ~XCodecWindow() {}
+
+    void note(const uint64_t &hash) {
+        unsigned slot = next_ % XCODEC_BACKREF_WINDOW;
+
+        if (next_ >= XCODEC_BACKREF_WINDOW) {
+            serial_map_t::iterator it = serial_.find(hash_[slot]);
+            if (it != serial_.end() && it->second == next_ - XCODEC_BACKREF_WINDOW)
+                serial_.erase(it);
+        }
+        hash_[slot] = hash;
+        data_[slot].clear();
+        serial_[hash] = next_++;
+    }
+
+    void note(const uint64_t &hash, const Buffer &data) {
+        note(hash);
+        data_[(next_ - 1) % XCODEC_BACKREF_WINDOW].append(data);
+    }
+
+    /*
+     * Index of the latest time the segment was noted, counting back from
+     * the last segment noted, which is at index 0.
+     */
+    bool find(const uint64_t &hash, unsigned *indexp) const {
+        serial_map_t::const_iterator it = serial_.find(hash);
+        if (it == serial_.end())
+            return (false);
+        *indexp = next_ - 1 - it->second;
+        return (true);
+    }
+
+    bool at(unsigned index, uint64_t *hashp) const {
+        if (index >= XCODEC_BACKREF_WINDOW || index >= next_)
+            return (false);
+        *hashp = hash_[(next_ - 1 - index) % XCODEC_BACKREF_WINDOW];
+        return (true);
+    }
+
+    /*
+     * Keeps the data of a segment noted without it, once it is found.
+     */
+    void fill(const uint64_t &hash, const Buffer &buf) {
+        unsigned index;
+
+        if (!find(hash, &index))
+            return;
+        Buffer &data = data_[(next_ - 1 - index) % XCODEC_BACKREF_WINDOW];
+        if (data.empty())
+            data.append(buf);
+    }
+
+    /*
+     * Appends the data of the segment if it is in the window with its data.
+     */
+    bool recall(const uint64_t &hash, Buffer &buf) const {
+        unsigned index;
+
+        if (!find(hash, &index))
+            return (false);
+        const Buffer &data = data_[(next_ - 1 - index) % XCODEC_BACKREF_WINDOW];
+        if (data.empty())
+            return (false);
+        buf.append(data);
+        return (true);
+    }
+};
+
+#endif /* !XCODEC_XCODEC_WINDOW_H */
@@ -8,6 +8,7 @@
 //                                                                            //
 ////////////////////////////////////////////////////////////////////////////////
 
+#include "../common/count_filter.h"
 #include "./zlib_filter.h"
 
 // Deflate
@@ -20,6 +21,7 @@ DeflateFilter::DeflateFilter(int level) : BufferedFilter("/zlib/deflate") {
     stream_.avail_in = 0;
     stream_.next_out = outbuf;
     stream_.avail_out = sizeof outbuf;
+    level_ = current_level_ = level;
 
     if (deflateInit (&stream_, level) != Z_OK)
         CRITICAL(log_) << "Could not initialize deflate stream.";
@@ -37,6 +39,12 @@ bool DeflateFilter::consume(Buffer &buf, int flg) {
     for (Buffer::SegmentIterator it = buf.segments(); !it.end(); it.next(), ++cnt);
     pending_.clear();
 
+    /*
+     * Data that the encoder has found incompressible is only stored.
+     */
+    if (!set_level(flg & INCOMPRESSIBLE ? 0 : level_))
+        return false;
+
     for (Buffer::SegmentIterator it = buf.segments(); !it.end(); it.next(), ++i) {
         seg = *it;
         stream_.next_in = (Bytef *) (uintptr_t) seg->data();
@@ -77,6 +85,32 @@ void DeflateFilter::flush(int flg) {
     Filter::flush(flg);
 }
 
+/*
+ * Changing the level ends the current deflate block, which goes out with the
+ * data that follows.  Should zlib be unable to end it yet, the level is left
+ * as it is until the next call.
+ */
+bool DeflateFilter::set_level(int level) {
+    int rv;
+
+    if (level == current_level_)
+        return true;
+
+    rv = deflateParams(&stream_, level, Z_DEFAULT_STRATEGY);
+    if (rv != Z_OK && rv != Z_BUF_ERROR) {
+        ERROR(log_) << "deflateParams(): " << zError(rv);
+        return false;
+    }
+    if (stream_.avail_out < sizeof outbuf) {
+        pending_.append(outbuf, sizeof outbuf - stream_.avail_out);
+        stream_.next_out = outbuf;
+        stream_.avail_out = sizeof outbuf;
+    }
+    if (rv == Z_OK)
+        current_level_ = level;
+    return true;
+}
+
 // Inflate
 
 InflateFilter::InflateFilter() : BufferedFilter("/zlib/inflate") {
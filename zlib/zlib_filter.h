@@ -21,6 +21,8 @@ class DeflateFilter : public BufferedFilter {
 private:
     z_stream stream_;
     uint8_t outbuf[DEFLATE_CHUNK_SIZE];
+    int level_;
+    int current_level_;
 
 public:
     DeflateFilter(int level = 0);
@@ -30,6 +32,9 @@ public:
     virtual bool consume(Buffer &buf, int flg = 0);
 
     virtual void flush(int flg);
+
+private:
+    bool set_level(int level);
 };
 
 class InflateFilter : public BufferedFilter {